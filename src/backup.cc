@@ -0,0 +1,168 @@
+#include "backup.h"
+#include "context.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+
+#include "rfl/json/read.hpp"
+#include "rfl/json/write.hpp"
+#include "ylt/easylog.hpp"
+
+namespace tgdb {
+static constexpr std::string_view vector_index_path = "vector_db.faiss";
+
+static std::filesystem::path snapshot_dir(const std::string &backup_dir,
+                                          uint32_t id) {
+  return std::filesystem::path(backup_dir) / "snapshots" / std::to_string(id);
+}
+
+// Drops the snapshot directories of backups purged from the engines.
+static void prune_snapshots(const config::backup_config_t &backup_cfg) {
+  auto snapshots = std::filesystem::path(backup_cfg.directory) / "snapshots";
+  if (!backup_cfg.keep || !std::filesystem::exists(snapshots)) {
+    return;
+  }
+
+  std::vector<uint32_t> ids;
+  for (auto &entry : std::filesystem::directory_iterator(snapshots)) {
+    ids.push_back(std::stoul(entry.path().filename().string()));
+  }
+  std::ranges::sort(ids, std::greater<>());
+  for (size_t i = backup_cfg.keep; i < ids.size(); ++i) {
+    std::error_code ec;
+    std::filesystem::remove_all(snapshot_dir(backup_cfg.directory, ids[i]), ec);
+  }
+}
+
+std::expected<backup_manifest, std::string> create_backup(context &ctx) {
+  auto &backup_cfg = ctx.cfg.backup_config;
+  auto backup_dir = std::filesystem::path(backup_cfg.directory);
+
+  auto message_backup = ctx.message_db.backup(
+      (backup_dir / "message_db").string(), backup_cfg.keep);
+  if (!message_backup) {
+    return std::unexpected("message_db: " + message_backup.error());
+  }
+  auto user_backup = ctx.users.user_db.backup(
+      (backup_dir / "user_db").string(), backup_cfg.keep);
+  if (!user_backup) {
+    return std::unexpected("user_db: " + user_backup.error());
+  }
+
+  backup_manifest manifest{
+      .id = *message_backup,
+      .created_at = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count(),
+      .message_backup_id = *message_backup,
+      .user_backup_id = *user_backup,
+  };
+
+  auto dir = snapshot_dir(backup_cfg.directory, manifest.id);
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  if (ec) {
+    return std::unexpected(std::format("Failed to create {}: {}", dir.string(),
+                                       ec.message()));
+  }
+
+  if (ctx.vector_db_service_) {
+    // Messages in the database backups may still be waiting for their
+    // embeddings, which have to be in the saved index
+    constexpr auto embedding_timeout = std::chrono::minutes(5);
+    if (!ctx.indexer.wait_for_embeddings(embedding_timeout)) {
+      ELOGFMT(WARNING,
+              "Embeddings still pending after {} minutes, backup {} may "
+              "lack the vectors of some messages",
+              embedding_timeout.count(), manifest.id);
+    }
+    // Each modality is saved under its index lock, so it is a point-in-time
+    // copy
+    manifest.vector_index = (dir / vector_index_path).string();
+    if (!ctx.vector_db_service_->Save(manifest.vector_index)) {
+      return std::unexpected<std::string>("Failed to save vector index");
+    }
+  }
+
+  std::ofstream(dir / "manifest.json") << rfl::json::write(manifest);
+  prune_snapshots(backup_cfg);
+
+  ELOGFMT(INFO, "Backup {} created in {}", manifest.id, dir.string());
+  return manifest;
+}
+
+std::expected<backup_manifest, std::string>
+restore_backup(const config::backup_config_t &backup_cfg,
+               std::optional<uint32_t> id) {
+  auto backup_dir = std::filesystem::path(backup_cfg.directory);
+
+  if (!id) {
+    auto snapshots = backup_dir / "snapshots";
+    if (!std::filesystem::exists(snapshots)) {
+      return std::unexpected("No backups in " + backup_dir.string());
+    }
+    for (auto &entry : std::filesystem::directory_iterator(snapshots)) {
+      auto snapshot_id =
+          static_cast<uint32_t>(std::stoul(entry.path().filename().string()));
+      id = std::max(id.value_or(0), snapshot_id);
+    }
+  }
+
+  auto dir = snapshot_dir(backup_cfg.directory, id.value_or(0));
+  std::ifstream ifs(dir / "manifest.json");
+  if (!ifs) {
+    return std::unexpected("Missing manifest in " + dir.string());
+  }
+  std::string json((std::istreambuf_iterator<char>(ifs)),
+                   std::istreambuf_iterator<char>());
+  auto manifest = rfl::json::read<backup_manifest>(json);
+  if (!manifest) {
+    return std::unexpected(std::string("Invalid manifest: ") +
+                           manifest.error().what());
+  }
+
+  if (auto res = kvdb::restore_backup((backup_dir / "message_db").string(),
+                                      "message_db",
+                                      manifest->message_backup_id);
+      !res) {
+    return std::unexpected("message_db: " + res.error());
+  }
+  if (auto res = kvdb::restore_backup((backup_dir / "user_db").string(),
+                                      "user_db", manifest->user_backup_id);
+      !res) {
+    return std::unexpected("user_db: " + res.error());
+  }
+
+  if (!manifest->vector_index.empty()) {
+    // The restored index replaces the current one with its logs, which do
+    // not apply to it, and any modality the backup lacks
+    for (auto &entry : std::filesystem::directory_iterator(".")) {
+      if (entry.path().filename().string().starts_with(vector_index_path)) {
+        std::error_code ec;
+        std::filesystem::remove(entry.path(), ec);
+      }
+    }
+    // Every file the index was saved as, e.g. vector_db.faiss.text.1.vectors
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+      auto name = entry.path().filename().string();
+      if (!name.starts_with(vector_index_path)) {
+        continue;
+      }
+      std::error_code ec;
+      std::filesystem::copy_file(
+          entry.path(), name,
+          std::filesystem::copy_options::overwrite_existing, ec);
+      if (ec) {
+        return std::unexpected(
+            std::format("Failed to restore {}: {}", name, ec.message()));
+      }
+    }
+  }
+
+  ELOGFMT(INFO, "Restored backup {} from {}", manifest->id, dir.string());
+  return std::move(manifest.value());
+}
+} // namespace tgdb
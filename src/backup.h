@@ -0,0 +1,35 @@
+#pragma once
+#include "config.h"
+
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <string>
+
+namespace tgdb {
+struct context;
+
+// Describes one online backup. message_db and user_db go to incremental
+// RocksDB backup engines under the backup directory, the vector index is
+// copied next to the manifest in snapshots/<id>/.
+struct backup_manifest {
+  uint32_t id;
+  int64_t created_at;
+  uint32_t message_backup_id;
+  uint32_t user_backup_id;
+  std::string vector_index;
+};
+
+// Backs up message_db, user_db and the vector index while the bot keeps
+// running. The databases are backed up first, the vector index is saved once
+// the embeddings of every message in them were generated. So each message in
+// the backup has its vectors in the saved index, unless embedding it failed,
+// and restoring does not require re-embedding.
+std::expected<backup_manifest, std::string> create_backup(context &ctx);
+
+// Brings message_db, user_db and the vector index back from a backup, the
+// latest one unless `id` is given. Must run before they are opened.
+std::expected<backup_manifest, std::string>
+restore_backup(const config::backup_config_t &backup_cfg,
+               std::optional<uint32_t> id = std::nullopt);
+} // namespace tgdb
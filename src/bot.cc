@@ -1,12 +1,14 @@
 #include "bot.h"
 #include "async_simple/coro/Lazy.h"
 #include "cinatra/ylt/coro_io/io_context_pool.hpp"
+#include "backup.h"
 #include "context.h"
 #include "td/telegram/td_api.h"
 #include "utf8.h"
 #include "utils.h"
 #include "ylt/coro_http/coro_http_client.hpp"
 #include "ylt/easylog.hpp"
+#include <algorithm>
 #include <chrono>
 #include <format>
 #include <thread>
@@ -58,6 +60,7 @@ void bot::process_update(int client_id,
                     },
                     [this](td_api::authorizationStateReady &update) {
                       ELOGFMT(INFO, "Bot logged in successfully");
+                      run_migrations().start([](auto &&) {});
 
                       if (ctx.cfg.chat_id != 0) {
                         std::thread([this]() {
@@ -203,16 +206,29 @@ void bot::process_update(int client_id,
                             ctx.message_db.get(std::to_string(td_message->id_));
                         if (db_message && mode.contains("db")) {
                           info_text +=
-                              "Indexed content:\n" + db_message->to_string();
+                              "Indexed content:\n" + db_message->to_string() +
+                              "\nSender: " +
+                              ctx.users.resolve(db_message->sender_id).to_string();
                         } else {
                           info_text += "Not indexed";
                         }
 
-                        // Check if message is in vector database
-                        if (ctx.vector_db_service_->Exists(std::to_string(td_message->id_))) {
-                            auto vector_data = ctx.vector_db_service_->GetVector(std::to_string(td_message->id_));
-                            if (!vector_data.empty()) {
-                                info_text += "\n\nVector data (first 100 chars):\n";
+                        // Vectors are keyed by message id in the index of
+                        // each embedding type
+                        auto vector_key = static_cast<VectorKey>(td_message->id_);
+                        if (ctx.vector_db_service_ &&
+                            ctx.vector_db_service_->Exists(vector_key)) {
+                            for (auto [type, name] :
+                                 {std::pair{EmbeddingType::Text, "Text"},
+                                  std::pair{EmbeddingType::Image, "Image"}}) {
+                                auto vector_data =
+                                    (*ctx.vector_db_service_)[static_cast<size_t>(type)]
+                                        .GetVector(vector_key);
+                                if (vector_data.empty()) {
+                                    continue;
+                                }
+                                info_text += std::format(
+                                    "\n\n{} vector data (first 100 values):\n", name);
                                 // Convert vector<float> to string representation
                                 std::string vector_str = "[";
                                 for (size_t i = 0; i < std::min((size_t)100, vector_data.size()); ++i) {
@@ -223,8 +239,6 @@ void bot::process_update(int client_id,
                                 }
                                 vector_str += "]";
                                 info_text += vector_str;
-                            } else {
-                                info_text += "\n\nFailed to retrieve vector data";
                             }
                         } else {
                             info_text += "\n\nNot in vector database";
@@ -253,6 +267,9 @@ void bot::process_update(int client_id,
               } else if (content == "/upgradedatabase") {
                 handle_upgrade_database_command(update.message_->chat_id_)
                     .start([](auto &&) {});
+              } else if (content == "/backup") {
+                handle_backup_command(update.message_->chat_id_)
+                    .start([](auto &&) {});
               }
             }
 
@@ -311,11 +328,6 @@ void bot::process_update(int client_id,
             answer->cache_time_ = 0;
             answer->is_personal_ = true;
 
-            auto offset =
-                update.offset_.size() ? std::stoull(update.offset_) : 0;
-
-            int counter = 0;
-
             if (use_ai_search) {
 
               auto handle_vector_results =
@@ -331,10 +343,12 @@ void bot::process_update(int client_id,
                       td_api::inputInlineQueryResultArticle>();
                   article_result->id_ = std::to_string(message.message_id);
                   article_result->title_ =
-                      message.sender.nickname + " (AI Search)";
+                      ctx.users.resolve(message.sender_id).nickname +
+                      " (AI Search)";
 
                   std::string content_str;
-                  for (auto &[key, value_str] : message.textifyed_contents) {
+                  for (const auto &[kind, value_str] :
+                       message.textifyed_contents.entries()) {
                     if (!value_str.empty()) {
                       if (content_str.size() > 0)
                         content_str += "\n";
@@ -420,183 +434,61 @@ void bot::process_update(int client_id,
               return;
             }
 
-            for (auto &[msgid, message] : ctx.message_db) {
-              counter++;
-
-              if (counter < offset) {
-                continue;
-              }
-
-              if (message.textifyed_contents.size() == 0 ||
-                  std::ranges::none_of(message.textifyed_contents,
-                                       [&](auto &pair) {
-                                         return pair.second.contains(query_str);
-                                       })) {
-                continue;
-              }
-
-              auto result =
-                  td_api::make_object<td_api::inputInlineQueryResultArticle>();
-              result->id_ = std::to_string(message.message_id);
-              result->title_ = message.sender.nickname;
-
-              std::string content_str;
-
-              for (auto &[key, _value_str] : message.textifyed_contents) {
-
-                size_t found_byte_offset_in_value = _value_str.find(query_str);
-
-                if (found_byte_offset_in_value != std::string::npos) {
-                  if (content_str.size() > 0)
-                    content_str += "\n";
-                  size_t value_cp_total =
-                      utf8::distance(_value_str.begin(), _value_str.end());
-                  size_t query_cp_len =
-                      utf8::distance(query_str.begin(), query_str.end());
-
-                  int padding_cp_each_side = 0;
-                  if (70 > (int)query_cp_len) {
-
-                    padding_cp_each_side = (70 - (int)query_cp_len) / 2;
-                  }
-                  padding_cp_each_side = std::min(30, padding_cp_each_side);
-                  padding_cp_each_side = std::max(0, padding_cp_each_side);
-
-                  std::string snippet_to_add;
-
-                  if (value_cp_total > (query_cp_len +
-                                        2 * (size_t)padding_cp_each_side + 5) ||
-                      value_cp_total > 60) {
-                    auto match_start_byte_it =
-                        _value_str.begin() + found_byte_offset_in_value;
-                    size_t match_start_cp_offset =
-                        utf8::distance(_value_str.begin(), match_start_byte_it);
-
-                    size_t snippet_start_cp =
-                        (match_start_cp_offset > (size_t)padding_cp_each_side)
-                            ? (match_start_cp_offset - padding_cp_each_side)
-                            : 0;
-
-                    size_t snippet_end_cp = std::min(
-                        value_cp_total, match_start_cp_offset + query_cp_len +
-                                            (size_t)padding_cp_each_side);
-
-                    auto snippet_start_byte_it = _value_str.begin();
-                    utf8::advance(snippet_start_byte_it, snippet_start_cp,
-                                  _value_str.end());
-
-                    auto snippet_end_byte_it = _value_str.begin();
-                    utf8::advance(snippet_end_byte_it, snippet_end_cp,
-                                  _value_str.end());
-
-                    snippet_to_add =
-                        std::string(snippet_start_byte_it, snippet_end_byte_it);
-
-                    bool add_prefix = snippet_start_cp > 0;
-                    bool add_suffix = snippet_end_cp < value_cp_total;
-
-                    if (add_prefix)
-                      snippet_to_add = "..." + snippet_to_add;
-                    if (add_suffix)
-                      snippet_to_add = snippet_to_add + "...";
-                  } else {
-                    snippet_to_add = _value_str;
-                  }
-                  content_str += snippet_to_add;
-                }
-              }
-
-              std::string final_description_str;
-              if (content_str.empty()) {
-                final_description_str = "empty";
-              } else {
-                size_t content_cp_len =
-                    utf8::distance(content_str.begin(), content_str.end());
-                if (content_cp_len > 200) {
-                  auto desc_end_it = content_str.begin();
-                  utf8::advance(desc_end_it, 200, content_str.end());
-                  final_description_str =
-                      std::string(content_str.begin(), desc_end_it) + "...";
-                } else {
-                  final_description_str = content_str;
-                }
-              }
-              result->description_ = final_description_str;
-
-              auto text_content = td_api::make_object<td_api::inputMessageText>(
-                  tgtext(content_str), nullptr, false);
-
-              text_content->text_->entities_ =
-                  std::vector<td_api::object_ptr<td_api::textEntity>>{};
-
-              size_t current_search_pos_bytes = 0;
-              while (true) {
-                size_t found_byte_offset =
-                    content_str.find(query_str, current_search_pos_bytes);
-                if (found_byte_offset == std::string::npos) {
-                  break;
-                }
-                auto text_entity = td_api::make_object<td_api::textEntity>();
-                text_entity->offset_ =
-                    utf8::distance(content_str.begin(),
-                                   content_str.begin() + found_byte_offset);
-                text_entity->length_ =
-                    utf8::distance(query_str.begin(), query_str.end());
-                text_entity->type_ =
-                    td_api::make_object<td_api::textEntityTypeBold>();
-                text_content->text_->entities_.push_back(
-                    std::move(text_entity));
-                current_search_pos_bytes =
-                    found_byte_offset + query_str.length();
-              }
-
-              result->input_message_content_ = std::move(text_content);
-
-              auto kbd = std::vector<std::vector<
-                  td_api::object_ptr<td_api::inlineKeyboardButton>>>{};
+            answer_keyword_query(std::move(answer), std::move(query_str),
+                                 update.offset_)
+                .start([](auto &&) {});
+          },
 
-              kbd.emplace_back();
+          [this](td_api::updateUser &update) {
+            ctx.users.update(*update.user_);
+          },
 
-              kbd[0].push_back(
-                  td_api::make_object<td_api::inlineKeyboardButton>(
-                      "原消息",
-                      td_api::make_object<td_api::inlineKeyboardButtonTypeUrl>(
-                          std::format("https://t.me/c/{}/{}",
-                                      -(message.chat_id + 1e12),
-                                      message.message_id >> 20))));
+          [this](td_api::updateNewChat &update) {
+            // Groups and channels can send messages as themselves, private
+            // and secret chats share the id or name of a user, whose profile
+            // comes from updateUser.
+            auto type = update.chat_->type_->get_id();
+            if (type == td_api::chatTypePrivate::ID ||
+                type == td_api::chatTypeSecret::ID) {
+              return;
+            }
+            sender_chats_.insert(update.chat_->id_);
+            ctx.users.update(user{.nickname = update.chat_->title_,
+                                  .user_id = update.chat_->id_});
+          },
 
-              kbd[0].push_back(
-                  td_api::make_object<td_api::inlineKeyboardButton>(
-                      "全部结果",
-                      td_api::make_object<
-                          td_api::inlineKeyboardButtonTypeSwitchInline>(
-                          query_str,
-                          td_api::make_object<td_api::targetChatCurrent>())));
+          [this](td_api::updateChatTitle &update) {
+            // updateNewChat always comes first and tells the chat type
+            if (!sender_chats_.contains(update.chat_id_)) {
+              return;
+            }
+            ctx.users.update(
+                user{.nickname = update.title_, .user_id = update.chat_id_});
+          },
 
-              result->reply_markup_ =
-                  td_api::make_object<td_api::replyMarkupInlineKeyboard>(
-                      std::move(kbd));
+          [this](td_api::updateMessageContent &update) {
+            ctx.indexer
+                .update_message_content(update.chat_id_, update.message_id_,
+                                        std::move(update.new_content_))
+                .start([](auto &&) {});
+          },
 
-              answer->results_.push_back(std::move(result));
+          [this](td_api::updateMessageEdited &update) {
+            // The new content arrives in updateMessageContent, this only
+            // catches edits of messages that were never indexed.
+            ctx.indexer
+                .index_missing_message(update.chat_id_, update.message_id_)
+                .start([](auto &&) {});
+          },
 
-              if (answer->results_.size() > 10) {
-                break;
-              }
+          [this](td_api::updateDeleteMessages &update) {
+            // from_cache only means tdlib evicted them from its own cache
+            if (update.is_permanent_ && !update.from_cache_) {
+              ctx.indexer
+                  .remove_messages(update.chat_id_,
+                                   std::move(update.message_ids_))
+                  .start([](auto &&) {});
             }
-
-            answer->next_offset_ = std::to_string(counter + 1);
-
-            send_query(std::move(answer), [this,
-                                           size = answer->results_.size()](
-                                              auto obj) {
-              if (obj->get_id() == td_api::error::ID) {
-                auto error = td_api::move_object_as<td_api::error>(obj);
-                ELOGFMT(ERROR, "Error: {}", error->message_);
-              } else {
-                ELOGFMT(INFO, "Inline query answered successfully, size: {}",
-                        size);
-              }
-            });
           },
 
           [this](td_api::updateMessageSendSucceeded &update) {
@@ -652,70 +544,268 @@ bot::send_query_async(td_api::object_ptr<td_api::Function> f) {
 }
 }; // namespace tgdb
 
+async_simple::coro::Lazy<std::expected<void, std::string>>
+tgdb::bot::run_migrations() {
+  auto &migrations = ctx.message_migrations;
+  // A damaged version is reported by run()
+  if (auto version = ctx.message_db.schema_version();
+      version && *version >= migrations.latest_version()) {
+    co_return std::expected<void, std::string>{};
+  }
+  auto res = co_await migrations.run(ctx.message_db);
+  if (!res) {
+    ELOGFMT(ERROR, "Database migration failed: {}", res.error());
+  }
+  co_return res;
+}
+
 async_simple::coro::Lazy<void>
 tgdb::bot::handle_upgrade_database_command(int64_t chat_id) {
-  co_await query_async<td_api::sendMessage>(
-      chat_id, 0, nullptr, nullptr, nullptr,
-      td_api::make_object<td_api::inputMessageText>(
-          tgtext("Starting database upgrade..."), nullptr, false));
-
-  int upgraded_count = 0;
-  for (auto &[key, message] : ctx.message_db) {
-    if (!message.image_file.has_value() ||
-        !message.image_file.value().has_value() ||
-        message.image_file->value().empty()) {
-      ELOGFMT(INFO, "Message {} in chat {} is missing image_file, fetching...",
-              message.message_id >> 20, message.chat_id);
-      auto fetched_message = co_await query_async<td_api::getMessage>(
-          message.chat_id, message.message_id);
-      if (fetched_message) {
-        if (auto msg_content =
-                try_get_as<td_api::messagePhoto>(fetched_message->content_)) {
-          if (msg_content->photo_ && msg_content->photo_->sizes_.size() > 0) {
-
-            auto &largest_size = msg_content->photo_->sizes_.back();
-            if (largest_size->photo_ && largest_size->photo_->local_.get()) {
-              message.image_file = largest_size->photo_->local_->path_;
-              ctx.message_db.put(key, message);
-              upgraded_count++;
-              ELOGFMT(INFO, "Upgraded message {} with image file: {}",
-                      message.message_id, message.image_file->value());
-              continue;
-            }
-          }
-        } else if (auto msg_content = try_get_as<td_api::messageSticker>(
-                       fetched_message->content_)) {
-          if (msg_content->sticker_ &&
-              msg_content->sticker_->sticker_->local_.get()) {
-            message.image_file = msg_content->sticker_->sticker_->local_->path_;
-            ctx.message_db.put(key, message);
-            upgraded_count++;
-            ELOGFMT(INFO, "Upgraded message {} with document file: {}",
-                    message.message_id, message.image_file->value());
-            continue;
-          }
+  auto &migrations = ctx.message_migrations;
+  auto reply = [this,
+                chat_id](std::string text) -> async_simple::coro::Lazy<void> {
+    co_await query_async<td_api::sendMessage>(
+        chat_id, 0, nullptr, nullptr, nullptr,
+        td_api::make_object<td_api::inputMessageText>(tgtext(std::move(text)),
+                                                      nullptr, false));
+  };
+
+  auto stored = ctx.message_db.schema_version();
+  if (!stored) {
+    co_await reply("Cannot migrate the database: " + stored.error());
+    co_return;
+  }
+  auto version = *stored;
+  if (migrations.running()) {
+    co_await reply(std::format("Database migration to version {} is running, "
+                               "currently at version {}.",
+                               migrations.latest_version(), version));
+    co_return;
+  }
+  if (version >= migrations.latest_version()) {
+    co_await reply(std::format("Database is up to date (schema version {}).",
+                               version));
+    co_return;
+  }
+
+  co_await reply(std::format("Migrating database from version {} to {}...",
+                             version, migrations.latest_version()));
+  auto res = co_await run_migrations();
+  co_await reply(res ? std::format("Database migration complete, schema "
+                                   "version {}.",
+                                   migrations.latest_version())
+                     : "Database migration failed: " + res.error());
+}
+
+async_simple::coro::Lazy<void>
+tgdb::bot::handle_backup_command(int64_t chat_id) {
+  auto reply = [this,
+                chat_id](std::string text) -> async_simple::coro::Lazy<void> {
+    co_await query_async<td_api::sendMessage>(
+        chat_id, 0, nullptr, nullptr, nullptr,
+        td_api::make_object<td_api::inputMessageText>(tgtext(std::move(text)),
+                                                      nullptr, false));
+  };
+  if (backup_running_.exchange(true)) {
+    co_await reply("A backup is already running.");
+    co_return;
+  }
+  // Cleared however the backup ends
+  struct running_guard {
+    std::atomic<bool> &running;
+    ~running_guard() { running = false; }
+  } guard{backup_running_};
+
+  co_await reply("Creating backup...");
+  // Backups copy files, so they run on the database I/O pool, which is
+  // joined on shutdown
+  auto res = co_await ctx.message_db.offload(
+      [this]() -> std::expected<backup_manifest, std::string> {
+        try {
+          return create_backup(ctx);
+        } catch (const std::exception &e) {
+          return std::unexpected<std::string>(e.what());
+        }
+      });
+  co_await reply(res ? std::format("Backup {} created in {}.", res->id,
+                                   ctx.cfg.backup_config.directory)
+                     : "Backup failed: " + res.error());
+}
+
+async_simple::coro::Lazy<void> tgdb::bot::answer_keyword_query(
+    td_api::object_ptr<td_api::answerInlineQuery> answer,
+    std::string query_str, std::string offset) {
+  // Matching reads the cache and part of the disk, so it runs on the io pool
+  // rather than the thread receiving updates.
+  auto page = co_await ctx.message_db.offload([&] {
+    return ctx.indexer.keyword_search(
+        query_str, offset, 10, ctx.cfg.tiering_config.search_scan_limit);
+  });
+
+  auto messages = co_await ctx.message_db.async_get_many(std::move(page.keys));
+  for (auto &found : messages) {
+    if (!found) {
+      continue;
+    }
+    auto &message = *found;
+
+    auto result =
+        td_api::make_object<td_api::inputInlineQueryResultArticle>();
+    result->id_ = std::to_string(message.message_id);
+    result->title_ = ctx.users.resolve(message.sender_id).nickname;
+
+    std::string content_str;
+
+    for (const auto &[kind, _value_str] :
+         message.textifyed_contents.entries()) {
+
+      size_t found_byte_offset_in_value = _value_str.find(query_str);
+
+      if (found_byte_offset_in_value != std::string::npos) {
+        if (content_str.size() > 0)
+          content_str += "\n";
+        size_t value_cp_total =
+            utf8::distance(_value_str.begin(), _value_str.end());
+        size_t query_cp_len =
+            utf8::distance(query_str.begin(), query_str.end());
+
+        int padding_cp_each_side = 0;
+        if (70 > (int)query_cp_len) {
+
+          padding_cp_each_side = (70 - (int)query_cp_len) / 2;
+        }
+        padding_cp_each_side = std::min(30, padding_cp_each_side);
+        padding_cp_each_side = std::max(0, padding_cp_each_side);
+
+        std::string snippet_to_add;
+
+        if (value_cp_total > (query_cp_len +
+                              2 * (size_t)padding_cp_each_side + 5) ||
+            value_cp_total > 60) {
+          auto match_start_byte_it =
+              _value_str.begin() + found_byte_offset_in_value;
+          size_t match_start_cp_offset =
+              utf8::distance(_value_str.begin(), match_start_byte_it);
+
+          size_t snippet_start_cp =
+              (match_start_cp_offset > (size_t)padding_cp_each_side)
+                  ? (match_start_cp_offset - padding_cp_each_side)
+                  : 0;
+
+          size_t snippet_end_cp = std::min(
+              value_cp_total, match_start_cp_offset + query_cp_len +
+                                  (size_t)padding_cp_each_side);
+
+          auto snippet_start_byte_it = _value_str.begin();
+          utf8::advance(snippet_start_byte_it, snippet_start_cp,
+                        _value_str.end());
+
+          auto snippet_end_byte_it = _value_str.begin();
+          utf8::advance(snippet_end_byte_it, snippet_end_cp,
+                        _value_str.end());
+
+          snippet_to_add =
+              std::string(snippet_start_byte_it, snippet_end_byte_it);
+
+          bool add_prefix = snippet_start_cp > 0;
+          bool add_suffix = snippet_end_cp < value_cp_total;
+
+          if (add_prefix)
+            snippet_to_add = "..." + snippet_to_add;
+          if (add_suffix)
+            snippet_to_add = snippet_to_add + "...";
         } else {
-          ELOGFMT(INFO, "Message {} in chat {} is not a photo or sticker",
-                  message.message_id, message.chat_id);
-          message.image_file = std::nullopt;
-          ctx.message_db.put(key, message);
-          continue;
+          snippet_to_add = _value_str;
         }
+        content_str += snippet_to_add;
+      }
+    }
 
-        ELOGFMT(WARNING,
-                "Message {} in chat {} has a image but do not have local file",
-                message.message_id, message.chat_id);
+    std::string final_description_str;
+    if (content_str.empty()) {
+      final_description_str = "empty";
+    } else {
+      size_t content_cp_len =
+          utf8::distance(content_str.begin(), content_str.end());
+      if (content_cp_len > 200) {
+        auto desc_end_it = content_str.begin();
+        utf8::advance(desc_end_it, 200, content_str.end());
+        final_description_str =
+            std::string(content_str.begin(), desc_end_it) + "...";
       } else {
-        ELOGFMT(ERROR, "Failed to fetch message {} in chat {}",
-                message.message_id, message.chat_id);
+        final_description_str = content_str;
       }
     }
+    result->description_ = final_description_str;
+
+    auto text_content = td_api::make_object<td_api::inputMessageText>(
+        tgtext(content_str), nullptr, false);
+
+    text_content->text_->entities_ =
+        std::vector<td_api::object_ptr<td_api::textEntity>>{};
+
+    size_t current_search_pos_bytes = 0;
+    while (true) {
+      size_t found_byte_offset =
+          content_str.find(query_str, current_search_pos_bytes);
+      if (found_byte_offset == std::string::npos) {
+        break;
+      }
+      auto text_entity = td_api::make_object<td_api::textEntity>();
+      text_entity->offset_ =
+          utf8::distance(content_str.begin(),
+                         content_str.begin() + found_byte_offset);
+      text_entity->length_ =
+          utf8::distance(query_str.begin(), query_str.end());
+      text_entity->type_ =
+          td_api::make_object<td_api::textEntityTypeBold>();
+      text_content->text_->entities_.push_back(
+          std::move(text_entity));
+      current_search_pos_bytes =
+          found_byte_offset + query_str.length();
+    }
+
+    result->input_message_content_ = std::move(text_content);
+
+    auto kbd = std::vector<std::vector<
+        td_api::object_ptr<td_api::inlineKeyboardButton>>>{};
+
+    kbd.emplace_back();
+
+    kbd[0].push_back(
+        td_api::make_object<td_api::inlineKeyboardButton>(
+            "原消息",
+            td_api::make_object<td_api::inlineKeyboardButtonTypeUrl>(
+                std::format("https://t.me/c/{}/{}",
+                            -(message.chat_id + 1e12),
+                            message.message_id >> 20))));
+
+    kbd[0].push_back(
+        td_api::make_object<td_api::inlineKeyboardButton>(
+            "全部结果",
+            td_api::make_object<
+                td_api::inlineKeyboardButtonTypeSwitchInline>(
+                query_str,
+                td_api::make_object<td_api::targetChatCurrent>())));
+
+    result->reply_markup_ =
+        td_api::make_object<td_api::replyMarkupInlineKeyboard>(
+            std::move(kbd));
+
+    answer->results_.push_back(std::move(result));
   }
 
-  co_await query_async<td_api::sendMessage>(
-      chat_id, 0, nullptr, nullptr, nullptr,
-      td_api::make_object<td_api::inputMessageText>(
-          tgtext(std::format("Database upgrade complete. {} messages upgraded.",
-                             upgraded_count)),
-          nullptr, false));
-}
\ No newline at end of file
+  answer->next_offset_ = std::move(page.next_offset);
+
+  send_query(std::move(answer), [this,
+                                 size = answer->results_.size()](
+                                    auto obj) {
+    if (obj->get_id() == td_api::error::ID) {
+      auto error = td_api::move_object_as<td_api::error>(obj);
+      ELOGFMT(ERROR, "Error: {}", error->message_);
+    } else {
+      ELOGFMT(INFO, "Inline query answered successfully, size: {}",
+              size);
+    }
+  });
+}
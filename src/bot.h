@@ -3,11 +3,14 @@
 #include "td/telegram/Client.h"
 #include "td/telegram/td_api.h"
 #include "td/telegram/td_api.hpp"
+#include <atomic>
 #include <cstdint>
 #include <expected>
 #include <format>
 #include <functional>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "async_simple/coro/Lazy.h"
 #include "ylt/easylog.hpp"
@@ -26,6 +29,9 @@ struct bot {
   uint64_t next_query_id() { return ++current_query_id_; }
 
   std::unordered_map<int64_t, int64_t> temp_msgid_map = {};
+  // Groups and channels, whose titles are kept in the user directory since
+  // messages can be sent on their behalf. Only touched by process_update.
+  std::unordered_set<int64_t> sender_chats_;
   using Object = td_api::object_ptr<td_api::Object>;
 
   std::unordered_map<uint64_t, std::function<void(Object)>> handlers_;
@@ -92,5 +98,15 @@ struct bot {
 
  private:
    async_simple::coro::Lazy<void> handle_upgrade_database_command(int64_t chat_id);
+   async_simple::coro::Lazy<void> handle_backup_command(int64_t chat_id);
+   // Answers an inline query with a page of messages containing `query_str`,
+   // see indexer::keyword_search() for `offset`.
+   async_simple::coro::Lazy<void>
+   answer_keyword_query(td_api::object_ptr<td_api::answerInlineQuery> answer,
+                        std::string query_str, std::string offset);
+   // Set while /backup runs, a second one is turned away meanwhile
+   std::atomic<bool> backup_running_ = false;
+   // Brings message_db to the latest schema version in the background.
+   async_simple::coro::Lazy<std::expected<void, std::string>> run_migrations();
  };
  } // namespace tgdb
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 #include "rfl/TaggedUnion.hpp"
+#include <cstdint>
+#include <map>
 #include <optional>
 #include <string>
 #include <variant>
+#include <vector>
 
 namespace tgdb {
 struct config {
@@ -26,6 +29,117 @@ struct config {
 
   std::optional<embedding_config_t> embedding_config;
 
+  // "faiss" for exact search, or "faiss_hnsw", "faiss_ivf_flat" and
+  // "faiss_ivf_pq" for approximate search
   std::string vector_database = "faiss";
+
+  struct faiss_config_t {
+    // How the searched index keeps vectors: "float", "fp16" or "sq8" (one
+    // byte per dimension). Snapshots always keep the float vectors.
+    std::string storage = "float";
+    int hnsw_m = 32;
+    int ef_construction = 80;
+    // Higher values trade latency for recall
+    int ef_search = 64;
+    int nprobe = 16;
+    // IVF lists, 0 derives them from the number of vectors
+    int nlist = 0;
+    int pq_m = 64;
+    int pq_nbits = 8;
+    // IVF indexes are built once this many vectors exist
+    size_t min_train_vectors = 50000;
+    // Checkpointed vectors are first ranked by their sign bits and only this
+    // many candidates are compared exactly, 0 compares all of them. Only
+    // used by the flat type with float storage, the others search an index
+    size_t binary_candidates = 0;
+    // Vector changes are logged and synced in groups at this interval, which
+    // cannot be 0. The index itself is rewritten once checkpoint_mb of
+    // changes accumulated.
+    uint32_t wal_sync_ms = 1000;
+    size_t checkpoint_mb = 64;
+  };
+
+  faiss_config_t faiss_config;
+
+  struct rocksdb_config_t {
+    size_t block_cache_mb = 256;
+    int bloom_bits_per_key = 10;
+    // "zstd", "lz4", "snappy" or "none". The build only links zstd into
+    // rocksdb, lz4 and snappy need it rebuilt with them.
+    std::string compression = "zstd";
+    int zstd_level = 3;
+    // zstd dictionary trained from a sample of message values, 0 disables it
+    uint32_t zstd_dict_kb = 16;
+    uint32_t zstd_train_kb = 1600;
+    size_t write_buffer_mb = 64;
+    int max_write_buffer_number = 3;
+  };
+
+  rocksdb_config_t rocksdb_config;
+  // Threads running blocking database calls for coroutines
+  size_t db_io_threads = 4;
+
+  struct migration_config_t {
+    // Records migrated at once, and an upper bound on records scanned per
+    // second so migrations do not starve live indexing.
+    size_t concurrency = 8;
+    size_t max_rate = 1000;
+    // Upper bound on messages per second that steps look up from Telegram,
+    // to stay below its flood limits. 0 for no limit.
+    size_t max_fetch_rate = 20;
+  };
+
+  migration_config_t migration_config;
+
+  struct backup_config_t {
+    std::string directory = "backups";
+    // Backups kept per database, 0 keeps all of them
+    uint32_t keep = 7;
+    // Restores the latest backup when message_db does not exist yet, to
+    // bring up a new node from a copied backup directory.
+    bool restore_if_missing = false;
+  };
+
+  backup_config_t backup_config;
+
+  // Limits on how long messages are kept, enforced while message_db is
+  // compacted. Unset fields keep data forever.
+  struct retention_rule_t {
+    // Chat the rule applies to, unset for the default rule
+    std::optional<int64_t> chat_id;
+    std::optional<uint32_t> max_age_days;
+    // Only the newest max_count messages of the chat are kept
+    std::optional<size_t> max_count;
+    // Image paths and OCR text are dropped after this many days
+    std::optional<uint32_t> drop_media_after_days;
+  };
+
+  struct retention_config_t {
+    std::vector<retention_rule_t> rules;
+    // How often max_count limits are recounted and expired data compacted
+    uint32_t enforce_interval_hours = 24;
+  };
+
+  retention_config_t retention_config;
+
+  struct tiering_config_t {
+    // Messages sent within this many days are kept in memory, older ones are
+    // read from disk on demand. 0 keeps every message in memory.
+    uint32_t hot_days = 180;
+    // How often messages that aged past hot_days leave memory
+    uint32_t demote_interval_minutes = 60;
+    // Inline keyword searches match the messages in memory first, then go on
+    // to older ones on disk, reading at most this many per page of results.
+    uint32_t search_scan_limit = 20000;
+  };
+
+  tiering_config_t tiering_config;
+
+  // Overrides for the message column families ("meta", "text", "media").
+  // Families listed here get their own block cache.
+  std::map<std::string, rocksdb_config_t> column_families = {
+      {"meta", {.block_cache_mb = 64, .zstd_dict_kb = 0}},
+      {"media", {.block_cache_mb = 32, .zstd_dict_kb = 0}},
+  };
 };
 } // namespace tgdb
\ No newline at end of file
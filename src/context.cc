@@ -1,7 +1,11 @@
 #include "context.h"
+#include "backup.h"
 #include "config.h"
 
+#include <charconv>
+#include <chrono>
 #include <filesystem>
+#include <thread>
 
 #include "rfl/DefaultIfMissing.hpp"
 #include "rfl/json/read.hpp"
@@ -10,6 +14,54 @@
 #include "database/faiss_vector_db.h"
 #include "embedding/dashscope_embedding_service.h"
 
+static kvdb::tuning_options
+to_tuning(const tgdb::config::rocksdb_config_t &db_cfg) {
+  return kvdb::tuning_options{
+      .block_cache_bytes = db_cfg.block_cache_mb << 20,
+      .bloom_bits_per_key = db_cfg.bloom_bits_per_key,
+      .compression = db_cfg.compression,
+      .zstd_level = db_cfg.zstd_level,
+      .zstd_dict_bytes = db_cfg.zstd_dict_kb << 10,
+      .zstd_train_bytes = db_cfg.zstd_train_kb << 10,
+      .write_buffer_bytes = db_cfg.write_buffer_mb << 20,
+      .max_write_buffer_number = db_cfg.max_write_buffer_number,
+  };
+}
+
+// The index every modality shared before had keys "<message id>:type-<N>"
+// with N the EmbeddingType. It is read with N in the low bits of the key.
+constexpr int shared_type_bits = 8;
+
+static std::optional<tgdb::VectorKey> shared_key(std::string_view key) {
+  auto suffix = key.rfind(":type-");
+  if (suffix == std::string_view::npos) {
+    return std::nullopt;
+  }
+  auto id_end = key.data() + suffix;
+  auto type_begin = id_end + std::string_view(":type-").size();
+  uint64_t message_id, type;
+  auto [id_parsed, id_ec] = std::from_chars(key.data(), id_end, message_id);
+  auto [type_parsed, type_ec] =
+      std::from_chars(type_begin, key.data() + key.size(), type);
+  if (id_ec != std::errc() || id_parsed != id_end ||
+      type_ec != std::errc() || type_parsed != key.data() + key.size() ||
+      message_id >> (64 - shared_type_bits) || type >> shared_type_bits) {
+    return std::nullopt;
+  }
+  return message_id << shared_type_bits | type;
+}
+
+// The EmbeddingType and message id of a key read by shared_key(), nullopt
+// for types that do not exist
+static std::optional<std::pair<size_t, tgdb::VectorKey>>
+split_shared_key(tgdb::VectorKey key) {
+  auto type = static_cast<size_t>(key & ((1u << shared_type_bits) - 1));
+  if (type > static_cast<size_t>(tgdb::EmbeddingType::Image)) {
+    return std::nullopt;
+  }
+  return std::pair{type, key >> shared_type_bits};
+}
+
 void tgdb::context::init() {
   if (std::filesystem::exists("./config.json")) {
     auto ifs = std::ifstream("./config.json");
@@ -34,19 +86,91 @@ void tgdb::context::init() {
   } else {
     ELOGFMT(WARNING, "No config.json found, using default configuration");
   }
+  if (cfg.faiss_config.wal_sync_ms == 0) {
+    ELOGFMT(ERROR, "faiss_config.wal_sync_ms must be positive");
+    throw std::runtime_error("faiss_config.wal_sync_ms must be positive");
+  }
+
+  if (cfg.backup_config.restore_if_missing &&
+      !std::filesystem::exists("message_db")) {
+    if (auto res = restore_backup(cfg.backup_config); !res) {
+      ELOGFMT(ERROR, "Failed to restore backup: {}", res.error());
+      throw std::runtime_error("Failed to restore backup: " + res.error());
+    }
+  }
+
+  db_io = std::make_shared<kvdb::io_pool>(cfg.db_io_threads);
+  message_db.io = db_io;
+  users.user_db.io = db_io;
+
+  message_db.tune(to_tuning(cfg.rocksdb_config));
+  for (const auto &[name, family_cfg] : cfg.column_families) {
+    message_db.tune_family(name, to_tuning(family_cfg));
+  }
+  retention.install();
+  if (auto hot_days = cfg.tiering_config.hot_days) {
+    message_db.hot = [hot_days](const message &msg) {
+      auto now = std::chrono::duration_cast<std::chrono::seconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                     .count();
+      return msg.send_time >=
+             now - static_cast<int64_t>(hot_days) * 24 * 60 * 60;
+    };
+  }
 
   if (auto res = message_db.open(); !res) {
     ELOGFMT(ERROR, "Failed to open message_db: {}", res.error());
     throw std::runtime_error("Failed to open message_db: " + res.error());
   } else {
-    ELOGFMT(INFO, "message_db opened successfully, {} entries",
+    ELOGFMT(INFO, "message_db opened successfully, {} entries in memory",
             message_db.cache->size());
   }
 
-  if (cfg.vector_database == "faiss") {
-    vector_db_service_ =
-        std::make_unique<FaissVectorDbService>(1024, faiss::METRIC_L2);
-    if (!vector_db_service_->CreateOrLoad("vector_db.faiss")) {
+  // Pending migrations start once the bot is logged in, see bot.cc
+  message_migrations.options.concurrency = cfg.migration_config.concurrency;
+  message_migrations.options.max_rate = cfg.migration_config.max_rate;
+  register_message_migrations(*this, message_migrations);
+
+  if (auto res = users.open(); !res) {
+    ELOGFMT(ERROR, "Failed to open user_db: {}", res.error());
+    throw std::runtime_error("Failed to open user_db: " + res.error());
+  } else {
+    ELOGFMT(INFO, "user_db opened successfully, {} users", users.size());
+  }
+
+  if (cfg.vector_database == "faiss" ||
+      cfg.vector_database.starts_with("faiss_")) {
+    const auto &faiss_cfg = cfg.faiss_config;
+    FaissIndexOptions options{
+        .type = cfg.vector_database == "faiss"
+                    ? "flat"
+                    : cfg.vector_database.substr(std::string("faiss_").size()),
+        .storage = faiss_cfg.storage,
+        .hnsw_m = faiss_cfg.hnsw_m,
+        .ef_construction = faiss_cfg.ef_construction,
+        .ef_search = faiss_cfg.ef_search,
+        .nlist = faiss_cfg.nlist,
+        .nprobe = faiss_cfg.nprobe,
+        .pq_m = faiss_cfg.pq_m,
+        .pq_nbits = faiss_cfg.pq_nbits,
+        .min_train_vectors = faiss_cfg.min_train_vectors,
+        .binary_candidates = faiss_cfg.binary_candidates,
+        .checkpoint_bytes = faiss_cfg.checkpoint_mb << 20,
+    };
+    // Named in EmbeddingType order
+    vector_db_service_ = std::make_unique<ModalVectorDb>(
+        std::vector<std::string>{"text", "image"}, [options]() {
+          return std::make_unique<FaissVectorDbService>(1024, faiss::METRIC_L2,
+                                                        options);
+        });
+    auto open_shared = [options]() mutable {
+      options.legacy_key = shared_key;
+      return std::make_unique<FaissVectorDbService>(1024, faiss::METRIC_L2,
+                                                    options);
+    };
+    if (!vector_db_service_->CreateOrLoad("vector_db.faiss") ||
+        !vector_db_service_->Migrate("vector_db.faiss", open_shared,
+                                     split_shared_key)) {
       ELOGFMT(ERROR, "Failed to load vector database!");
       return;
     } else {
@@ -76,11 +200,49 @@ void tgdb::context::init() {
   }
 
   if (vector_db_service_) {
-    // Save the vector database every 30 seconds
+    // Group commit of the vector log
+    std::thread([this]() {
+      while (true) {
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(cfg.faiss_config.wal_sync_ms));
+        vector_db_service_->Sync();
+      }
+    }).detach();
+
+    // Maintain the vector database every 30 seconds, it is only rewritten
+    // once its log grew large enough
     std::thread([this]() {
       while (true) {
         std::this_thread::sleep_for(std::chrono::seconds(30));
-        vector_db_service_->Save("vector_db.faiss");
+        vector_db_service_->Train();
+        vector_db_service_->Compact();
+        vector_db_service_->Checkpoint();
+      }
+    }).detach();
+  }
+
+  if (message_db.hot) {
+    std::thread([this]() {
+      while (true) {
+        std::this_thread::sleep_for(std::chrono::minutes(
+            cfg.tiering_config.demote_interval_minutes));
+        if (auto moved = message_db.demote()) {
+          ELOGFMT(INFO, "Moved {} messages out of memory", moved);
+        }
+      }
+    }).detach();
+  }
+
+  if (!cfg.retention_config.rules.empty()) {
+    std::thread([this]() {
+      // Compactions RocksDB runs on its own apply the rules from the start.
+      // Forcing one on every boot would rewrite the whole database, so the
+      // first enforce() waits for the interval.
+      retention.recount();
+      while (true) {
+        std::this_thread::sleep_for(
+            std::chrono::hours(cfg.retention_config.enforce_interval_hours));
+        retention.enforce();
       }
     }).detach();
   }
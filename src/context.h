@@ -3,21 +3,30 @@
 #include "config.h"
 #include "data.h"
 #include "database/database.hpp"
-#include "database/vector_db.h"
+#include "database/modal_vector_db.hpp"
 #include "embedding/embedding_service.h"
 #include "indexer.h"
+#include "migrations.h"
 #include "ocr.h"
+#include "retention.h"
+#include "user_directory.h"
 #include <memory>
 
 
 namespace tgdb {
 struct context {
+  std::shared_ptr<kvdb::io_pool> db_io;
+  // Declared before message_db, whose compaction filters call into it
+  retention retention{*this};
   kvdb::database<message> message_db;
+  kvdb::migrations<message> message_migrations;
+  user_directory users;
   config cfg;
   bot bot{*this};
   indexer indexer{*this};
   std::unique_ptr<IOcrClient> ocr_client_ = nullptr;
-  std::unique_ptr<VectorDbService> vector_db_service_ = nullptr;
+  // One index per EmbeddingType
+  std::unique_ptr<ModalVectorDb> vector_db_service_ = nullptr;
   std::unique_ptr<EmbeddingService> embedding_service_ = nullptr;
   context() : message_db("message_db") {}
   void init();
@@ -1,9 +1,14 @@
 #pragma once
+#include "ylt/struct_pack.hpp"
 #include "ylt/struct_pack/compatible.hpp"
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <format>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <unordered_map>
 
 namespace tgdb {
@@ -16,7 +21,142 @@ struct user {
                        nickname, user_id, str_id.value_or("None"));
   }
 };
-struct message {
+
+enum class content_kind : uint8_t {
+  text,
+  image,
+  document,
+  audio,
+  voice,
+  video_note,
+  location,
+  contact,
+  venue,
+  functional_message,
+};
+
+inline constexpr std::array<std::string_view, 10> content_kind_names = {
+    "text",       "image",    "document", "audio", "voice",
+    "video_note", "location", "contact",  "venue", "functional_message",
+};
+
+inline constexpr std::string_view content_kind_name(content_kind kind) {
+  return content_kind_names[static_cast<size_t>(kind)];
+}
+
+// Textified message fields packed into a single buffer. A message rarely has
+// more than two fields, so the field table is a small inline array instead of
+// a hash table with a key string per entry.
+struct textified_contents {
+  struct field {
+    content_kind kind;
+    uint32_t offset;
+    uint32_t size;
+  };
+  static constexpr size_t inline_capacity = 3;
+
+  std::string buffer;
+  std::array<field, inline_capacity> fields = {};
+  uint8_t count = 0;
+
+  struct entry {
+    content_kind kind;
+    std::string_view value;
+  };
+
+  struct iterator {
+    using value_type = entry;
+    using difference_type = std::ptrdiff_t;
+
+    const textified_contents *owner = nullptr;
+    size_t index = 0;
+
+    entry operator*() const { return owner->at(index); }
+    iterator &operator++() {
+      ++index;
+      return *this;
+    }
+    iterator operator++(int) {
+      auto temp = *this;
+      ++index;
+      return temp;
+    }
+    bool operator==(const iterator &) const = default;
+  };
+
+  struct entries_view {
+    const textified_contents *owner;
+    iterator begin() const { return {owner, 0}; }
+    iterator end() const { return {owner, owner->count}; }
+  };
+
+  // Iterated through entries() rather than begin()/end() on the struct itself,
+  // so struct_pack keeps treating it as a plain aggregate.
+  entries_view entries() const { return {this}; }
+
+  bool empty() const { return count == 0; }
+  size_t field_count() const { return count; }
+
+  entry at(size_t index) const {
+    auto &f = fields[index];
+    return {f.kind, std::string_view(buffer).substr(f.offset, f.size)};
+  }
+
+  std::optional<std::string_view> get(content_kind kind) const {
+    for (size_t i = 0; i < count; ++i) {
+      if (fields[i].kind == kind) {
+        return at(i).value;
+      }
+    }
+    return std::nullopt;
+  }
+
+  // Returns false if the inline field table is full.
+  bool set(content_kind kind, std::string_view value) {
+    erase(kind);
+    if (count == inline_capacity) {
+      return false;
+    }
+    fields[count++] = {kind, static_cast<uint32_t>(buffer.size()),
+                       static_cast<uint32_t>(value.size())};
+    buffer.append(value);
+    return true;
+  }
+
+  void erase(content_kind kind) {
+    for (size_t i = 0; i < count; ++i) {
+      if (fields[i].kind != kind) {
+        continue;
+      }
+      auto removed = fields[i];
+      buffer.erase(removed.offset, removed.size);
+      std::copy(fields.begin() + i + 1, fields.begin() + count,
+                fields.begin() + i);
+      fields[--count] = {};
+      for (size_t j = 0; j < count; ++j) {
+        if (fields[j].offset > removed.offset) {
+          fields[j].offset -= removed.size;
+        }
+      }
+      return;
+    }
+  }
+
+  std::string to_string() const {
+    std::string result = "{";
+    for (const auto &[kind, value] : entries()) {
+      if (result.size() > 1) {
+        result += ", ";
+      }
+      result += std::format("{}: {}", content_kind_name(kind), value);
+    }
+    return result + "}";
+  }
+};
+
+namespace legacy {
+// Message layout before textified contents were packed (schema version 0).
+struct message_v0 {
   int64_t message_id;
   int64_t send_time;
   int64_t chat_id;
@@ -24,17 +164,131 @@ struct message {
   user sender;
   int64_t reply_to_message_id = -1;
   struct_pack::compatible<std::optional<std::string>, 1> image_file;
+};
+} // namespace legacy
+
+// message is stored split over three column families, so scans that only
+// need one kind of data do not read the others. Every part carries chat_id
+// and send_time so it can be filtered on its own.
+struct message_meta {
+  static constexpr std::string_view family_name = "meta";
+  int64_t message_id;
+  int64_t send_time;
+  int64_t chat_id;
+  // Profiles live in the user directory, see user_directory.
+  int64_t sender_id = 0;
+  int64_t reply_to_message_id = -1;
+};
+
+struct message_text {
+  static constexpr std::string_view family_name = "text";
+  int64_t chat_id;
+  int64_t send_time;
+  // Every textified field except the OCR text of images.
+  textified_contents contents = {};
+};
+
+struct message_media {
+  static constexpr std::string_view family_name = "media";
+  int64_t chat_id;
+  int64_t send_time;
+  std::optional<std::string> image_file;
+  std::optional<std::string> ocr_text;
+};
+
+struct message {
+  int64_t message_id;
+  int64_t send_time;
+  int64_t chat_id;
+  textified_contents textifyed_contents = {};
+  int64_t sender_id = 0;
+  int64_t reply_to_message_id = -1;
+  struct_pack::compatible<std::optional<std::string>, 1> image_file;
+
+  // Decodes records written with an older layout, see kvdb::detail::decode.
+  // Their sender profile is dropped, migration step 1 moves it to the user
+  // directory.
+  static std::optional<message> upgrade(std::string_view packed) {
+    auto old = struct_pack::deserialize<legacy::message_v0>(packed);
+    if (!old) {
+      return std::nullopt;
+    }
+
+    message msg{
+        .message_id = old->message_id,
+        .send_time = old->send_time,
+        .chat_id = old->chat_id,
+        .sender_id = old->sender.user_id,
+        .reply_to_message_id = old->reply_to_message_id,
+        .image_file = std::move(old->image_file),
+    };
+    for (size_t i = 0; i < content_kind_names.size(); ++i) {
+      auto it = old->textifyed_contents.find(std::string(content_kind_names[i]));
+      if (it != old->textifyed_contents.end()) {
+        msg.textifyed_contents.set(static_cast<content_kind>(i), it->second);
+      }
+    }
+    return msg;
+  }
+
+  // Column family layout, see kvdb::layout.
+  using families = std::tuple<message_meta, message_text, message_media>;
+
+  static families to_parts(const message &msg) {
+    families parts{
+        message_meta{
+            .message_id = msg.message_id,
+            .send_time = msg.send_time,
+            .chat_id = msg.chat_id,
+            .sender_id = msg.sender_id,
+            .reply_to_message_id = msg.reply_to_message_id,
+        },
+        message_text{.chat_id = msg.chat_id, .send_time = msg.send_time},
+        message_media{.chat_id = msg.chat_id, .send_time = msg.send_time},
+    };
+    auto &[meta, text, media] = parts;
+    for (const auto &[kind, value] : msg.textifyed_contents.entries()) {
+      if (kind == content_kind::image) {
+        media.ocr_text = std::string(value);
+      } else {
+        text.contents.set(kind, value);
+      }
+    }
+    if (msg.image_file.has_value()) {
+      media.image_file = *msg.image_file;
+    }
+    return parts;
+  }
+
+  static message from_parts(families &&parts) {
+    auto &[meta, text, media] = parts;
+    message msg{
+        .message_id = meta.message_id,
+        .send_time = meta.send_time,
+        .chat_id = meta.chat_id,
+        .textifyed_contents = std::move(text.contents),
+        .sender_id = meta.sender_id,
+        .reply_to_message_id = meta.reply_to_message_id,
+    };
+    if (media.ocr_text) {
+      msg.textifyed_contents.set(content_kind::image, *media.ocr_text);
+    }
+    if (media.image_file) {
+      msg.image_file = std::move(media.image_file);
+    }
+    return msg;
+  }
 
   inline std::string to_string() const {
     return std::format("message{{message_id: {}, "
                        "textifyed_contents: {}, "
-                       "sender: {}, reply_to_message_id: {}, "
+                       "sender_id: {}, reply_to_message_id: {}, "
                         "image_file: {}}}",
-                        message_id, textifyed_contents,
-                        sender.to_string(), reply_to_message_id,
+                        message_id, textifyed_contents.to_string(),
+                        sender_id, reply_to_message_id,
                         image_file.has_value() ? (
                           image_file.value().has_value() ? image_file->value() : "None"
                         ) : "None");
   }
 };
-} // namespace tgdb
\ No newline at end of file
+} // namespace tgdb
@@ -0,0 +1,183 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "async_simple/coro/Collect.h"
+#include "async_simple/coro/Lazy.h"
+#include "async_simple/coro/Sleep.h"
+
+#include "ylt/easylog.hpp"
+#include "ylt/struct_pack.hpp"
+
+#include "database.hpp"
+
+namespace kvdb {
+struct scan_progress {
+  size_t scanned = 0;
+  // Entries the processor returned a new value for.
+  size_t written = 0;
+  // Rewrites dropped because the live value changed after the snapshot.
+  size_t conflicts = 0;
+  std::chrono::steady_clock::duration elapsed = {};
+};
+
+struct background_scan_options {
+  scan_options scan = {};
+  // Processors running at once within a chunk.
+  size_t concurrency = 8;
+  // Entries read per chunk, their rewrites are committed as one batch.
+  size_t chunk_size = 256;
+  // Upper limit on scanned entries per second, 0 for no limit.
+  size_t max_rate = 0;
+  // Name of the metadata entry recording the last committed key. A scan with
+  // a checkpoint resumes where an interrupted run stopped.
+  std::string checkpoint;
+  std::function<void(const scan_progress &)> on_progress;
+};
+
+namespace detail {
+template <typename T, typename V> V project(const T &value) {
+  if constexpr (std::is_same_v<V, T>) {
+    return value;
+  } else {
+    return std::get<V>(T::to_parts(value));
+  }
+}
+} // namespace detail
+
+// Runs `process(key, value)` over a snapshot of `db`, so maintenance jobs see
+// a consistent view while live writes continue. `process` returns the value
+// to store for the key, or nullopt to leave it alone. Rewrites are committed
+// in batches, one per chunk, and skipped if the live value was changed in the
+// meantime so they never clobber newer data. The keys of a chunk are locked
+// against other writers from that comparison until the batch is written.
+//
+// With a checkpoint every chunk commits the last key it covered in the same
+// batch as its rewrites, so a restarted scan neither skips nor repeats work.
+//
+// V selects what is scanned: the whole value (V = T) or a single column
+// family part of it, see database::scan_part(). `process` returns a new V,
+// for a part it replaces that part of the live value and the other parts,
+// which the scan never compared, are kept as they are.
+template <typename T, typename V = T, typename F>
+async_simple::coro::Lazy<scan_progress>
+background_scan(database<T> &db, background_scan_options options,
+                F process) {
+  auto begin_time = std::chrono::steady_clock::now();
+  scan_progress progress;
+
+  auto snapshot = db.snapshot();
+  options.scan.snapshot = snapshot;
+  if (!options.checkpoint.empty()) {
+    if (auto last = db.get_meta(options.checkpoint)) {
+      ELOGFMT(INFO, "Resuming scan {} after key {}", options.checkpoint, *last);
+      options.scan.lower_bound = *last + '\0';
+    }
+  }
+  scan_range<T, V> range{&db, std::move(options.scan)};
+
+  struct entry {
+    std::string key;
+    V value;
+    std::optional<V> replacement;
+  };
+
+  // Reading and committing run on the database's io pool, the processors
+  // on the caller's executor.
+  auto it = co_await db.offload([&] { return range.begin(); });
+  while (it.valid()) {
+    std::vector<entry> chunk;
+    chunk.reserve(options.chunk_size);
+    std::string last_key;
+    co_await db.offload([&] {
+      for (size_t read = 0; it.valid() && read < options.chunk_size;
+           ++it, ++read) {
+        progress.scanned++;
+        last_key.assign(it.key());
+        if (auto res = it.try_decode(); !res) {
+          ELOGFMT(ERROR, "Background scan skipped {}: {}", it.key(),
+                  res.error());
+          continue;
+        }
+        chunk.push_back({std::move(it->first), std::move(it->second), {}});
+      }
+    });
+
+    std::vector<async_simple::coro::Lazy<void>> tasks;
+    tasks.reserve(chunk.size());
+    for (auto &e : chunk) {
+      tasks.push_back([](entry &e, F &process) -> async_simple::coro::Lazy<void> {
+        e.replacement = co_await process(e.key, e.value);
+      }(e, process));
+    }
+    co_await async_simple::coro::collectAllWindowedPara(
+        options.concurrency, false, std::move(tasks));
+
+    progress.written += co_await db.offload([&] {
+      std::vector<std::string_view> keys;
+      for (auto &e : chunk) {
+        if (e.replacement) {
+          keys.push_back(e.key);
+        }
+      }
+      auto locks = db.lock_keys(keys);
+      transaction_batch<T> batch(&db);
+      for (auto &e : chunk) {
+        if (!e.replacement) {
+          continue;
+        }
+        // Compare against the latest state, the snapshot value is what the
+        // processor based its rewrite on.
+        auto current = db.get(e.key);
+        if (!current || struct_pack::serialize<std::string>(
+                            detail::project<T, V>(*current)) !=
+                            struct_pack::serialize<std::string>(e.value)) {
+          progress.conflicts++;
+          continue;
+        }
+        if constexpr (std::is_same_v<V, T>) {
+          batch.put(e.key, *e.replacement);
+        } else {
+          auto parts = T::to_parts(*current);
+          std::get<V>(parts) = std::move(*e.replacement);
+          batch.put(e.key, T::from_parts(std::move(parts)));
+        }
+      }
+      if (!options.checkpoint.empty()) {
+        batch.put_meta(options.checkpoint, last_key);
+        batch.write();
+      } else if (batch.size() > 0) {
+        batch.write();
+      }
+      return batch.size();
+    });
+
+    progress.elapsed = std::chrono::steady_clock::now() - begin_time;
+    if (options.on_progress) {
+      options.on_progress(progress);
+    }
+
+    if (options.max_rate) {
+      auto due = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(static_cast<double>(progress.scanned) /
+                                        options.max_rate));
+      if (due > progress.elapsed) {
+        co_await async_simple::coro::sleep(due - progress.elapsed);
+      }
+    }
+  }
+
+  if (!options.checkpoint.empty()) {
+    db.remove_meta(options.checkpoint);
+  }
+
+  co_return progress;
+}
+} // namespace kvdb
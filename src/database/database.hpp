@@ -1,154 +1,481 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <concepts>
+#include <cstdint>
 #include <expected>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <print>
+#include <ranges>
+#include <shared_mutex>
+#include <span>
 #include <string>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "rocksdb/db.h"
 #include "rocksdb/options.h"
 #include "rocksdb/slice.h"
+#include "rocksdb/utilities/backup_engine.h"
+#include "rocksdb/utilities/checkpoint.h"
+#include "rocksdb/write_batch.h"
 
 #include "ylt/easylog.hpp"
 #include "ylt/struct_pack.hpp"
 
+#include "expiry_filter.hpp"
+#include "io_pool.hpp"
+#include "sharded_cache.hpp"
+#include "tuning.hpp"
+
 namespace kvdb {
 template <typename T = std::string> struct database;
 
+// Values can be split over several column families by declaring
+//   using families = std::tuple<Parts...>;
+//   static families to_parts(const T &);
+//   static T from_parts(families &&);
+// where every part has a `static constexpr std::string_view family_name`.
+// The first part is the primary one, a key exists iff its primary part does.
+// Other types are stored as a single blob in the default column family.
+template <typename T> struct layout {
+  using parts = std::tuple<T>;
+  static constexpr bool split = false;
+};
+
+template <typename T>
+  requires requires { typename T::families; }
+struct layout<T> {
+  using parts = typename T::families;
+  static constexpr bool split = true;
+};
+
+template <typename T>
+inline constexpr size_t part_count =
+    std::tuple_size_v<typename layout<T>::parts>;
+
+namespace detail {
+template <typename P, typename Tuple> struct tuple_index;
+template <typename P, typename... Ts>
+struct tuple_index<P, std::tuple<Ts...>> {
+  static constexpr size_t value = [] {
+    constexpr bool matches[] = {std::is_same_v<P, Ts>...};
+    for (size_t i = 0; i < sizeof...(Ts); ++i) {
+      if (matches[i]) {
+        return i;
+      }
+    }
+    return sizeof...(Ts);
+  }();
+};
+
+template <size_t N, typename F> void for_each_index(F &&f) {
+  [&]<size_t... I>(std::index_sequence<I...>) {
+    (f(std::integral_constant<size_t, I>{}), ...);
+  }(std::make_index_sequence<N>{});
+}
+
+inline std::string_view view(const rocksdb::Slice &slice) {
+  return std::string_view(slice.data(), slice.size());
+}
+
+// Decodes a stored value. Types whose layout changed can provide
+// `static std::optional<T> upgrade(std::string_view)` to read records written
+// with an older layout; those are converted on the fly until rewritten.
+template <typename T>
+std::expected<T, std::string> decode(std::string_view packed) {
+  if (auto value = struct_pack::deserialize<T>(packed); value) {
+    return std::move(*value);
+  }
+  if constexpr (requires {
+                  { T::upgrade(packed) } -> std::same_as<std::optional<T>>;
+                }) {
+    if (auto upgraded = T::upgrade(packed)) {
+      return std::move(*upgraded);
+    }
+  }
+  return std::unexpected<std::string>("Failed to deserialize value");
+}
+} // namespace detail
+
+template <typename T, typename P>
+inline constexpr size_t part_index =
+    detail::tuple_index<P, typename layout<T>::parts>::value;
+
 template <typename T> struct transaction_batch {
   rocksdb::WriteBatch batch;
   database<T> *db;
+  // Applied to the cache only after the batch is written, so readers never
+  // see uncommitted values. nullopt drops the cached entry.
+  std::vector<std::pair<std::string, std::optional<T>>> cache_updates;
 
   transaction_batch(database<T> *db) : db(db) {}
 
   void put_raw(std::string_view key, std::string_view value) {
-    batch.Put(key, value);
-    if (db->cache) {
-      db->cache->emplace(key, value);
+    batch.Put(db->handles[0], key, value);
+    if (auto decoded = detail::decode<T>(value); decoded) {
+      cache_updates.emplace_back(std::string(key), std::move(*decoded));
+    } else {
+      cache_updates.emplace_back(std::string(key), std::nullopt);
     }
   }
 
   void put(std::string_view key, const T &value) {
-    auto packed_value = struct_pack::serialize(value);
-    put_raw(key, std::string_view(packed_value.data(), packed_value.size()));
+    db->encode_into(batch, key, value);
+    cache_updates.emplace_back(std::string(key), value);
   }
 
   void remove(std::string_view key) {
-    batch.Delete(key);
-    if (db->cache) {
-      db->cache->erase(key);
-    }
+    db->erase_from(batch, key);
+    cache_updates.emplace_back(std::string(key), std::nullopt);
+  }
+
+  // Stores database metadata, e.g. a checkpoint committed together with the
+  // data it covers.
+  void put_meta(std::string_view name, std::string_view value) {
+    batch.Put(db->meta_handle(), name, value);
   }
 
+  size_t size() const { return cache_updates.size(); }
+
+  // Locks the keys of the batch against other writers, then writes it.
   void commit();
+  // Writes the batch while the caller holds database::lock_keys() for all of
+  // its keys.
+  void write();
 };
 
-template <typename T> struct database_iterator {
-  rocksdb::Iterator *iter = nullptr;
-  std::optional<typename std::unordered_map<std::string, T>::iterator>
-      cache_iter;
+// Options for streaming range scans straight from RocksDB.
+struct scan_options {
+  // Only keys starting with this prefix are visited.
+  std::string prefix;
+  // Inclusive lower bound on the visited keys.
+  std::optional<std::string> lower_bound;
+  // Exclusive upper bound on the visited keys.
+  std::optional<std::string> upper_bound;
+  size_t readahead_size = 2 * 1024 * 1024;
+  // Long scans should not evict the working set from the block cache.
+  bool fill_cache = false;
+  // Reads this point-in-time view instead of the latest state, see
+  // database::snapshot().
+  std::shared_ptr<const rocksdb::Snapshot> snapshot;
+};
 
+namespace detail {
+// Smallest key that is greater than every key starting with `prefix`.
+inline std::optional<std::string> prefix_successor(std::string_view prefix) {
+  std::string successor(prefix);
+  while (!successor.empty()) {
+    auto last = static_cast<unsigned char>(successor.back());
+    if (last != 0xff) {
+      successor.back() = static_cast<char>(last + 1);
+      return successor;
+    }
+    successor.pop_back();
+  }
+  return std::nullopt;
+}
+} // namespace detail
+
+// Iterates whole values (V = T) or a single column family part (V = P).
+template <typename T, typename V = T> struct database_iterator {
   using iterator_category = std::input_iterator_tag;
-  using value_type = std::pair<const std::string, T>;
+  using value_type = std::pair<std::string, V>;
   using difference_type = std::ptrdiff_t;
   using pointer = value_type *;
   using reference = value_type &;
 
-  database_iterator(rocksdb::DB *db,
-                    rocksdb::ReadOptions options = rocksdb::ReadOptions()) {
-    iter = db->NewIterator(options);
-    iter->SeekToFirst();
-  }
-
-  database_iterator() : iter() {}
+  database_iterator() = default;
 
-  database_iterator(rocksdb::Iterator *iterator) : iter(iterator) {}
+  database_iterator(database<T> *owner, scan_options options = {})
+      : state(std::make_unique<scan_state>()) {
+    state->options = std::move(options);
 
-  ~database_iterator() { delete iter; }
-
-  bool valid() const { return iter && iter->Valid(); }
+    state->upper_bound = detail::prefix_successor(state->options.prefix);
+    if (state->options.upper_bound &&
+        (!state->upper_bound ||
+         *state->options.upper_bound < *state->upper_bound)) {
+      state->upper_bound = state->options.upper_bound;
+    }
 
-  mutable value_type current;
-  reference operator*() {
-    if (cache_iter) {
-      return *cache_iter.value();
+    rocksdb::ReadOptions read_options;
+    read_options.readahead_size = state->options.readahead_size;
+    read_options.fill_cache = state->options.fill_cache;
+    read_options.snapshot = state->options.snapshot.get();
+    if (state->upper_bound) {
+      state->upper_bound_slice = rocksdb::Slice(*state->upper_bound);
+      read_options.iterate_upper_bound = &state->upper_bound_slice;
     }
 
-    if (!valid()) {
-      throw std::runtime_error("Iterator is not valid");
-    }
-    auto key = iter->key().ToString();
-    auto packed_value = iter->value().ToString();
-    auto value = struct_pack::deserialize<T>(packed_value);
-    if (value) {
-      // current = {key, *value};
-      throw std::runtime_error("unimplemented");
-      return current;
+    std::vector<rocksdb::ColumnFamilyHandle *> families;
+    if constexpr (std::is_same_v<V, T>) {
+      for (size_t i = 0; i < part_count<T>; ++i) {
+        families.push_back(owner->part_handle(i));
+      }
     } else {
-      throw std::runtime_error("Failed to deserialize value");
+      families.push_back(owner->part_handle(part_index<T, V>));
     }
-  }
-  value_type operator*() const {
-    if (cache_iter) {
-      return {cache_iter.value()->first, cache_iter.value()->second};
+    bool with_legacy = layout<T>::split && owner->has_legacy_values;
+    if (with_legacy) {
+      families.push_back(owner->handles[0]);
     }
 
-    if (!valid()) {
-      throw std::runtime_error("Iterator is not valid");
+    // NewIterators gives one consistent view over all families.
+    std::vector<rocksdb::Iterator *> iterators;
+    auto s = owner->db->NewIterators(read_options, families, &iterators);
+    if (!s.ok()) {
+      ELOGFMT(ERROR, "Failed to create database iterator: {}", s.ToString());
+      state.reset();
+      return;
     }
-    auto key = iter->key().ToString();
-    auto packed_value = iter->value().ToString();
-    auto value = struct_pack::deserialize<T>(packed_value);
-    if (value) {
-      return {key, *value};
-    } else {
-      throw std::runtime_error("Failed to deserialize value");
+    for (auto *iterator : iterators) {
+      state->iters.emplace_back(iterator);
+    }
+    if (with_legacy) {
+      state->legacy = std::move(state->iters.back());
+      state->iters.pop_back();
     }
+
+    auto &lower_bound = state->options.lower_bound;
+    seek(lower_bound && *lower_bound > state->options.prefix
+             ? *lower_bound
+             : state->options.prefix);
   }
 
-  database_iterator &operator++() {
-    if (cache_iter) {
-      ++(*cache_iter);
-      return *this;
-    } else {
-      iter->Next();
-      return *this;
+  bool valid() const {
+    return state && (state->iters[0]->Valid() ||
+                     (state->legacy && state->legacy->Valid()));
+  }
+
+  // Positions the iterator at the first key that is not less than `target`.
+  void seek(std::string_view target) {
+    if (!state) {
+      return;
+    }
+    auto position = [&](rocksdb::Iterator &iter) {
+      if (target.empty()) {
+        iter.SeekToFirst();
+      } else {
+        iter.Seek(rocksdb::Slice(target.data(), target.size()));
+      }
+    };
+    position(*state->iters[0]);
+    if (state->legacy) {
+      position(*state->legacy);
     }
+    settle();
   }
 
-  database_iterator operator++(int) {
-    database_iterator temp = *this;
-    ++(*this);
-    return temp;
+  // Current key, without decoding the value.
+  std::string_view key() const { return detail::view(source().key()); }
+
+  // Decodes the current value, reporting failures instead of throwing.
+  std::expected<void, std::string> try_decode() const {
+    if (!valid()) {
+      return std::unexpected<std::string>("Iterator is not valid");
+    }
+    if (state->decoded) {
+      return {};
+    }
+
+    state->current.first.assign(key());
+    auto value = state->from_legacy ? decode_legacy() : decode_primary();
+    if (!value) {
+      return std::unexpected(value.error());
+    }
+    state->current.second = std::move(*value);
+    state->decoded = true;
+    return {};
   }
 
-  bool operator==(const database_iterator &other) const {
-    if (cache_iter) {
-      return cache_iter == other.cache_iter;
+  reference operator*() const {
+    if (auto res = try_decode(); !res) {
+      throw std::runtime_error(res.error());
     }
+    return state->current;
+  }
 
-    if (!this->valid() && !other.valid()) {
-      return true;
+  pointer operator->() const { return &**this; }
+
+  database_iterator &operator++() {
+    auto current = std::string(key());
+    rocksdb::Slice current_slice(current);
+    if (state->iters[0]->Valid() && state->iters[0]->key() == current_slice) {
+      state->iters[0]->Next();
     }
-    if (!this->valid() || !other.valid()) {
-      return false;
+    if (state->legacy && state->legacy->Valid() &&
+        state->legacy->key() == current_slice) {
+      state->legacy->Next();
     }
+    settle();
+    return *this;
+  }
 
-    return (iter->key().compare(other.iter->key()) == 0 &&
-            iter->value().compare(other.iter->value()) == 0);
+  void operator++(int) { ++(*this); }
+
+  bool operator==(const database_iterator &other) const {
+    if (!valid() || !other.valid()) {
+      return valid() == other.valid();
+    }
+    return state == other.state;
   }
 
   bool operator!=(const database_iterator &other) const {
     return !(*this == other);
   }
+
+private:
+  // Kept on the heap so the upper bound slice referenced by ReadOptions stays
+  // put when the iterator itself is moved.
+  struct scan_state {
+    scan_options options;
+    std::optional<std::string> upper_bound;
+    rocksdb::Slice upper_bound_slice;
+    // iters[0] drives the scan, the others are secondary families that are
+    // aligned to it when a whole value is decoded.
+    std::vector<std::unique_ptr<rocksdb::Iterator>> iters;
+    // Default family holding values written before the split into families.
+    std::unique_ptr<rocksdb::Iterator> legacy;
+    bool from_legacy = false;
+    // Reused across steps, so the key buffer is allocated once per scan.
+    value_type current;
+    bool decoded = false;
+  };
+  std::unique_ptr<scan_state> state;
+
+  rocksdb::Iterator &source() const {
+    return state->from_legacy ? *state->legacy : *state->iters[0];
+  }
+
+  void settle() {
+    state->decoded = false;
+    auto &primary = *state->iters[0];
+    bool legacy_valid = state->legacy && state->legacy->Valid();
+    state->from_legacy =
+        legacy_valid &&
+        (!primary.Valid() || state->legacy->key().compare(primary.key()) < 0);
+
+    for (auto *iter : {state->iters[0].get(), state->legacy.get()}) {
+      if (iter && !iter->Valid() && !iter->status().ok()) {
+        ELOGFMT(ERROR, "Database iterator failed: {}",
+                iter->status().ToString());
+      }
+    }
+  }
+
+  std::expected<V, std::string> decode_legacy() const {
+    auto value = detail::decode<T>(detail::view(state->legacy->value()));
+    if constexpr (std::is_same_v<V, T>) {
+      return value;
+    } else {
+      if (!value) {
+        return std::unexpected(value.error());
+      }
+      return std::get<V>(T::to_parts(*value));
+    }
+  }
+
+  std::expected<V, std::string> decode_primary() const {
+    if constexpr (!std::is_same_v<V, T> || !layout<T>::split) {
+      return detail::decode<V>(detail::view(state->iters[0]->value()));
+    } else {
+      typename T::families parts;
+      std::string error;
+      auto primary_key = state->iters[0]->key();
+      detail::for_each_index<part_count<T>>([&](auto i) {
+        constexpr size_t I = decltype(i)::value;
+        using P = std::tuple_element_t<I, typename T::families>;
+        if (!error.empty()) {
+          return;
+        }
+
+        auto &iter = *state->iters[I];
+        if constexpr (I > 0) {
+          if (!iter.Valid() || iter.key().compare(primary_key) < 0) {
+            iter.Seek(primary_key);
+          }
+          if (!iter.Valid() || iter.key() != primary_key) {
+            // This family has no part for the key
+            return;
+          }
+        }
+
+        if (auto part = detail::decode<P>(detail::view(iter.value()))) {
+          std::get<I>(parts) = std::move(*part);
+        } else {
+          error = part.error();
+        }
+      });
+
+      if (!error.empty()) {
+        return std::unexpected(error);
+      }
+      return T::from_parts(std::move(parts));
+    }
+  }
+};
+
+template <typename T, typename V = T> struct scan_range {
+  database<T> *owner;
+  scan_options options;
+
+  database_iterator<T, V> begin() const { return {owner, options}; }
+  database_iterator<T, V> end() const { return {}; }
 };
 
 template <typename T> struct database {
-  rocksdb::DB *db;
+  rocksdb::DB *db = nullptr;
   rocksdb::Options options;
   std::string db_path;
 
-  std::optional<std::unordered_map<std::string, T>> cache =
-      std::unordered_map<std::string, T>();
+  // handles[0] is the default family, followed by one handle per part when
+  // T is split over several families and by the metadata family last.
+  std::vector<rocksdb::ColumnFamilyHandle *> handles;
+  static constexpr std::string_view meta_family = "kvdb_meta";
+
+  // Set while the default family still holds whole values written before T
+  // was split over families. Those are read transparently until rewritten.
+  std::atomic<bool> has_legacy_values = false;
+
+  // Serializes writers of the same key, whether or not it is cached. Always
+  // taken before the cache shards, see lock_keys().
+  static constexpr size_t write_lock_count = 64;
+  std::array<std::mutex, write_lock_count> write_locks;
+
+  // Every hot entry lives in the cache as well, sharded so that concurrent
+  // readers and writers only contend on the same shard.
+  std::unique_ptr<sharded_cache<T>> cache =
+      std::make_unique<sharded_cache<T>>();
+
+  // Splits values into a hot tier, kept in the cache, and a cold tier read
+  // from disk through the bloom filters and block cache. Unset keeps every
+  // value cached. Set before open(); values that cool down are moved out of
+  // the cache by demote(). Cold values read by key are promoted into the
+  // cache and stay there as long as they are read between demote() passes.
+  std::function<bool(const T &)> hot;
+
+  // Keys of cold values read since the last demote()
+  std::mutex read_cold_mutex;
+  std::unordered_set<std::string> read_cold;
+
+  // Runs the async_* calls, which run inline when unset.
+  std::shared_ptr<io_pool> io;
+
+  std::optional<tuning_options> tuning;
+  std::unordered_map<std::string, tuning_options> family_tuning;
+  std::shared_ptr<rocksdb::Cache> block_cache;
+  // Compaction filters by family name, see expire_part().
+  std::unordered_map<std::string, std::shared_ptr<rocksdb::CompactionFilter>>
+      filters;
 
   database(std::string_view db_path) {
     options.create_if_missing = true;
@@ -156,43 +483,146 @@ template <typename T> struct database {
 
     this->db_path = db_path;
   }
+
+  // Must be called before open(). Applies to every column family without a
+  // tune_family() override, all of them sharing one block cache.
+  void tune(const tuning_options &tuning) { this->tuning = tuning; }
+
+  // Per family settings, with a block cache of its own.
+  void tune_family(std::string name, const tuning_options &tuning) {
+    family_tuning.insert_or_assign(std::move(name), tuning);
+  }
+
+  // Must be called before open(). Records of part P for which
+  // `expired(key, part)` holds are dropped when their family is compacted,
+  // `on_expired` is told about each of them. Dropping the primary part
+  // removes the record, so the other parts should expire along with it.
+  // Dropping another part reads as a default constructed P. The cache is not
+  // touched, see reload().
+  template <typename P = T>
+  void expire_part(typename expiry_filter<P>::predicate expired,
+                   typename expiry_filter<P>::listener on_expired = {}) {
+    static_assert(part_index<T, P> < part_count<T>, "P is not a part of T");
+    std::string name = layout<T>::split ? std::string(P::family_name)
+                                        : rocksdb::kDefaultColumnFamilyName;
+    filters.insert_or_assign(
+        std::move(name),
+        std::make_shared<expiry_filter<P>>(
+            std::move(expired), std::move(on_expired),
+            [](std::string_view packed, P &value) {
+              auto decoded = detail::decode<P>(packed);
+              if (!decoded) {
+                return false;
+              }
+              value = std::move(*decoded);
+              return true;
+            }));
+  }
+
+  rocksdb::ColumnFamilyHandle *part_handle(size_t index) const {
+    return handles[layout<T>::split ? index + 1 : 0];
+  }
+
+  // Holds schema version and checkpoints, never visible to scans.
+  rocksdb::ColumnFamilyHandle *meta_handle() const { return handles.back(); }
+
   std::expected<void, std::string> open() {
-    rocksdb::Status s = rocksdb::DB::Open(options, db_path, &db);
+    if (tuning) {
+      if (auto res = check_tuning(*tuning); !res) {
+        return std::unexpected(db_path + ": " + res.error());
+      }
+    }
+    for (auto &[name, family] : family_tuning) {
+      if (auto res = check_tuning(family); !res) {
+        return std::unexpected(db_path + " family " + name + ": " +
+                               res.error());
+      }
+    }
+
+    auto family_options = [&](const std::string &name) {
+      rocksdb::ColumnFamilyOptions cf_options(options);
+      if (auto it = family_tuning.find(name); it != family_tuning.end()) {
+        std::shared_ptr<rocksdb::Cache> family_cache;
+        apply_tuning(it->second, cf_options, family_cache);
+      } else if (tuning) {
+        apply_tuning(*tuning, cf_options, block_cache);
+      }
+      if (auto it = filters.find(name); it != filters.end()) {
+        cf_options.compaction_filter = it->second.get();
+      }
+      return cf_options;
+    };
+
+    std::vector<rocksdb::ColumnFamilyDescriptor> descriptors;
+    descriptors.emplace_back(
+        rocksdb::kDefaultColumnFamilyName,
+        family_options(rocksdb::kDefaultColumnFamilyName));
+    if constexpr (layout<T>::split) {
+      detail::for_each_index<part_count<T>>([&](auto i) {
+        using P = std::tuple_element_t<decltype(i)::value,
+                                       typename layout<T>::parts>;
+        auto name = std::string(P::family_name);
+        descriptors.emplace_back(name, family_options(name));
+      });
+    }
+    descriptors.emplace_back(std::string(meta_family),
+                             rocksdb::ColumnFamilyOptions(options));
+    options.create_missing_column_families = true;
+
+    rocksdb::Status s = rocksdb::DB::Open(rocksdb::DBOptions(options), db_path,
+                                          descriptors, &handles, &db);
 
     if (s.ok()) {
+      if constexpr (layout<T>::split) {
+        std::unique_ptr<rocksdb::Iterator> it(
+            db->NewIterator(rocksdb::ReadOptions(), handles[0]));
+        it->SeekToFirst();
+        has_legacy_values = it->Valid();
+        if (has_legacy_values) {
+          ELOGFMT(INFO, "{} still has values from before the column family "
+                        "split, reading them from the default family",
+                  db_path);
+        }
+      }
+
       if (cache) {
         cache->clear();
-        auto it = db->NewIterator(rocksdb::ReadOptions());
-        it->SeekToFirst();
-        for (; it->Valid(); it->Next()) {
-          auto key = it->key().ToString();
-          auto packed_value = it->value().ToString();
-          auto value = struct_pack::deserialize<T>(packed_value);
-          if (value) {
-            cache->emplace(key, *value);
-          } else {
-            // return std::unexpected("Failed to deserialize value: " +
-            //                        value.error());
-            ELOGFMT(ERROR, "Failed to deserialize value");
-            // If deserialization fails, remove the key from the database
-            if(auto res = remove(key); res.has_value()) {
-              ELOGFMT(ERROR, "Failed to remove key {}: {}", key, res.error());
-            } else {
-              ELOGFMT(INFO, "Removed key due to deserialization failure");
+        size_t undecodable = 0;
+        for (auto it = begin(); it.valid(); ++it) {
+          if (auto res = it.try_decode(); res) {
+            if (is_hot(it->second)) {
+              cache->insert_or_assign(it.key(), std::move(it->second));
             }
+          } else {
+            // Kept on disk, a later migration or layout may still read it
+            ELOGFMT(ERROR, "Failed to deserialize value of key {}: {}",
+                    it.key(), res.error());
+            undecodable++;
           }
         }
+        if (undecodable) {
+          ELOGFMT(WARNING, "{} values in {} could not be decoded", undecodable,
+                  db_path);
+        }
       }
       return {};
     } else {
       return std::unexpected(s.ToString());
     }
   }
-  ~database() { delete db; }
+  ~database() {
+    if (!db) {
+      return;
+    }
+    for (auto *handle : handles) {
+      db->DestroyColumnFamilyHandle(handle);
+    }
+    delete db;
+  }
   std::expected<std::string, std::string> get_raw(std::string_view key) {
     std::string value;
 
-    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), key, &value);
+    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), handles[0], key, &value);
     if (s.ok()) {
       return value;
     } else {
@@ -200,44 +630,222 @@ template <typename T> struct database {
     }
   }
   bool has(std::string_view key) {
-    if (cache) {
-      return cache->contains(std::string(key));
+    if (cache && cache->contains(key)) {
+      return true;
+    } else if (cache && !hot) {
+      return false;
     } else {
       std::string value;
-      rocksdb::Status s = db->Get(rocksdb::ReadOptions(), key, &value);
+      rocksdb::Status s =
+          db->Get(rocksdb::ReadOptions(), part_handle(0), key, &value);
+      if (layout<T>::split && s.IsNotFound() && has_legacy_values) {
+        s = db->Get(rocksdb::ReadOptions(), handles[0], key, &value);
+      }
       return s.ok();
     }
   }
+  // Writes straight to the default family, bypassing the cache.
   bool put_raw(std::string_view key, std::string_view value) {
-    rocksdb::Status s = db->Put(rocksdb::WriteOptions(), key, value);
+    rocksdb::Status s =
+        db->Put(rocksdb::WriteOptions(), handles[0], key, value);
     return s.ok();
   }
 
+  // Adds the writes storing `value` under `key` to `batch`.
+  void encode_into(rocksdb::WriteBatch &batch, std::string_view key,
+                   const T &value) {
+    if constexpr (layout<T>::split) {
+      auto parts = T::to_parts(value);
+      detail::for_each_index<part_count<T>>([&](auto i) {
+        constexpr size_t I = decltype(i)::value;
+        batch.Put(part_handle(I), key,
+                  struct_pack::serialize<std::string>(std::get<I>(parts)));
+      });
+      if (has_legacy_values) {
+        batch.Delete(handles[0], key);
+      }
+    } else {
+      batch.Put(handles[0], key, struct_pack::serialize<std::string, T>(value));
+    }
+  }
+
+  // Adds the writes removing `key` from every data family to `batch`.
+  void erase_from(rocksdb::WriteBatch &batch, std::string_view key) {
+    for (size_t i = 0; i + 1 < handles.size(); ++i) {
+      batch.Delete(handles[i], key);
+    }
+  }
+
+  std::optional<std::string> get_meta(std::string_view name) {
+    std::string value;
+    if (db->Get(rocksdb::ReadOptions(), meta_handle(), name, &value).ok()) {
+      return value;
+    }
+    return std::nullopt;
+  }
+
+  bool put_meta(std::string_view name, std::string_view value) {
+    return db->Put(rocksdb::WriteOptions(), meta_handle(), name, value).ok();
+  }
+
+  bool remove_meta(std::string_view name) {
+    return db->Delete(rocksdb::WriteOptions(), meta_handle(), name).ok();
+  }
+
+  // Version of the stored data, 0 for databases that never recorded one.
+  std::expected<uint32_t, std::string> schema_version() {
+    auto value = get_meta("schema_version");
+    if (!value) {
+      return 0;
+    }
+    uint32_t version;
+    auto [end, ec] =
+        std::from_chars(value->data(), value->data() + value->size(), version);
+    if (ec != std::errc() || end != value->data() + value->size()) {
+      return std::unexpected("Damaged schema version: '" + *value + "'");
+    }
+    return version;
+  }
+
+  bool set_schema_version(uint32_t version) {
+    return put_meta("schema_version", std::to_string(version));
+  }
+
+  static size_t write_lock_index(std::string_view key) {
+    return std::hash<std::string_view>{}(key) % write_lock_count;
+  }
+
+  // Holds off every other write of `keys` until the returned locks are
+  // released, so that a value can be read and rewritten atomically. Changes
+  // made meanwhile are committed with transaction_batch::write().
+  template <typename Keys>
+  std::vector<std::unique_lock<std::mutex>> lock_keys(Keys &&keys) {
+    std::vector<size_t> indexes;
+    for (const auto &key : keys) {
+      indexes.push_back(write_lock_index(key));
+    }
+    std::ranges::sort(indexes);
+    indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(indexes.size());
+    for (auto index : indexes) {
+      locks.emplace_back(write_locks[index]);
+    }
+    return locks;
+  }
+
   bool put(std::string_view key, const T &value) {
-    auto packed_value = struct_pack::serialize<std::string, T>(value);
-    if (cache) {
-      cache->emplace(key, value);
+    rocksdb::WriteBatch batch;
+    encode_into(batch, key, value);
+    // Held across the write, so concurrent writers of the same key update
+    // disk and cache in the same order.
+    std::unique_lock write_lock(write_locks[write_lock_index(key)]);
+    if (!cache) {
+      return db->Write(rocksdb::WriteOptions(), &batch).ok();
     }
-    return put_raw(key, packed_value);
+
+    auto &shard = cache->shard_for(key);
+    std::unique_lock lock(shard.mutex);
+    if (!db->Write(rocksdb::WriteOptions(), &batch).ok()) {
+      return false;
+    }
+    if (is_hot(value)) {
+      shard.map.insert_or_assign(std::string(key), value);
+    } else if (auto it = shard.map.find(key); it != shard.map.end()) {
+      shard.map.erase(it);
+    }
+    return true;
   }
 
   std::expected<T, std::string> get(std::string_view key) {
+    if (auto cached = find_cached(key)) {
+      return std::move(*cached);
+    }
+    if (cache && hot) {
+      // Held from the read until the value is promoted, so a concurrent put
+      // is never overwritten in the cache by the older value
+      std::unique_lock write_lock(write_locks[write_lock_index(key)]);
+      auto value = std::move(fetch(std::span(&key, 1))[0]);
+      if (value) {
+        promote(key, *value);
+      }
+      return value;
+    }
+    return std::move(fetch(std::span(&key, 1))[0]);
+  }
+
+  // Visits the cached values, that is the hot tier and promoted cold values,
+  // without touching disk.
+  template <typename F> void for_each_cached(F &&visit) const {
     if (cache) {
-      auto it = cache->find(std::string(key));
-      if (it != cache->end()) {
-        return it->second;
+      cache->for_each(std::forward<F>(visit));
+    }
+  }
+
+  // Reads only the column family holding part P of the value.
+  template <typename P>
+    requires layout<T>::split
+  std::expected<P, std::string> get_part(std::string_view key) {
+    if (auto cached = find_cached(key)) {
+      return std::get<P>(T::to_parts(*cached));
+    }
+
+    std::string value;
+    rocksdb::Status s = db->Get(rocksdb::ReadOptions(),
+                                part_handle(part_index<T, P>), key, &value);
+    if (s.ok()) {
+      return detail::decode<P>(value);
+    }
+    if (s.IsNotFound() && has_legacy_values) {
+      s = db->Get(rocksdb::ReadOptions(), handles[0], key, &value);
+      if (s.ok()) {
+        auto legacy = detail::decode<T>(value);
+        if (!legacy) {
+          return std::unexpected(legacy.error());
+        }
+        return std::get<P>(T::to_parts(*legacy));
       }
     }
-    auto packed_value = get_raw(key);
-    if (packed_value.has_value()) {
-      if (auto val = struct_pack::deserialize<T>(packed_value.value()); val) {
-        return *val;
-      } else {
-        return std::unexpected("Failed to deserialize value: " + val.error());
+    return std::unexpected(s.ToString());
+  }
+
+  // Looks up a batch of keys at once. Keys present in the cache are served
+  // from memory, the remaining ones are fetched from RocksDB with a single
+  // MultiGet call. Results are returned in the same order as `keys`.
+  std::vector<std::expected<T, std::string>>
+  get_many(std::span<const std::string> keys) {
+    std::vector<std::expected<T, std::string>> results(
+        keys.size(), std::unexpected<std::string>("NotFound: "));
+
+    std::vector<size_t> missing;
+    std::vector<std::string_view> missing_keys;
+    missing.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (auto cached = find_cached(keys[i])) {
+        results[i] = std::move(*cached);
+        continue;
       }
-    } else {
-      return std::unexpected(packed_value.error());
+      missing.push_back(i);
+      missing_keys.push_back(keys[i]);
+    }
+
+    if (missing.empty()) {
+      return results;
+    }
+
+    // Cold values are promoted, see get()
+    std::vector<std::unique_lock<std::mutex>> locks;
+    if (cache && hot) {
+      locks = lock_keys(missing_keys);
+    }
+    auto fetched = fetch(missing_keys);
+    for (size_t j = 0; j < missing.size(); ++j) {
+      if (fetched[j] && cache && hot) {
+        promote(missing_keys[j], *fetched[j]);
+      }
+      results[missing[j]] = std::move(fetched[j]);
     }
+    return results;
   }
 
   void with_transaction(
@@ -248,10 +856,18 @@ template <typename T> struct database {
   }
 
   std::expected<void, std::string> remove(std::string_view key) {
-    rocksdb::Status s = db->Delete(rocksdb::WriteOptions(), key);
+    std::unique_lock write_lock(write_locks[write_lock_index(key)]);
+    std::unique_lock<std::shared_mutex> lock;
+    if (cache) {
+      lock = std::unique_lock(cache->shard_for(key).mutex);
+    }
+
+    rocksdb::WriteBatch batch;
+    erase_from(batch, key);
+    rocksdb::Status s = db->Write(rocksdb::WriteOptions(), &batch);
     if (s.ok()) {
       if (cache) {
-        cache->erase(std::string(key));
+        cache->shard_for(key).map.erase(std::string(key));
       }
       return {};
     } else {
@@ -259,29 +875,361 @@ template <typename T> struct database {
     }
   }
 
-  database_iterator<T> begin();
-  database_iterator<T> end();
+  // Pins a consistent view of the database, released with the last copy of
+  // the returned pointer. Writes made afterwards are not visible through it.
+  std::shared_ptr<const rocksdb::Snapshot> snapshot() {
+    return std::shared_ptr<const rocksdb::Snapshot>(
+        db->GetSnapshot(),
+        [db = db](const rocksdb::Snapshot *s) { db->ReleaseSnapshot(s); });
+  }
+
+  // Writes a point-in-time copy of the database to `dir`, which must not
+  // exist yet. SST files are hard-linked, so this is cheap on one filesystem.
+  std::expected<void, std::string> checkpoint(const std::string &dir) {
+    rocksdb::Checkpoint *raw = nullptr;
+    auto s = rocksdb::Checkpoint::Create(db, &raw);
+    if (!s.ok()) {
+      return std::unexpected(s.ToString());
+    }
+    std::unique_ptr<rocksdb::Checkpoint> checkpoint(raw);
+    s = checkpoint->CreateCheckpoint(dir);
+    if (!s.ok()) {
+      return std::unexpected(s.ToString());
+    }
+    return {};
+  }
+
+  // Adds an incremental backup to `backup_dir` while the database stays
+  // online. Files already backed up are shared, not copied again. Keeps the
+  // `keep` most recent backups, all of them if 0. Returns the backup id.
+  std::expected<uint32_t, std::string> backup(const std::string &backup_dir,
+                                               uint32_t keep = 0) {
+    rocksdb::BackupEngine *raw = nullptr;
+    auto s = rocksdb::BackupEngine::Open(
+        rocksdb::Env::Default(), rocksdb::BackupEngineOptions(backup_dir),
+        &raw);
+    if (!s.ok()) {
+      return std::unexpected(s.ToString());
+    }
+    std::unique_ptr<rocksdb::BackupEngine> engine(raw);
+
+    rocksdb::CreateBackupOptions backup_options;
+    backup_options.flush_before_backup = true;
+    rocksdb::BackupID id = 0;
+    s = engine->CreateNewBackup(backup_options, db, &id);
+    if (!s.ok()) {
+      return std::unexpected(s.ToString());
+    }
+    if (keep) {
+      if (s = engine->PurgeOldBackups(keep); !s.ok()) {
+        ELOGFMT(WARNING, "Failed to purge old backups of {}: {}", db_path,
+                s.ToString());
+      }
+    }
+    return id;
+  }
+
+  // Awaitable versions of the calls above for coroutines. Cache hits are
+  // answered inline, everything touching RocksDB runs on the io pool.
+  async_simple::coro::Lazy<std::expected<T, std::string>>
+  async_get(std::string key) {
+    if (auto cached = find_cached(key)) {
+      co_return std::move(*cached);
+    }
+    co_return co_await offload([this, key = std::move(key)] { return get(key); });
+  }
+
+  async_simple::coro::Lazy<bool> async_has(std::string key) {
+    if (cache && cache->contains(key)) {
+      co_return true;
+    }
+    co_return co_await offload([this, key = std::move(key)] { return has(key); });
+  }
+
+  async_simple::coro::Lazy<std::vector<std::expected<T, std::string>>>
+  async_get_many(std::vector<std::string> keys) {
+    co_return co_await offload(
+        [this, keys = std::move(keys)] { return get_many(keys); });
+  }
+
+  async_simple::coro::Lazy<bool> async_put(std::string key, T value) {
+    co_return co_await offload(
+        [this, key = std::move(key), value = std::move(value)] {
+          return put(key, value);
+        });
+  }
+
+  async_simple::coro::Lazy<std::expected<void, std::string>>
+  async_remove(std::string key) {
+    co_return co_await offload(
+        [this, key = std::move(key)] { return remove(key); });
+  }
+
+  // Runs blocking work against this database on the io pool.
+  template <typename F>
+  async_simple::coro::Lazy<std::invoke_result_t<F &>> offload(F f) {
+    if (!io) {
+      co_return f();
+    }
+    co_return co_await io->run(std::move(f));
+  }
+
+  // Compacts every data family, which applies the expire_part() filters to
+  // all records instead of waiting for compactions to reach them.
+  std::expected<void, std::string> compact() {
+    rocksdb::CompactRangeOptions compact_options;
+    compact_options.bottommost_level_compaction =
+        rocksdb::BottommostLevelCompaction::kForce;
+    for (size_t i = 0; i + 1 < handles.size(); ++i) {
+      auto s = db->CompactRange(compact_options, handles[i], nullptr, nullptr);
+      if (!s.ok()) {
+        return std::unexpected(s.ToString());
+      }
+    }
+    return {};
+  }
+
+  // Reloads the cached values of `keys` from disk, dropping those that are
+  // gone. Needed after records changed underneath the cache, such as parts
+  // dropped by an expire_part() filter.
+  void reload(std::span<const std::string> keys) {
+    if (!cache) {
+      return;
+    }
+    for (const auto &key : keys) {
+      // The write lock keeps a concurrent put from being overwritten by the
+      // value read here, the shard is only locked once it has been read
+      std::unique_lock write_lock(write_locks[write_lock_index(key)]);
+      std::string_view view = key;
+      auto value = std::move(fetch(std::span(&view, 1))[0]);
+      auto &shard = cache->shard_for(key);
+      std::unique_lock lock(shard.mutex);
+      if (value && is_hot(*value)) {
+        shard.map.insert_or_assign(key, std::move(*value));
+      } else if (auto it = shard.map.find(key); it != shard.map.end()) {
+        shard.map.erase(it);
+      }
+    }
+  }
+
+  bool is_hot(const T &value) const { return !hot || hot(value); }
+
+  // Moves the cached values that are no longer hot and were not read since
+  // the previous call to the cold tier, that is drops them from the cache.
+  // Returns how many were moved.
+  size_t demote() {
+    if (!cache || !hot) {
+      return 0;
+    }
+    std::unordered_set<std::string> read;
+    {
+      std::lock_guard lock(read_cold_mutex);
+      read.swap(read_cold);
+    }
+    return cache->erase_if([&](const std::string &key, const T &value) {
+      return !hot(value) && !read.contains(key);
+    });
+  }
+
+  // Commits a batch built with transaction_batch(this).
+  async_simple::coro::Lazy<void> async_write(transaction_batch<T> batch) {
+    co_await offload([batch = std::move(batch)]() mutable { batch.commit(); });
+  }
+
+  // Full scans and range scans read straight from disk, so memory use stays
+  // constant regardless of the database size.
+  database_iterator<T> begin() { return {this}; }
+  database_iterator<T> end() { return {}; }
+
+  scan_range<T> scan(scan_options options = {}) {
+    return {this, std::move(options)};
+  }
+
+  // Scans a single column family, without touching the other parts.
+  template <typename P>
+    requires layout<T>::split
+  scan_range<T, P> scan_part(scan_options options = {}) {
+    return {this, std::move(options)};
+  }
+
+private:
+  // Cache lookup that records reads of promoted cold values, see demote().
+  std::optional<T> find_cached(std::string_view key) {
+    if (!cache) {
+      return std::nullopt;
+    }
+    auto cached = cache->find(key);
+    if (cached && hot && !hot(*cached)) {
+      std::lock_guard lock(read_cold_mutex);
+      read_cold.emplace(key);
+    }
+    return cached;
+  }
+
+  // Caches a value read from disk. The caller holds the write lock of `key`.
+  void promote(std::string_view key, const T &value) {
+    {
+      auto &shard = cache->shard_for(key);
+      std::unique_lock lock(shard.mutex);
+      shard.map.insert_or_assign(std::string(key), value);
+    }
+    if (!hot(value)) {
+      std::lock_guard lock(read_cold_mutex);
+      read_cold.emplace(key);
+    }
+  }
+
+  // Reads every part of `keys` with one multi-family MultiGet, falling back
+  // to the default family for values not split into families yet.
+  std::vector<std::expected<T, std::string>>
+  fetch(std::span<const std::string_view> keys) {
+    constexpr size_t families = part_count<T>;
+    const size_t count = keys.size() * families;
+
+    std::vector<rocksdb::ColumnFamilyHandle *> cfs(count);
+    std::vector<rocksdb::Slice> slices(count);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      for (size_t f = 0; f < families; ++f) {
+        cfs[i * families + f] = part_handle(f);
+        slices[i * families + f] =
+            rocksdb::Slice(keys[i].data(), keys[i].size());
+      }
+    }
+    std::vector<rocksdb::PinnableSlice> values(count);
+    std::vector<rocksdb::Status> statuses(count);
+    db->MultiGet(rocksdb::ReadOptions(), count, cfs.data(), slices.data(),
+                 values.data(), statuses.data());
+
+    std::vector<std::expected<T, std::string>> results;
+    results.reserve(keys.size());
+    std::vector<size_t> legacy;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      auto offset = i * families;
+      if (layout<T>::split && statuses[offset].IsNotFound() &&
+          has_legacy_values) {
+        legacy.push_back(i);
+        results.emplace_back(std::unexpected<std::string>("NotFound: "));
+        continue;
+      }
+      results.push_back(
+          assemble(std::span(values).subspan(offset, families),
+                   std::span(statuses).subspan(offset, families)));
+    }
+
+    if (!legacy.empty()) {
+      std::vector<rocksdb::Slice> legacy_slices;
+      for (auto i : legacy) {
+        legacy_slices.emplace_back(keys[i].data(), keys[i].size());
+      }
+      std::vector<rocksdb::PinnableSlice> legacy_values(legacy.size());
+      std::vector<rocksdb::Status> legacy_statuses(legacy.size());
+      db->MultiGet(rocksdb::ReadOptions(), handles[0], legacy.size(),
+                   legacy_slices.data(), legacy_values.data(),
+                   legacy_statuses.data());
+      for (size_t j = 0; j < legacy.size(); ++j) {
+        if (legacy_statuses[j].ok()) {
+          results[legacy[j]] =
+              detail::decode<T>(detail::view(legacy_values[j]));
+        } else {
+          results[legacy[j]] = std::unexpected(legacy_statuses[j].ToString());
+        }
+      }
+    }
+    return results;
+  }
+
+  // Builds a value from the per-family lookups of a single key.
+  static std::expected<T, std::string>
+  assemble(std::span<rocksdb::PinnableSlice> values,
+           std::span<rocksdb::Status> statuses) {
+    if (!statuses[0].ok()) {
+      return std::unexpected(statuses[0].ToString());
+    }
+    if constexpr (!layout<T>::split) {
+      return detail::decode<T>(detail::view(values[0]));
+    } else {
+      typename T::families parts;
+      std::string error;
+      detail::for_each_index<part_count<T>>([&](auto i) {
+        constexpr size_t I = decltype(i)::value;
+        using P = std::tuple_element_t<I, typename T::families>;
+        if (!error.empty()) {
+          return;
+        }
+        if (statuses[I].ok()) {
+          if (auto part = detail::decode<P>(detail::view(values[I]))) {
+            std::get<I>(parts) = std::move(*part);
+          } else {
+            error = part.error();
+          }
+        } else if (!statuses[I].IsNotFound()) {
+          error = statuses[I].ToString();
+        }
+      });
+      if (!error.empty()) {
+        return std::unexpected(error);
+      }
+      return T::from_parts(std::move(parts));
+    }
+  }
 };
-template <typename T> inline database_iterator<T> database<T>::end() {
-  auto e = database_iterator<T>();
-  if (cache) {
-    e.cache_iter = cache->end();
+
+// Restores a backup made by database::backup() into `db_path`, the latest one
+// unless `id` is given. The database must not be open.
+inline std::expected<void, std::string>
+restore_backup(const std::string &backup_dir, const std::string &db_path,
+               std::optional<uint32_t> id = std::nullopt) {
+  rocksdb::BackupEngineReadOnly *raw = nullptr;
+  auto s = rocksdb::BackupEngineReadOnly::Open(
+      rocksdb::Env::Default(), rocksdb::BackupEngineOptions(backup_dir), &raw);
+  if (!s.ok()) {
+    return std::unexpected(s.ToString());
   }
-  return e;
-}
+  std::unique_ptr<rocksdb::BackupEngineReadOnly> engine(raw);
 
-template <typename T> inline database_iterator<T> database<T>::begin() {
-  auto b = database_iterator<T>(db);
-  if (cache) {
-    b.cache_iter = cache->begin();
+  s = id ? engine->RestoreDBFromBackup(*id, db_path, db_path)
+         : engine->RestoreDBFromLatestBackup(db_path, db_path);
+  if (!s.ok()) {
+    return std::unexpected(s.ToString());
   }
-  return b;
+  return {};
 }
 
 template <typename T> inline void transaction_batch<T>::commit() {
+  auto locks = db->lock_keys(cache_updates | std::views::keys);
+  write();
+}
+
+template <typename T> inline void transaction_batch<T>::write() {
+  // Lock every touched shard in index order, then write and publish the cache
+  // updates while no reader can observe a half-applied batch.
+  std::vector<std::unique_lock<std::shared_mutex>> locks;
+  if (db->cache) {
+    std::vector<size_t> shards;
+    for (const auto &[key, _] : cache_updates) {
+      shards.push_back(sharded_cache<T>::shard_index(key));
+    }
+    std::ranges::sort(shards);
+    shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+    for (auto index : shards) {
+      locks.emplace_back(db->cache->shards[index].mutex);
+    }
+  }
+
   rocksdb::Status s = db->db->Write(rocksdb::WriteOptions(), &batch);
   if (!s.ok()) {
     throw std::runtime_error("Transaction commit failed: " + s.ToString());
   }
+
+  if (db->cache) {
+    for (auto &[key, value] : cache_updates) {
+      auto &map = db->cache->shard_for(key).map;
+      if (value && db->is_hot(*value)) {
+        map.insert_or_assign(key, std::move(*value));
+      } else {
+        map.erase(key);
+      }
+    }
+  }
 }
-}; // namespace kvdb
\ No newline at end of file
+}; // namespace kvdb
@@ -0,0 +1,49 @@
+#pragma once
+#include <functional>
+#include <string_view>
+
+#include "rocksdb/compaction_filter.h"
+#include "rocksdb/slice.h"
+
+namespace kvdb {
+// Drops the records of one column family for which `expired(key, value)`
+// holds while they are compacted, so expiry costs nothing on the write or
+// read path. Both callbacks run on RocksDB's compaction threads and must be
+// thread safe. `decode` turns the stored bytes back into P and returns false
+// for values it cannot read, those are always kept.
+template <typename P> class expiry_filter : public rocksdb::CompactionFilter {
+public:
+  using predicate = std::function<bool(std::string_view key, const P &value)>;
+  using listener = std::function<void(std::string_view key)>;
+  using decoder = std::function<bool(std::string_view packed, P &value)>;
+
+  expiry_filter(predicate expired, listener on_expired, decoder decode)
+      : expired_(std::move(expired)), on_expired_(std::move(on_expired)),
+        decode_(std::move(decode)) {}
+
+  bool Filter(int, const rocksdb::Slice &key,
+              const rocksdb::Slice &existing_value, std::string *,
+              bool *) const override {
+    P value;
+    if (!decode_(std::string_view(existing_value.data(), existing_value.size()),
+                 value)) {
+      return false;
+    }
+    std::string_view key_view(key.data(), key.size());
+    if (!expired_(key_view, value)) {
+      return false;
+    }
+    if (on_expired_) {
+      on_expired_(key_view);
+    }
+    return true;
+  }
+
+  const char *Name() const override { return "kvdb.expiry_filter"; }
+
+private:
+  predicate expired_;
+  listener on_expired_;
+  decoder decode_;
+};
+} // namespace kvdb
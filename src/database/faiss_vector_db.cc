@@ -1,29 +1,42 @@
 #include "faiss_vector_db.h"
 #include "faiss/impl/FaissException.h"
+#include "mapped_file.hpp"
 #include "ylt/easylog.hpp"
 #include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexIDMap.h>
+#include <faiss/IndexIVFFlat.h>
+#include <faiss/IndexIVFPQ.h>
+#include <faiss/IndexScalarQuantizer.h>
+#include <faiss/clone_index.h>
+#include <faiss/impl/IDSelector.h>
+#include <faiss/index_factory.h>
 #include <faiss/index_io.h>
+#include <faiss/utils/distances.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
+#include <unordered_map>
 
-namespace {
-void write_map(
-    const std::string &filename,
-    const std::unordered_map<std::string, faiss::Index::idx_t> &map) {
-  std::ofstream ofs(filename, std::ios::binary);
-  if (!ofs) {
-    throw std::runtime_error("Cannot open file for writing map: " + filename);
-  }
-  size_t map_size = map.size();
-  ofs.write(reinterpret_cast<const char *>(&map_size), sizeof(map_size));
-  for (const auto &pair : map) {
-    size_t key_len = pair.first.length();
-    ofs.write(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
-    ofs.write(pair.first.c_str(), key_len);
-    ofs.write(reinterpret_cast<const char *>(&pair.second),
-              sizeof(pair.second));
-  }
-}
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
+namespace {
 void read_map(const std::string &filename,
               std::unordered_map<std::string, faiss::Index::idx_t> &map) {
   std::ifstream ifs(filename, std::ios::binary);
@@ -55,73 +68,583 @@ void read_map(const std::string &filename,
   }
 }
 
-void write_vector_of_strings(const std::string &filename,
-                             const std::vector<std::string> &vec) {
-  std::ofstream ofs(filename, std::ios::binary);
-  if (!ofs) {
-    throw std::runtime_error(
-        "Cannot open file for writing vector of strings: " + filename);
+// A snapshot is <path>.meta plus files named after its generation:
+//
+// <path>.<generation>.vectors: vectors_header, then the ids in ascending
+// order and the vectors in the same order.
+// <path>.<generation>.keys: keys_header, then the key of each row and the
+// slots of a kvdb::id_table from keys to rows. Snapshots written while keys
+// were strings have string_keys_header, then per row the offset of its key
+// in the blob (plus one past the end), the rows sorted by key and the blob.
+// <path>.<generation>.attrs: attributes_header, then the attributes of the
+// rows as one array per field: chat ids, sender ids, send times and content
+// kinds. Snapshots written before vectors had attributes lack it.
+// <path>.<generation>.bits: codes_header, the mean of the vectors, then per
+// row one bit per dimension telling whether it is above the mean. Only
+// written with FaissIndexOptions::binary_candidates, which flat indexes
+// with float storage alone take.
+// <path>.<generation>.faissidx: the index searched instead of scanning the
+// vectors, for types other than flat once it is built.
+//
+// The first three are used in place through a mapping, so they are laid out
+// with every array aligned to its element size.
+constexpr std::array<char, 8> vectors_magic{'T', 'G', 'V', 'E', 'C', 'S', '0', '1'};
+constexpr std::array<char, 8> string_keys_magic{'T', 'G', 'K', 'E', 'Y', 'S', '0', '1'};
+constexpr std::array<char, 8> keys_magic{'T', 'G', 'K', 'E', 'Y', 'S', '0', '2'};
+constexpr std::array<char, 8> attributes_magic{'T', 'G', 'A', 'T', 'T', 'R', '0', '1'};
+constexpr std::array<char, 8> codes_magic{'T', 'G', 'B', 'I', 'T', 'S', '0', '1'};
+
+struct vectors_header {
+  std::array<char, 8> magic;
+  uint64_t dimension;
+  uint64_t count;
+};
+
+struct keys_header {
+  std::array<char, 8> magic;
+  uint64_t count;
+  // Slots of the table, a power of two
+  uint64_t capacity;
+};
+
+struct string_keys_header {
+  std::array<char, 8> magic;
+  uint64_t count;
+  uint64_t blob_size;
+};
+
+using key_slot = kvdb::id_slot<uint64_t>;
+
+struct attributes_header {
+  std::array<char, 8> magic;
+  uint64_t count;
+};
+
+struct codes_header {
+  std::array<char, 8> magic;
+  uint64_t dimension;
+  uint64_t count;
+};
+
+size_t code_words(size_t dimension) { return (dimension + 63) / 64; }
+
+// Sets bit i of `code` when dimension i of `vector` is above `center`'s.
+// Without the centering most embeddings would share most of their bits.
+void sign_code(const float *vector, const float *center, size_t dimension,
+               uint64_t *code) {
+  std::fill_n(code, code_words(dimension), 0);
+  for (size_t i = 0; i < dimension; ++i) {
+    if (vector[i] > center[i]) {
+      code[i / 64] |= uint64_t{1} << (i % 64);
+    }
+  }
+}
+
+// For each of `queries` codes, the `candidates` selected rows whose codes
+// differ from it in the fewest bits, in no particular order. The codes are
+// read once for all queries.
+template <typename F>
+std::vector<std::vector<uint32_t>>
+hamming_candidates(const uint64_t *codes, size_t rows, size_t words,
+                   const uint64_t *query_codes, size_t queries,
+                   size_t candidates, F selected) {
+  using entry = std::pair<uint32_t, uint32_t>; // distance, row
+  std::vector<std::vector<entry>> heaps(queries);
+  for (auto &heap : heaps) {
+    heap.reserve(candidates);
+  }
+  for (size_t row = 0; row < rows; ++row) {
+    if (!selected(row)) {
+      continue;
+    }
+    auto *code = codes + row * words;
+    for (size_t q = 0; q < queries; ++q) {
+      auto *query = query_codes + q * words;
+      uint32_t distance = 0;
+      for (size_t w = 0; w < words; ++w) {
+        distance += std::popcount(code[w] ^ query[w]);
+      }
+      auto &heap = heaps[q];
+      if (heap.size() < candidates) {
+        heap.emplace_back(distance, static_cast<uint32_t>(row));
+        std::push_heap(heap.begin(), heap.end());
+      } else if (distance < heap.front().first) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = {distance, static_cast<uint32_t>(row)};
+        std::push_heap(heap.begin(), heap.end());
+      }
+    }
   }
-  size_t vec_size = vec.size();
-  ofs.write(reinterpret_cast<const char *>(&vec_size), sizeof(vec_size));
-  for (const auto &str : vec) {
-    size_t str_len = str.length();
-    ofs.write(reinterpret_cast<const char *>(&str_len), sizeof(str_len));
-    ofs.write(str.c_str(), str_len);
+  std::vector<std::vector<uint32_t>> result(queries);
+  for (size_t q = 0; q < queries; ++q) {
+    for (auto &[distance, row] : heaps[q]) {
+      result[q].push_back(row);
+    }
   }
+  return result;
 }
 
-void read_vector_of_strings(const std::string &filename,
-                            std::vector<std::string> &vec) {
-  std::ifstream ifs(filename, std::ios::binary);
-  if (!ifs) {
-    throw std::runtime_error(
-        "Cannot open file for reading vector of strings: " + filename);
+template <typename T>
+const T *view_of(std::string_view bytes, size_t offset, size_t count) {
+  if (offset > bytes.size() || count > (bytes.size() - offset) / sizeof(T)) {
+    return nullptr;
   }
-  vec.clear();
-  size_t vec_size;
-  ifs.read(reinterpret_cast<char *>(&vec_size), sizeof(vec_size));
-  if (ifs.fail())
-    throw std::runtime_error("Failed to read vector size from: " + filename);
+  return reinterpret_cast<const T *>(bytes.data() + offset);
+}
 
-  vec.resize(vec_size);
-  for (size_t i = 0; i < vec_size; ++i) {
-    size_t str_len;
-    ifs.read(reinterpret_cast<char *>(&str_len), sizeof(str_len));
-    if (ifs.fail())
-      throw std::runtime_error("Failed to read string length from: " +
-                               filename);
+std::string_view bytes_of(const kvdb::mapped_file &file) {
+  return {reinterpret_cast<const char *>(file.data()), file.size()};
+}
 
-    std::string str(str_len, '\0');
-    ifs.read(&str[0], str_len);
-    if (ifs.fail())
-      throw std::runtime_error("Failed to read string from: " + filename);
-    vec[i] = str;
+template <typename T> void write_raw(std::ostream &os, const T *data, size_t count) {
+  os.write(reinterpret_cast<const char *>(data), count * sizeof(T));
+}
+
+// Rows whose key is kvdb::empty_id are left out of the table.
+void write_keys(std::ostream &os, const std::vector<uint64_t> &keys) {
+  kvdb::id_table<uint64_t> rows(keys.size());
+  for (size_t row = 0; row < keys.size(); ++row) {
+    if (keys[row] != kvdb::empty_id) {
+      rows.insert_or_assign(keys[row], row);
+    }
+  }
+  keys_header header{keys_magic, keys.size(), rows.slots().size()};
+  write_raw(os, &header, 1);
+  write_raw(os, keys.data(), keys.size());
+  write_raw(os, rows.slots().data(), rows.slots().size());
+}
+
+// The keys file of a snapshot written while keys were strings, in the
+// current layout. Rows without a key for `key_of` or with the key of an
+// earlier row get kvdb::empty_id. Empty if the file is damaged.
+template <typename F>
+std::string keys_from_strings(std::string_view data, F key_of) {
+  auto *header = view_of<string_keys_header>(data, 0, 1);
+  if (!header) {
+    return {};
+  }
+  auto count = header->count;
+  size_t offset = sizeof(string_keys_header);
+  auto *offsets = view_of<uint64_t>(data, offset, count + 1);
+  offset += (count + 1) * sizeof(uint64_t) + count * sizeof(uint32_t);
+  auto *blob = view_of<char>(data, offset, header->blob_size);
+  if (!offsets || !blob || offsets[count] != header->blob_size) {
+    return {};
+  }
+  std::vector<uint64_t> keys(count);
+  kvdb::id_table<bool> seen(count);
+  for (size_t row = 0; row < count; ++row) {
+    if (offsets[row] > offsets[row + 1] || offsets[row + 1] > header->blob_size) {
+      return {};
+    }
+    auto key = key_of(std::string_view(blob + offsets[row],
+                                       offsets[row + 1] - offsets[row]));
+    keys[row] = key && *key != kvdb::empty_id && seen.insert_or_assign(*key, true)
+                    ? *key
+                    : kvdb::empty_id;
+  }
+  std::ostringstream os;
+  write_keys(os, keys);
+  return std::move(os).str();
+}
+
+std::string snapshot_file(const std::string &path, uint64_t generation,
+                          std::string_view kind) {
+  return std::format("{}.{}.{}", path, generation, kind);
+}
+
+std::filesystem::path directory_of(const std::string &path) {
+  std::filesystem::path base(path);
+  return base.has_parent_path() ? base.parent_path()
+                                : std::filesystem::path(".");
+}
+
+// Removes the files of every snapshot of `path` but `keep`, including those
+// written before snapshots had generations.
+void remove_stale_snapshots(const std::string &path, uint64_t keep) {
+  auto dir = directory_of(path);
+  auto prefix = std::filesystem::path(path).filename().string() + ".";
+  auto kept = std::to_string(keep);
+  std::error_code ec;
+  for (auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    auto name = entry.path().filename().string();
+    if (!name.starts_with(prefix)) {
+      continue;
+    }
+    std::string_view rest(name);
+    rest.remove_prefix(prefix.size());
+    auto generation = rest.substr(0, rest.find('.'));
+    bool numbered = generation.size() < rest.size() && !generation.empty() &&
+                    std::all_of(generation.begin(), generation.end(),
+                                [](char c) { return c >= '0' && c <= '9'; });
+    bool legacy = rest == "faissidx" || rest == "key2id" || rest == "id2key";
+    if ((numbered && generation != kept) || legacy) {
+      std::filesystem::remove(entry.path(), ec);
+    }
+  }
+}
+
+// Accepts the ids `member` holds true for, rows for scans of mapped vectors.
+template <typename F> struct predicate_selector : faiss::IDSelector {
+  F member;
+
+  explicit predicate_selector(F member) : member(std::move(member)) {}
+
+  bool is_member(faiss::idx_t id) const override { return member(id); }
+};
+
+// Rows per delta segment
+constexpr size_t segment_rows = 1024;
+
+// Filtered searches of an ANN index scan the matching vectors exactly
+// instead when fewer than one in this many match, since graph and list
+// traversal finds too few of them then.
+constexpr size_t exact_filter_ratio = 20;
+
+// An HNSW graph keeps the nodes of purged vectors until more than one in
+// this many of its nodes are purged, then it is rebuilt.
+constexpr size_t ann_rebuild_ratio = 4;
+
+bool is_ivf(const std::string &type) { return type.starts_with("ivf"); }
+
+// Whether searches scan the mapped float vectors instead of an index
+bool scans_vectors(const tgdb::FaissIndexOptions &options) {
+  return options.type == "flat" && options.storage == "float";
+}
+
+std::optional<faiss::ScalarQuantizer::QuantizerType>
+quantizer_of(const std::string &storage) {
+  if (storage == "sq8") {
+    return faiss::ScalarQuantizer::QT_8bit;
+  } else if (storage == "fp16") {
+    return faiss::ScalarQuantizer::QT_fp16;
+  }
+  return std::nullopt;
+}
+
+// Search parameters of an ANN index as configured, the caller sets the
+// selector.
+struct ann_search_params {
+  faiss::SearchParameters flat;
+  faiss::SearchParametersHNSW hnsw;
+  faiss::SearchParametersIVF ivf;
+  faiss::SearchParameters *params = &flat;
+
+  ann_search_params(const faiss::IndexIDMap2 &ann,
+                    const tgdb::FaissIndexOptions &options, int top_k) {
+    if (dynamic_cast<const faiss::IndexHNSW *>(ann.index)) {
+      hnsw.efSearch = std::max(options.ef_search, top_k);
+      params = &hnsw;
+    } else if (dynamic_cast<const faiss::IndexIVF *>(ann.index)) {
+      ivf.nprobe = options.nprobe;
+      params = &ivf;
+    }
+  }
+  ann_search_params(const ann_search_params &) = delete;
+  ann_search_params &operator=(const ann_search_params &) = delete;
+};
+
+bool sync_file(std::FILE *file) {
+  if (std::fflush(file) != 0) {
+    return false;
   }
+#ifdef _WIN32
+  return _commit(_fileno(file)) == 0;
+#else
+  return fsync(fileno(file)) == 0;
+#endif
 }
-} 
+
+// Syncs a file written and closed by someone else
+bool sync_file(const std::string &name) {
+#ifdef _WIN32
+  int fd = _open(name.c_str(), _O_RDWR | _O_BINARY);
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = _commit(fd) == 0;
+  _close(fd);
+#else
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = fsync(fd) == 0;
+  close(fd);
+#endif
+  return synced;
+}
+
+// Makes the renames into `dir` durable. Windows cannot open directories to
+// sync them and commits renames with the metadata of the file instead.
+bool sync_directory(const std::filesystem::path &dir) {
+#ifdef _WIN32
+  return true;
+#else
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = fsync(fd) == 0;
+  close(fd);
+  return synced;
+#endif
+}
+} // namespace
 
 namespace tgdb {
 
+struct FaissVectorDbService::Base {
+  // Where the snapshot lives: mapped files, or its bytes when it was never
+  // written to disk
+  kvdb::mapped_file vectors_file;
+  kvdb::mapped_file keys_file;
+  kvdb::mapped_file attributes_file;
+  kvdb::mapped_file codes_file;
+  std::string vectors_bytes;
+  std::string keys_bytes;
+  std::string attributes_bytes;
+  std::string codes_bytes;
+
+  size_t count = 0;
+  const faiss::idx_t *ids = nullptr;
+  const float *vectors = nullptr;
+  const VectorKey *keys = nullptr;
+  // Key to row
+  const key_slot *key_slots = nullptr;
+  size_t key_capacity = 0;
+  // Null for snapshots without attributes
+  const int64_t *chat_ids = nullptr;
+  const int64_t *sender_ids = nullptr;
+  const int64_t *send_times = nullptr;
+  const uint32_t *content_kinds = nullptr;
+  // Null without sign codes
+  const float *code_center = nullptr;
+  const uint64_t *codes = nullptr;
+
+  // The only thing that changes once opened, one bit per row
+  std::unique_ptr<std::atomic<uint64_t>[]> removed;
+  std::atomic<size_t> removed_count = 0;
+
+  // Searched instead of the vectors when present
+  std::unique_ptr<faiss::IndexIDMap2> ann;
+  // Where ann was read from, empty if it was built in memory
+  std::string ann_file;
+
+  // Nodes of ann whose vectors were purged from the snapshot, which HNSW
+  // graphs keep. Searches skip them since they have no row.
+  size_t AnnTombstones() const {
+    return ann ? static_cast<size_t>(ann->ntotal) - count : 0;
+  }
+
+  bool Parse(std::string_view vectors_data, std::string_view keys_data,
+             std::string_view attributes_data, size_t dimension) {
+    auto *vh = view_of<vectors_header>(vectors_data, 0, 1);
+    auto *kh = view_of<keys_header>(keys_data, 0, 1);
+    if (!vh || !kh || vh->magic != vectors_magic || kh->magic != keys_magic ||
+        vh->dimension != dimension || kh->count != vh->count ||
+        vh->count >= vectors_data.size() ||
+        !std::has_single_bit(kh->capacity) || kh->capacity <= kh->count) {
+      return false;
+    }
+    count = vh->count;
+    size_t offset = sizeof(vectors_header);
+    ids = view_of<faiss::idx_t>(vectors_data, offset, count);
+    offset += count * sizeof(faiss::idx_t);
+    vectors = view_of<float>(vectors_data, offset, count * dimension);
+
+    offset = sizeof(keys_header);
+    keys = view_of<VectorKey>(keys_data, offset, count);
+    offset += count * sizeof(VectorKey);
+    key_slots = view_of<key_slot>(keys_data, offset, kh->capacity);
+    key_capacity = kh->capacity;
+
+    if (!attributes_data.empty()) {
+      auto *ah = view_of<attributes_header>(attributes_data, 0, 1);
+      if (!ah || ah->magic != attributes_magic || ah->count != count) {
+        return false;
+      }
+      offset = sizeof(attributes_header);
+      chat_ids = view_of<int64_t>(attributes_data, offset, count);
+      offset += count * sizeof(int64_t);
+      sender_ids = view_of<int64_t>(attributes_data, offset, count);
+      offset += count * sizeof(int64_t);
+      send_times = view_of<int64_t>(attributes_data, offset, count);
+      offset += count * sizeof(int64_t);
+      content_kinds = view_of<uint32_t>(attributes_data, offset, count);
+      if (!chat_ids || !sender_ids || !send_times || !content_kinds) {
+        return false;
+      }
+    }
+
+    removed = std::make_unique<std::atomic<uint64_t>[]>(count / 64 + 1);
+    return ids && vectors && keys && key_slots;
+  }
+
+  bool ParseCodes(std::string_view codes_data, size_t dimension) {
+    auto *ch = view_of<codes_header>(codes_data, 0, 1);
+    if (!ch || ch->magic != codes_magic || ch->dimension != dimension ||
+        ch->count != count) {
+      return false;
+    }
+    size_t offset = sizeof(codes_header);
+    auto *center = view_of<float>(codes_data, offset, dimension);
+    // The codes start on a word boundary
+    offset += (dimension * sizeof(float) + 7) / 8 * 8;
+    auto *words =
+        view_of<uint64_t>(codes_data, offset, count * code_words(dimension));
+    if (!center || !words) {
+      return false;
+    }
+    code_center = center;
+    codes = words;
+    return true;
+  }
+
+  VectorAttributes AttributesAt(size_t row) const {
+    if (!chat_ids) {
+      return {};
+    }
+    return {chat_ids[row], sender_ids[row], send_times[row],
+            content_kinds[row]};
+  }
+
+  std::optional<size_t> RowOf(faiss::idx_t id) const {
+    auto it = std::lower_bound(ids, ids + count, id);
+    if (it == ids + count || *it != id) {
+      return std::nullopt;
+    }
+    return it - ids;
+  }
+
+  VectorKey KeyAt(size_t row) const { return keys[row]; }
+
+  std::optional<size_t> Find(VectorKey key) const {
+    auto *slot = kvdb::find_id(key_slots, key_capacity, key);
+    if (!slot || slot->value >= count) {
+      return std::nullopt;
+    }
+    return slot->value;
+  }
+
+  bool Removed(size_t row) const {
+    return removed[row / 64].load(std::memory_order_relaxed) &
+           (uint64_t{1} << (row % 64));
+  }
+
+  void Remove(size_t row) {
+    auto bit = uint64_t{1} << (row % 64);
+    if (!(removed[row / 64].fetch_or(bit) & bit)) {
+      removed_count++;
+    }
+  }
+};
+
+// Vectors added since the base was written. Rows below `size` never change
+// but for their removed flag, later ones are filled in by the writer before
+// it advances `size`.
+struct FaissVectorDbService::Segment {
+  explicit Segment(size_t dimension)
+      : vectors(std::make_unique_for_overwrite<float[]>(segment_rows *
+                                                        dimension)),
+        ids(std::make_unique_for_overwrite<faiss::idx_t[]>(segment_rows)),
+        keys(std::make_unique_for_overwrite<VectorKey[]>(segment_rows)),
+        attributes(std::make_unique<VectorAttributes[]>(segment_rows)),
+        removed(std::make_unique<std::atomic<bool>[]>(segment_rows)) {}
+
+  std::unique_ptr<float[]> vectors;
+  std::unique_ptr<faiss::idx_t[]> ids;
+  std::unique_ptr<VectorKey[]> keys;
+  std::unique_ptr<VectorAttributes[]> attributes;
+  std::unique_ptr<std::atomic<bool>[]> removed;
+  std::atomic<size_t> size = 0;
+  std::atomic<size_t> removed_count = 0;
+
+  void Remove(size_t row) {
+    if (!removed[row].exchange(true)) {
+      removed_count++;
+    }
+  }
+};
+
+struct FaissVectorDbService::View {
+  std::shared_ptr<Base> base;
+  // The last one is being filled
+  std::vector<std::shared_ptr<Segment>> segments;
+};
+
+// A view as a checkpoint writes it: its rows as of the freeze, while writers
+// go on appending to it and flagging rows as removed.
+struct FaissVectorDbService::Frozen {
+  std::shared_ptr<const View> view;
+  // Rows of the frozen segments, the first ones of view
+  std::vector<size_t> sizes;
+  // The removed flags of the base and the segments when frozen
+  std::vector<uint64_t> base_removed;
+  size_t base_removed_count = 0;
+  std::vector<std::vector<bool>> segment_removed;
+  faiss::idx_t next_id = 0;
+
+  bool BaseRemoved(size_t row) const {
+    return base_removed[row / 64] & (uint64_t{1} << (row % 64));
+  }
+};
+
+struct FaissVectorDbService::Row {
+  faiss::idx_t id;
+  VectorKey key;
+  const float *vector;
+  VectorAttributes attributes;
+};
+
+struct FaissVectorDbService::Hit {
+  float distance;
+  VectorKey key;
+};
+
 FaissVectorDbService::FaissVectorDbService(int dimension,
-                                           faiss::MetricType metric)
-    : dimension_(dimension), next_id_(0) {
-  if (metric == faiss::METRIC_L2) {
-    index_ = std::make_unique<faiss::IndexFlatL2>(dimension_);
-  } else if (metric == faiss::METRIC_INNER_PRODUCT) {
-    index_ = std::make_unique<faiss::IndexFlatIP>(dimension_);
-  } else {
+                                           faiss::MetricType metric,
+                                           FaissIndexOptions options)
+    : dimension_(dimension), metric_(metric), options_(std::move(options)),
+      view_(std::make_shared<View>(View{std::make_shared<Base>(), {}})),
+      next_id_(0) {
+  if (metric_ != faiss::METRIC_L2 && metric_ != faiss::METRIC_INNER_PRODUCT) {
     ELOGFMT(WARN, "Warning: Unsupported Faiss metric type, defaulting to METRIC_L2.");
-    index_ = std::make_unique<faiss::IndexFlatL2>(dimension_);
+    metric_ = faiss::METRIC_L2;
+  }
+  if (options_.type != "flat" && options_.type != "hnsw" &&
+      !is_ivf(options_.type)) {
+    ELOGFMT(WARN, "Unsupported Faiss index type {}, defaulting to flat.",
+            options_.type);
+    options_.type = "flat";
+  }
+  if (options_.storage != "float" && !quantizer_of(options_.storage)) {
+    ELOGFMT(WARN, "Unsupported vector storage {}, defaulting to float.",
+            options_.storage);
+    options_.storage = "float";
+  }
+  // The other types search an index, sign codes would only cost a scan
+  if (options_.binary_candidates > 0 && !scans_vectors(options_)) {
+    ELOGFMT(WARN, "binary_candidates is only used by flat indexes with float "
+                  "storage, ignoring it for {} with {} storage.",
+            options_.type, options_.storage);
+    options_.binary_candidates = 0;
   }
 }
 
-FaissVectorDbService::~FaissVectorDbService() = default;
+FaissVectorDbService::~FaissVectorDbService() {
+  if (wal_) {
+    Sync();
+    std::fclose(wal_);
+  }
+}
 
-bool FaissVectorDbService::AddVector(const std::string &key,
-                                     const std::vector<float> &vector) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (key_to_id_.count(key)) {
+bool FaissVectorDbService::AddVector(VectorKey key,
+                                     const std::vector<float> &vector,
+                                     const VectorAttributes &attributes) {
+  std::lock_guard write_lock(write_mutex_);
+  std::unique_lock lock(mutex_);
+  if (key == kvdb::empty_id || Find(key)) {
     return false;
   }
   if (vector.size() != dimension_) {
@@ -129,116 +652,339 @@ bool FaissVectorDbService::AddVector(const std::string &key,
     return false;
   }
 
-  faiss::Index::idx_t current_id = next_id_++;
-  index_->add(1, vector.data());
+  faiss::idx_t current_id = next_id_++;
+  Insert(key, current_id, vector.data(), attributes);
+  Log(WalOp::Put, key, current_id, vector.data(), &attributes);
+
+  return true;
+}
+
+size_t FaissVectorDbService::AddVectors(
+    const std::vector<VectorKey> &keys,
+    const std::vector<std::vector<float>> &vectors,
+    const std::vector<VectorAttributes> &attributes) {
+  if (keys.size() != vectors.size() ||
+      (!attributes.empty() && attributes.size() != vectors.size())) {
+    ELOGFMT(ERROR, "Error: Got {} keys and {} attributes for {} vectors.",
+            keys.size(), attributes.size(), vectors.size());
+    return 0;
+  }
+  std::lock_guard write_lock(write_mutex_);
+  std::unique_lock lock(mutex_);
+  size_t added = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (keys[i] == kvdb::empty_id || Find(keys[i])) {
+      continue;
+    }
+    if (vectors[i].size() != dimension_) {
+      ELOGFMT(ERROR, "Error: Vector dimension mismatch for key '{}'. Expected {}, got {}.", keys[i], dimension_, vectors[i].size());
+      continue;
+    }
+    auto vector_attributes =
+        attributes.empty() ? VectorAttributes{} : attributes[i];
+    faiss::idx_t current_id = next_id_++;
+    Insert(keys[i], current_id, vectors[i].data(), vector_attributes);
+    Log(WalOp::Put, keys[i], current_id, vectors[i].data(),
+        &vector_attributes);
+    added++;
+  }
+  return added;
+}
+
+std::optional<FaissVectorDbService::Location>
+FaissVectorDbService::Find(VectorKey key) const {
+  if (auto *location = delta_keys_.find(key)) {
+    return *location;
+  }
+  auto &base = *view_->base;
+  if (auto row = base.Find(key); row && !base.Removed(*row)) {
+    return Location{base.ids[*row], nullptr, *row};
+  }
+  return std::nullopt;
+}
+
+const float *FaissVectorDbService::VectorOf(const Location &location) const {
+  if (location.segment) {
+    return location.segment->vectors.get() + location.row * dimension_;
+  }
+  return view_->base->vectors + location.row * dimension_;
+}
 
-  key_to_id_[key] = current_id;
-  if (current_id >= id_to_key_.size()) {
-    id_to_key_.resize(current_id + 1);
+VectorAttributes
+FaissVectorDbService::AttributesOf(const Location &location) const {
+  if (location.segment) {
+    return location.segment->attributes[location.row];
   }
-  id_to_key_[current_id] = key;
+  return view_->base->AttributesAt(location.row);
+}
 
-  return true;
+void FaissVectorDbService::Insert(VectorKey key, faiss::idx_t id,
+                                  const float *vector,
+                                  const VectorAttributes &attributes) {
+  auto *segment =
+      view_->segments.empty() ? nullptr : view_->segments.back().get();
+  if (!segment || segment->size.load() == segment_rows) {
+    auto view = std::make_shared<View>(*view_);
+    view->segments.push_back(std::make_shared<Segment>(dimension_));
+    segment = view->segments.back().get();
+    view_ = std::move(view);
+  }
+  auto row = segment->size.load();
+  std::copy_n(vector, dimension_, segment->vectors.get() + row * dimension_);
+  segment->ids[row] = id;
+  segment->keys[row] = key;
+  segment->attributes[row] = attributes;
+  segment->size.store(row + 1, std::memory_order_release);
+  delta_keys_.insert_or_assign(key, {id, segment, row});
+  live_++;
+}
+
+void FaissVectorDbService::Tombstone(VectorKey key,
+                                     const Location &location) {
+  if (location.segment) {
+    location.segment->Remove(location.row);
+  } else {
+    view_->base->Remove(location.row);
+  }
+  delta_keys_.erase(key);
+  live_--;
 }
 
 std::vector<SearchResult>
-FaissVectorDbService::Search(const std::vector<float> &query_vector,
-                             int top_k) {
-  std::lock_guard<std::mutex> lock(mutex_);
+FaissVectorDbService::Search(const std::vector<float> &query_vector, int top_k,
+                             const SearchFilter &filter) {
   if (query_vector.size() != dimension_) {
     ELOGFMT(ERROR, "Error: Query vector dimension mismatch. Expected {}, got {}.", dimension_, query_vector.size());
     return {};
   }
-  if (index_->ntotal == 0) {
-    return {};
+  return std::move(
+      SearchQueries(query_vector.data(), 1, top_k, filter).front());
+}
+
+std::vector<std::vector<SearchResult>> FaissVectorDbService::SearchBatch(
+    const std::vector<std::vector<float>> &query_vectors, int top_k,
+    const SearchFilter &filter) {
+  // Valid queries are packed back to back, the others get no results
+  std::vector<float> packed;
+  std::vector<size_t> slots;
+  packed.reserve(query_vectors.size() * dimension_);
+  for (size_t i = 0; i < query_vectors.size(); ++i) {
+    if (query_vectors[i].size() != dimension_) {
+      ELOGFMT(ERROR, "Error: Query vector dimension mismatch. Expected {}, got {}.", dimension_, query_vectors[i].size());
+      continue;
+    }
+    packed.insert(packed.end(), query_vectors[i].begin(),
+                  query_vectors[i].end());
+    slots.push_back(i);
   }
-  if (top_k <= 0) {
-    return {};
+
+  std::vector<std::vector<SearchResult>> search_results(query_vectors.size());
+  if (slots.empty()) {
+    return search_results;
+  }
+  auto found = SearchQueries(packed.data(), slots.size(), top_k, filter);
+  for (size_t q = 0; q < slots.size(); ++q) {
+    search_results[slots[q]] = std::move(found[q]);
   }
+  return search_results;
+}
 
-  std::vector<faiss::Index::idx_t> result_ids(top_k);
-  std::vector<float> result_distances(top_k);
+// Each part of the index is searched once for all queries, which lets faiss
+// compute the distances as one matrix product instead of a scan per query.
+std::vector<std::vector<SearchResult>>
+FaissVectorDbService::SearchQueries(const float *queries, size_t count,
+                                    int top_k, const SearchFilter &filter) {
+  std::vector<std::vector<SearchResult>> search_results(count);
+  if (top_k <= 0) {
+    return search_results;
+  }
+  std::shared_ptr<const View> view;
+  {
+    std::shared_lock lock(mutex_);
+    view = view_;
+  }
 
-  index_->search(1, query_vector.data(), top_k, result_distances.data(),
-                 result_ids.data());
+  std::vector<std::vector<Hit>> hits(count);
+  SearchBase(*view->base, queries, count, top_k, filter, hits);
+  for (auto &segment : view->segments) {
+    SearchSegment(*segment, queries, count, top_k, filter, hits);
+  }
 
-  std::vector<SearchResult> search_results;
-  for (int i = 0; i < top_k; ++i) {
-    if (result_ids[i] != -1 &&
-        static_cast<size_t>(result_ids[i]) < id_to_key_.size()) {
-      const std::string &key = id_to_key_[result_ids[i]];
-      if (!key.empty()) {
-        search_results.push_back({key, result_distances[i]});
-      }
+  // Smaller is closer for L2, larger for inner products
+  auto closer = [&](const Hit &a, const Hit &b) {
+    return metric_ == faiss::METRIC_INNER_PRODUCT ? a.distance > b.distance
+                                                  : a.distance < b.distance;
+  };
+  for (size_t q = 0; q < count; ++q) {
+    auto &query_hits = hits[q];
+    auto k = std::min(query_hits.size(), static_cast<size_t>(top_k));
+    std::partial_sort(query_hits.begin(), query_hits.begin() + k,
+                      query_hits.end(), closer);
+    search_results[q].reserve(k);
+    for (size_t i = 0; i < k; ++i) {
+      search_results[q].push_back(
+          {query_hits[i].key, query_hits[i].distance});
     }
   }
   return search_results;
 }
 
-bool FaissVectorDbService::RemoveVector(const std::string &key) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = key_to_id_.find(key);
-  if (it == key_to_id_.end()) {
-    return false; 
+void FaissVectorDbService::SearchBase(
+    const Base &base, const float *queries, size_t count, int top_k,
+    const SearchFilter &filter, std::vector<std::vector<Hit>> &hits) const {
+  if (base.count == 0) {
+    return;
   }
+  auto k = std::min<size_t>(top_k, base.count);
+  std::vector<faiss::idx_t> ids(count * k);
+  std::vector<float> distances(count * k);
+  bool any_removed =
+      base.removed_count.load() > 0 || base.AnnTombstones() > 0;
+  bool filtered = !filter.empty();
+  auto selected = [&](size_t row) {
+    return !base.Removed(row) &&
+           (!filtered || filter.matches(base.AttributesAt(row)));
+  };
 
-  key_to_id_.erase(it);
-  RebuildIndex();
+  if (base.codes && options_.binary_candidates > 0) {
+    // Sign codes pick the candidates, the float vectors rank them
+    auto words = code_words(dimension_);
+    std::vector<uint64_t> query_codes(count * words);
+    for (size_t q = 0; q < count; ++q) {
+      sign_code(queries + q * dimension_, base.code_center, dimension_,
+                query_codes.data() + q * words);
+    }
+    auto candidates = hamming_candidates(
+        base.codes, base.count, words, query_codes.data(), count,
+        std::max<size_t>(options_.binary_candidates, k),
+        [&](size_t row) { return !(any_removed || filtered) || selected(row); });
+    std::vector<Hit> ranked;
+    for (size_t q = 0; q < count; ++q) {
+      ranked.clear();
+      for (auto row : candidates[q]) {
+        auto *vector = base.vectors + row * dimension_;
+        auto distance =
+            metric_ == faiss::METRIC_INNER_PRODUCT
+                ? faiss::fvec_inner_product(queries + q * dimension_, vector,
+                                            dimension_)
+                : faiss::fvec_L2sqr(queries + q * dimension_, vector,
+                                    dimension_);
+        ranked.push_back({distance, base.KeyAt(row)});
+      }
+      auto closer = [&](const Hit &a, const Hit &b) {
+        return metric_ == faiss::METRIC_INNER_PRODUCT ? a.distance > b.distance
+                                                      : a.distance < b.distance;
+      };
+      auto kept = std::min(k, ranked.size());
+      std::partial_sort(ranked.begin(), ranked.begin() + kept, ranked.end(),
+                        closer);
+      hits[q].insert(hits[q].end(), ranked.begin(), ranked.begin() + kept);
+    }
+    return;
+  }
 
-  return true;
-}
+  auto *ann = base.ann.get();
+  if (ann && filtered) {
+    // The attribute columns are small next to the vectors, counting the
+    // matches first is cheap
+    size_t matching = 0;
+    for (size_t row = 0; row < base.count; ++row) {
+      matching += filter.matches(base.AttributesAt(row));
+    }
+    if (matching * exact_filter_ratio < base.count) {
+      ann = nullptr;
+    }
+  }
 
-void FaissVectorDbService::RebuildIndex() {
-  if (dimension_ <= 0)
+  if (ann) {
+    ann_search_params search_params(*ann, options_, top_k);
+    predicate_selector selector([&](faiss::idx_t id) {
+      auto row = base.RowOf(id);
+      return row && selected(*row);
+    });
+    if (any_removed || filtered) {
+      search_params.params->sel = &selector;
+    }
+    ann->search(count, queries, k, distances.data(), ids.data(),
+                search_params.params);
+    for (size_t i = 0; i < count * k; ++i) {
+      if (ids[i] != -1) {
+        if (auto row = base.RowOf(ids[i])) {
+          hits[i / k].push_back({distances[i], base.KeyAt(*row)});
+        }
+      }
+    }
     return;
+  }
 
-  std::unique_ptr<faiss::Index> new_index;
-  if (index_->metric_type == faiss::METRIC_L2) {
-    new_index = std::make_unique<faiss::IndexFlatL2>(dimension_);
-  } else if (index_->metric_type == faiss::METRIC_INNER_PRODUCT) {
-    new_index = std::make_unique<faiss::IndexFlatIP>(dimension_);
+  // Exact scan of the mapped vectors, which returns rows
+  predicate_selector selector(
+      [&](faiss::idx_t row) { return selected(row); });
+  const faiss::IDSelector *sel = any_removed || filtered ? &selector : nullptr;
+  if (metric_ == faiss::METRIC_INNER_PRODUCT) {
+    faiss::knn_inner_product(queries, base.vectors, dimension_, count,
+                             base.count, k, distances.data(), ids.data(), sel);
   } else {
-    ELOGFMT(ERROR, "Error: RebuildIndex encountered unknown metric type. Defaulting to L2.");
-    new_index = std::make_unique<faiss::IndexFlatL2>(dimension_);
-  }
-
-  std::vector<std::string> new_id_to_key;
-  std::unordered_map<std::string, faiss::Index::idx_t> new_key_to_id;
-  faiss::Index::idx_t current_new_id = 0;
-
-  std::vector<float> buffer(dimension_);
-  for (faiss::Index::idx_t old_id = 0; old_id < index_->ntotal; ++old_id) {
-    if (static_cast<size_t>(old_id) < id_to_key_.size() &&
-        !id_to_key_[old_id].empty()) {
-      const std::string &key = id_to_key_[old_id];
-      if (key_to_id_.count(
-              key)) {
-        try {
-          index_->reconstruct(old_id, buffer.data());
-          new_index->add(1, buffer.data());
-          new_key_to_id[key] = current_new_id;
-          if (current_new_id >= new_id_to_key.size()) {
-            new_id_to_key.resize(current_new_id + 1);
-          }
-          new_id_to_key[current_new_id] = key;
-          current_new_id++;
-        } catch (const faiss::FaissException &e) {
-          ELOGFMT(ERROR, "FaissException during reconstruct in RebuildIndex for id {}: {}", old_id, e.what());
-        }
-      }
+    faiss::knn_L2sqr(queries, base.vectors, dimension_, count, base.count, k,
+                     distances.data(), ids.data(), nullptr, sel);
+  }
+  for (size_t i = 0; i < count * k; ++i) {
+    if (ids[i] != -1) {
+      hits[i / k].push_back({distances[i], base.KeyAt(ids[i])});
     }
   }
+}
 
-  index_ = std::move(new_index);
-  key_to_id_ = std::move(new_key_to_id);
-  id_to_key_ = std::move(new_id_to_key);
-  next_id_ = current_new_id; 
+void FaissVectorDbService::SearchSegment(
+    const Segment &segment, const float *queries, size_t count, int top_k,
+    const SearchFilter &filter, std::vector<std::vector<Hit>> &hits) const {
+  auto size = segment.size.load(std::memory_order_acquire);
+  if (size == 0) {
+    return;
+  }
+  auto k = std::min<size_t>(top_k, size);
+  std::vector<faiss::idx_t> rows(count * k);
+  std::vector<float> distances(count * k);
+  bool filtered = !filter.empty();
+  predicate_selector selector([&](faiss::idx_t row) {
+    return !segment.removed[row].load() &&
+           (!filtered || filter.matches(segment.attributes[row]));
+  });
+  const faiss::IDSelector *sel =
+      segment.removed_count.load() > 0 || filtered ? &selector : nullptr;
+  if (metric_ == faiss::METRIC_INNER_PRODUCT) {
+    faiss::knn_inner_product(queries, segment.vectors.get(), dimension_, count,
+                             size, k, distances.data(), rows.data(), sel);
+  } else {
+    faiss::knn_L2sqr(queries, segment.vectors.get(), dimension_, count, size,
+                     k, distances.data(), rows.data(), nullptr, sel);
+  }
+  for (size_t i = 0; i < count * k; ++i) {
+    if (rows[i] != -1) {
+      hits[i / k].push_back({distances[i], segment.keys[rows[i]]});
+    }
+  }
+}
+
+bool FaissVectorDbService::RemoveVector(VectorKey key) {
+  std::lock_guard write_lock(write_mutex_);
+  std::unique_lock lock(mutex_);
+  auto location = Find(key);
+  if (!location) {
+    return false;
+  }
+
+  Log(WalOp::Delete, key, location->id, nullptr);
+  Tombstone(key, *location);
+  return true;
 }
 
-bool FaissVectorDbService::UpdateVector(const std::string &key,
+bool FaissVectorDbService::UpdateVector(VectorKey key,
                                         const std::vector<float> &vector) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (key_to_id_.find(key) == key_to_id_.end()) {
+  std::lock_guard write_lock(write_mutex_);
+  std::unique_lock lock(mutex_);
+  auto location = Find(key);
+  if (!location) {
     return false;
   }
   if (vector.size() != dimension_) {
@@ -246,114 +992,704 @@ bool FaissVectorDbService::UpdateVector(const std::string &key,
     return false;
   }
 
-  faiss::Index::idx_t old_faiss_id = key_to_id_[key];
-  key_to_id_.erase(key);
+  // The new vector gets a new id, the old one is purged by Compact()
+  auto attributes = AttributesOf(*location);
+  Log(WalOp::Delete, key, location->id, nullptr);
+  Tombstone(key, *location);
 
-  RebuildIndex();
-
-  faiss::Index::idx_t new_id = next_id_++;
-  index_->add(1, vector.data());
-  key_to_id_[key] = new_id;
-  if (new_id >= id_to_key_.size()) {
-    id_to_key_.resize(new_id + 1);
-  }
-  id_to_key_[new_id] = key;
+  faiss::idx_t new_id = next_id_++;
+  Insert(key, new_id, vector.data(), attributes);
+  Log(WalOp::Put, key, new_id, vector.data(), &attributes);
 
   return true;
 }
 
-bool FaissVectorDbService::Save(const std::string &path) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  try {
-    faiss::write_index(index_.get(), (path + ".faissidx").c_str());
-    write_map(path + ".key2id", key_to_id_);
-    write_vector_of_strings(path + ".id2key", id_to_key_);
+// Removed rows are left out whenever the base is rewritten, this only forces
+// a rewrite once they make up a noticeable part of the index.
+size_t FaissVectorDbService::Compact() {
+  size_t purged;
+  {
+    std::lock_guard write_lock(write_mutex_);
+    purged = view_->base->removed_count;
+    size_t total = view_->base->count;
+    for (auto &segment : view_->segments) {
+      purged += segment->removed_count;
+      total += segment->size;
+    }
+    if (purged == 0 || purged * 10 < total) {
+      return 0;
+    }
+  }
+  return Merge() ? purged : 0;
+}
 
-    std::ofstream meta_ofs(path + ".meta", std::ios::binary);
-    if (!meta_ofs)
+bool FaissVectorDbService::Train() {
+  {
+    std::lock_guard write_lock(write_mutex_);
+    auto &base = *view_->base;
+    // A base written without sign codes gets them once
+    bool missing_codes =
+        options_.binary_candidates > 0 && live_ > 0 && !base.codes;
+    bool configured = scans_vectors(options_) ||
+                      (base.ann && IsConfiguredType(base.ann->index));
+    if (configured && !missing_codes) {
+      return true;
+    }
+    if (!missing_codes && live_ < TrainingThreshold()) {
       return false;
-    meta_ofs.write(reinterpret_cast<const char *>(&next_id_), sizeof(next_id_));
-    meta_ofs.write(reinterpret_cast<const char *>(&dimension_),
-                   sizeof(dimension_));
-    faiss::MetricType metric = index_->metric_type;
-    meta_ofs.write(reinterpret_cast<const char *>(&metric), sizeof(metric));
-    meta_ofs.close();
+    }
+  }
+  if (!Merge()) {
+    return false;
+  }
+  std::shared_lock lock(mutex_);
+  return scans_vectors(options_) || view_->base->ann;
+}
 
-    return true;
+// Takes the view as it is for a checkpoint. When sealing, rows added from
+// now on go to a new segment, which the checkpoint keeps as it is. Needs
+// write_mutex_.
+FaissVectorDbService::Frozen FaissVectorDbService::Freeze(bool seal) {
+  Frozen frozen;
+  frozen.view = view_;
+  frozen.next_id = next_id_;
+  auto &base = *view_->base;
+  if (base.removed) {
+    frozen.base_removed.resize(base.count / 64 + 1);
+    for (size_t word = 0; word < frozen.base_removed.size(); ++word) {
+      frozen.base_removed[word] = base.removed[word].load();
+    }
+    frozen.base_removed_count = base.removed_count;
+  }
+  auto &segments = view_->segments;
+  auto count = segments.size();
+  // An empty last segment is already as good as a new one
+  bool sealed = count == 0 || segments.back()->size == 0;
+  if (sealed && count > 0) {
+    count--;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    auto &segment = *segments[i];
+    auto &removed = frozen.segment_removed.emplace_back(segment.size.load());
+    for (size_t row = 0; row < removed.size(); ++row) {
+      removed[row] = segment.removed[row];
+    }
+    frozen.sizes.push_back(removed.size());
+  }
+  if (seal && !sealed) {
+    auto view = std::make_shared<View>(*view_);
+    view->segments.push_back(std::make_shared<Segment>(dimension_));
+    std::unique_lock lock(mutex_);
+    view_ = std::move(view);
+  }
+  return frozen;
+}
+
+// Live vectors of the base and the segments of `frozen`, in id order.
+std::vector<FaissVectorDbService::Row>
+FaissVectorDbService::LiveRows(const Frozen &frozen) const {
+  std::vector<Row> rows;
+  auto &base = *frozen.view->base;
+  for (size_t row = 0; row < base.count; ++row) {
+    if (!frozen.BaseRemoved(row)) {
+      rows.push_back({base.ids[row], base.KeyAt(row),
+                      base.vectors + row * dimension_, base.AttributesAt(row)});
+    }
+  }
+  for (size_t i = 0; i < frozen.sizes.size(); ++i) {
+    auto &segment = *frozen.view->segments[i];
+    for (size_t row = 0; row < frozen.sizes[i]; ++row) {
+      if (!frozen.segment_removed[i][row]) {
+        rows.push_back({segment.ids[row], segment.keys[row],
+                        segment.vectors.get() + row * dimension_,
+                        segment.attributes[row]});
+      }
+    }
+  }
+  std::sort(rows.begin(), rows.end(),
+            [](const Row &a, const Row &b) { return a.id < b.id; });
+  return rows;
+}
+// Writes the live vectors of `frozen` as snapshot `generation` of `path`, or
+// only to memory without a path, and opens the result. The meta file is
+// renamed into place last and everything is synced before and after, so a
+// crash leaves either snapshot complete on disk. Needs merge_mutex_.
+std::shared_ptr<FaissVectorDbService::Base>
+FaissVectorDbService::WriteSnapshot(const std::string &path,
+                                    uint64_t generation,
+                                    const Frozen &frozen) const {
+  auto rows = LiveRows(frozen);
+  auto write_vectors = [&](std::ostream &os) {
+    vectors_header header{vectors_magic, static_cast<uint64_t>(dimension_),
+                          rows.size()};
+    write_raw(os, &header, 1);
+    for (auto &row : rows) {
+      write_raw(os, &row.id, 1);
+    }
+    for (auto &row : rows) {
+      write_raw(os, row.vector, dimension_);
+    }
+  };
+  auto write_row_keys = [&](std::ostream &os) {
+    std::vector<uint64_t> keys;
+    keys.reserve(rows.size());
+    for (auto &row : rows) {
+      keys.push_back(row.key);
+    }
+    write_keys(os, keys);
+  };
+  auto write_attributes = [&](std::ostream &os) {
+    attributes_header header{attributes_magic, rows.size()};
+    write_raw(os, &header, 1);
+    for (auto &row : rows) {
+      write_raw(os, &row.attributes.chat_id, 1);
+    }
+    for (auto &row : rows) {
+      write_raw(os, &row.attributes.sender_id, 1);
+    }
+    for (auto &row : rows) {
+      write_raw(os, &row.attributes.send_time, 1);
+    }
+    for (auto &row : rows) {
+      write_raw(os, &row.attributes.content_kinds, 1);
+    }
+  };
+  auto write_codes = [&](std::ostream &os) {
+    std::vector<float> center(dimension_);
+    for (auto &row : rows) {
+      for (size_t i = 0; i < dimension_; ++i) {
+        center[i] += row.vector[i];
+      }
+    }
+    for (auto &value : center) {
+      value /= std::max<size_t>(rows.size(), 1);
+    }
+    codes_header header{codes_magic, static_cast<uint64_t>(dimension_),
+                        rows.size()};
+    write_raw(os, &header, 1);
+    write_raw(os, center.data(), center.size());
+    std::array<char, 8> padding{};
+    write_raw(os, padding.data(),
+              (dimension_ * sizeof(float) + 7) / 8 * 8 -
+                  dimension_ * sizeof(float));
+    std::vector<uint64_t> code(code_words(dimension_));
+    for (auto &row : rows) {
+      sign_code(row.vector, center.data(), dimension_, code.data());
+      write_raw(os, code.data(), code.size());
+    }
+  };
+  bool with_codes = options_.binary_candidates > 0;
+  // Next to its final name first, so a crash never leaves half a file there
+  auto write_file = [](const std::string &name, auto &&write) {
+    {
+      std::ofstream ofs(name + ".tmp", std::ios::binary);
+      write(ofs);
+      ofs.flush();
+      if (!ofs) {
+        throw std::runtime_error("Failed to write " + name);
+      }
+    }
+    if (!sync_file(name + ".tmp")) {
+      throw std::runtime_error("Failed to sync " + name);
+    }
+    std::filesystem::rename(name + ".tmp", name);
+  };
+  auto sync_snapshot_directory = [&] {
+    if (!sync_directory(directory_of(path))) {
+      throw std::runtime_error("Failed to sync the directory of " + path);
+    }
+  };
+
+  try {
+    auto base = std::make_shared<Base>();
+    bool parsed;
+    if (path.empty()) {
+      std::ostringstream vectors_os, keys_os, attributes_os;
+      write_vectors(vectors_os);
+      write_row_keys(keys_os);
+      write_attributes(attributes_os);
+      base->vectors_bytes = std::move(vectors_os).str();
+      base->keys_bytes = std::move(keys_os).str();
+      base->attributes_bytes = std::move(attributes_os).str();
+      parsed = base->Parse(base->vectors_bytes, base->keys_bytes,
+                           base->attributes_bytes, dimension_);
+      if (parsed && with_codes) {
+        std::ostringstream codes_os;
+        write_codes(codes_os);
+        base->codes_bytes = std::move(codes_os).str();
+        parsed = base->ParseCodes(base->codes_bytes, dimension_);
+      }
+    } else {
+      auto vectors_file = snapshot_file(path, generation, "vectors");
+      auto keys_file = snapshot_file(path, generation, "keys");
+      auto attributes_file = snapshot_file(path, generation, "attrs");
+      write_file(vectors_file, write_vectors);
+      write_file(keys_file, write_row_keys);
+      write_file(attributes_file, write_attributes);
+      parsed = base->vectors_file.open(vectors_file) &&
+               base->keys_file.open(keys_file) &&
+               base->attributes_file.open(attributes_file) &&
+               base->Parse(bytes_of(base->vectors_file),
+                           bytes_of(base->keys_file),
+                           bytes_of(base->attributes_file), dimension_);
+      if (parsed && with_codes) {
+        auto codes_file = snapshot_file(path, generation, "bits");
+        write_file(codes_file, write_codes);
+        parsed = base->codes_file.open(codes_file) &&
+                 base->ParseCodes(bytes_of(base->codes_file), dimension_);
+      }
+    }
+    if (!parsed) {
+      ELOGFMT(ERROR, "Failed to read back the vector snapshot of {}", path);
+      return nullptr;
+    }
+
+    base->ann = BuildAnn(*base, frozen);
+    if (path.empty()) {
+      return base;
+    }
+    if (base->ann) {
+      base->ann_file = snapshot_file(path, generation, "faissidx");
+      faiss::write_index(base->ann.get(), (base->ann_file + ".tmp").c_str());
+      if (!sync_file(base->ann_file + ".tmp")) {
+        throw std::runtime_error("Failed to sync " + base->ann_file);
+      }
+      std::filesystem::rename(base->ann_file + ".tmp", base->ann_file);
+    }
+    // The meta file may only name a generation whose files are on disk, and
+    // has to be there itself before Merge() replaces the log
+    sync_snapshot_directory();
+    write_file(path + ".meta", [&](std::ostream &os) {
+      write_raw(os, &frozen.next_id, 1);
+      write_raw(os, &dimension_, 1);
+      write_raw(os, &metric_, 1);
+      write_raw(os, &generation, 1);
+    });
+    sync_snapshot_directory();
+    return base;
   } catch (const faiss::FaissException &e) {
     ELOGFMT(ERROR, "FaissException during Save: {}", e.what());
-    return false;
+    return nullptr;
   } catch (const std::exception &e) {
     ELOGFMT(ERROR, "StdException during Save: {}", e.what());
-    return false;
+    return nullptr;
   }
 }
 
-bool FaissVectorDbService::Load(const std::string &path) {
-  std::lock_guard<std::mutex> lock(mutex_);
+// The index searched for a new snapshot, if the configured type needs one.
+// The index of the frozen base is updated with the frozen changes since it
+// was written, otherwise one is built from the snapshot's vectors, trained
+// first if needed. The snapshot's ids are what tells the live nodes of an
+// HNSW graph from its tombstones, after a restart as well.
+std::unique_ptr<faiss::IndexIDMap2>
+FaissVectorDbService::BuildAnn(const Base &snapshot,
+                               const Frozen &frozen) const {
+  if (scans_vectors(options_)) {
+    return nullptr;
+  }
+  auto &base = *frozen.view->base;
+  bool update = base.ann && IsConfiguredType(base.ann->index);
+  if (!update && snapshot.count < TrainingThreshold()) {
+    return nullptr;
+  }
+
   try {
-    std::string index_file = path + ".faissidx";
-    std::string key2id_file = path + ".key2id";
-    std::string id2key_file = path + ".id2key";
-    std::string meta_file = path + ".meta";
+    // HNSW graphs cannot drop nodes, purged ones stay in the graph as
+    // tombstones until there are too many of them
+    bool hnsw =
+        update && dynamic_cast<const faiss::IndexHNSW *>(base.ann->index);
+    if (hnsw) {
+      auto tombstones = base.AnnTombstones() + frozen.base_removed_count;
+      update = tombstones * ann_rebuild_ratio <=
+               static_cast<size_t>(base.ann->ntotal);
+    }
+    std::vector<faiss::idx_t> purged;
+    for (size_t row = 0;
+         !hnsw && frozen.base_removed_count > 0 && row < base.count; ++row) {
+      if (frozen.BaseRemoved(row)) {
+        purged.push_back(base.ids[row]);
+      }
+    }
+    if (update) {
+      // A mapped index is read only, its file is read into memory instead
+      std::unique_ptr<faiss::Index> copy(
+          base.ann_file.empty() ? faiss::clone_index(base.ann.get())
+                                : faiss::read_index(base.ann_file.c_str()));
+      std::unique_ptr<faiss::IndexIDMap2> ann(
+          dynamic_cast<faiss::IndexIDMap2 *>(copy.get()));
+      if (ann) {
+        copy.release();
+        if (!purged.empty()) {
+          ann->remove_ids(
+              faiss::IDSelectorBatch(purged.size(), purged.data()));
+        }
+        for (size_t i = 0; i < frozen.sizes.size(); ++i) {
+          auto &segment = *frozen.view->segments[i];
+          for (size_t row = 0; row < frozen.sizes[i]; ++row) {
+            if (!frozen.segment_removed[i][row]) {
+              ann->add_with_ids(1, segment.vectors.get() + row * dimension_,
+                                &segment.ids[row]);
+            }
+          }
+        }
+        return ann;
+      }
+    }
 
-    
-    std::ifstream index_ifs(index_file, std::ios::binary);
-    if (!index_ifs) {
-      ELOGFMT(ERROR, "Load error: Missing {}", index_file);
-      return false;
+    // Also converts an index of another type or storage, once
+    ELOGFMT(INFO, "Building {} vector index with {} storage from {} vectors",
+            options_.type, options_.storage, snapshot.count);
+    auto ann = MakeIndex(options_.type, snapshot.count);
+    if (!ann->is_trained) {
+      ann->train(snapshot.count, snapshot.vectors);
     }
-    index_ifs.close();
+    ann->add_with_ids(snapshot.count, snapshot.vectors, snapshot.ids);
+    ReportRecall(snapshot, *ann);
+    return ann;
+  } catch (const faiss::FaissException &e) {
+    ELOGFMT(ERROR, "FaissException while building {} index: {}",
+            options_.type, e.what());
+    return nullptr;
+  }
+}
 
-    std::ifstream key2id_ifs(key2id_file, std::ios::binary);
-    if (!key2id_ifs) {
-      ELOGFMT(ERROR, "Load error: Missing {}", key2id_file);
-      return false;
+// Logs how much of the exact top 10 of a sample of the indexed vectors a new
+// index finds, which is what quantization and approximate search cost.
+void FaissVectorDbService::ReportRecall(const Base &snapshot,
+                                        const faiss::IndexIDMap2 &ann) const {
+  constexpr size_t samples = 100;
+  if (snapshot.count == 0) {
+    return;
+  }
+  auto queries = std::min(samples, snapshot.count);
+  auto k = std::min<size_t>(10, snapshot.count);
+  std::vector<float> vectors(queries * dimension_);
+  for (size_t i = 0; i < queries; ++i) {
+    auto row = i * snapshot.count / queries;
+    std::copy_n(snapshot.vectors + row * dimension_, dimension_,
+                vectors.data() + i * dimension_);
+  }
+
+  std::vector<faiss::idx_t> exact(queries * k), found(queries * k);
+  std::vector<float> distances(queries * k);
+  if (metric_ == faiss::METRIC_INNER_PRODUCT) {
+    faiss::knn_inner_product(vectors.data(), snapshot.vectors, dimension_,
+                             queries, snapshot.count, k, distances.data(),
+                             exact.data());
+  } else {
+    faiss::knn_L2sqr(vectors.data(), snapshot.vectors, dimension_, queries,
+                     snapshot.count, k, distances.data(), exact.data());
+  }
+  ann_search_params search_params(ann, options_, k);
+  ann.search(queries, vectors.data(), k, distances.data(), found.data(),
+             search_params.params);
+
+  size_t hits = 0;
+  for (size_t q = 0; q < queries; ++q) {
+    auto first = found.begin() + q * k;
+    for (size_t i = q * k; i < (q + 1) * k; ++i) {
+      hits += exact[i] != -1 &&
+              std::find(first, first + k, snapshot.ids[exact[i]]) != first + k;
+    }
+  }
+  ELOGFMT(INFO, "{} index with {} storage finds {:.1f}% of the exact top {} "
+                "of {} sampled vectors",
+          options_.type, options_.storage, 100.0 * hits / (queries * k), k,
+          queries);
+}
+
+// Replaces the base with one holding every live vector and drops the
+// segments. With a path this is a checkpoint: the new base is the next
+// snapshot and the log is left with the changes made since the freeze. The
+// snapshot and its index are written from a frozen view while searches and
+// writers both continue, writers only wait for the freeze and the swap.
+bool FaissVectorDbService::Merge() {
+  std::lock_guard merge_lock(merge_mutex_);
+  Frozen frozen;
+  {
+    std::lock_guard write_lock(write_mutex_);
+    frozen = Freeze(true);
+  }
+  auto generation = path_.empty() ? generation_ : generation_ + 1;
+  auto base = WriteSnapshot(path_, generation, frozen);
+  if (!base) {
+    return false;
+  }
+  std::lock_guard write_lock(write_mutex_);
+  bool logged = Swap(frozen, std::move(base));
+  generation_ = generation;
+  if (!path_.empty()) {
+    // Searches still running keep the previous base mapped. Where its files
+    // cannot go while mapped they are removed on the next start.
+    remove_stale_snapshots(path_, generation_);
+  }
+  return logged;
+}
+
+// Makes `base`, written from `frozen`, the base, with the changes made since
+// the freeze on top: the segments added since are kept and frozen rows
+// removed since are removed from it. With a path the log is replaced by
+// records of just those changes. Needs write_mutex_.
+bool FaissVectorDbService::Swap(const Frozen &frozen,
+                                std::shared_ptr<Base> base) {
+  std::vector<std::pair<VectorKey, faiss::idx_t>> removed;
+  auto &old_base = *frozen.view->base;
+  for (size_t word = 0; word < frozen.base_removed.size(); ++word) {
+    auto bits = old_base.removed[word].load() & ~frozen.base_removed[word];
+    for (; bits; bits &= bits - 1) {
+      auto row = word * 64 + std::countr_zero(bits);
+      removed.emplace_back(old_base.KeyAt(row), old_base.ids[row]);
+    }
+  }
+  for (size_t i = 0; i < frozen.sizes.size(); ++i) {
+    auto &segment = *frozen.view->segments[i];
+    for (size_t row = 0; row < frozen.sizes[i]; ++row) {
+      if (segment.removed[row] && !frozen.segment_removed[i][row]) {
+        removed.emplace_back(segment.keys[row], segment.ids[row]);
+      }
     }
-    key2id_ifs.close();
+  }
 
-    std::ifstream id2key_ifs(id2key_file, std::ios::binary);
-    if (!id2key_ifs) {
-      ELOGFMT(ERROR, "Load error: Missing {}", id2key_file);
+  std::string records;
+  {
+    std::unique_lock lock(mutex_);
+    for (auto &[key, id] : removed) {
+      if (auto row = base->Find(key); row && base->ids[*row] == id) {
+        base->Remove(*row);
+      }
+      AppendRecord(records, WalOp::Delete, key, id, nullptr, nullptr);
+    }
+    auto view = std::make_shared<View>(View{std::move(base), {}});
+    view->segments.assign(view_->segments.begin() + frozen.sizes.size(),
+                          view_->segments.end());
+    delta_keys_.clear();
+    live_ = view->base->count - view->base->removed_count;
+    for (auto &segment : view->segments) {
+      for (size_t row = 0; row < segment->size; ++row) {
+        if (!segment->removed[row]) {
+          delta_keys_.insert_or_assign(segment->keys[row],
+                                       {segment->ids[row], segment.get(), row});
+          live_++;
+          AppendRecord(records, WalOp::Put, segment->keys[row],
+                       segment->ids[row],
+                       segment->vectors.get() + row * dimension_,
+                       &segment->attributes[row]);
+        }
+      }
+    }
+    view_ = std::move(view);
+  }
+  return path_.empty() || ReplaceLog(records);
+}
+
+// Makes `base` all there is. Needs write_mutex_.
+void FaissVectorDbService::Reset(std::shared_ptr<Base> base) {
+  std::unique_lock lock(mutex_);
+  live_ = base->count;
+  view_ = std::make_shared<View>(View{std::move(base), {}});
+  delta_keys_.clear();
+}
+
+std::unique_ptr<faiss::IndexIDMap2>
+FaissVectorDbService::MakeIndex(const std::string &type, size_t vectors) const {
+  auto nlist = options_.nlist > 0
+                   ? options_.nlist
+                   : std::clamp(static_cast<int>(4 * std::sqrt(vectors)), 16,
+                                65536);
+  // How vectors are encoded, the mapped snapshot keeps them as floats
+  std::string codes = "Flat";
+  if (options_.storage == "sq8") {
+    codes = "SQ8";
+  } else if (options_.storage == "fp16") {
+    codes = "SQfp16";
+  }
+  std::string description = codes;
+  if (type == "hnsw") {
+    description = options_.storage == "float"
+                      ? std::format("HNSW{}", options_.hnsw_m)
+                      : std::format("HNSW{},{}", options_.hnsw_m, codes);
+  } else if (type == "ivf_flat") {
+    description = std::format("IVF{},{}", nlist, codes);
+  } else if (type == "ivf_pq") {
+    description = std::format("IVF{},PQ{}x{}", nlist, options_.pq_m,
+                              options_.pq_nbits);
+  }
+
+  auto *inner = faiss::index_factory(dimension_, description.c_str(), metric_);
+  if (auto *hnsw = dynamic_cast<faiss::IndexHNSW *>(inner)) {
+    hnsw->hnsw.efConstruction = options_.ef_construction;
+  } else if (auto *ivf = dynamic_cast<faiss::IndexIVF *>(inner)) {
+    // Needed by remove_ids()
+    ivf->set_direct_map_type(faiss::DirectMap::Hashtable);
+  }
+  auto index = std::make_unique<faiss::IndexIDMap2>(inner);
+  index->own_fields = true;
+  return index;
+}
+
+bool FaissVectorDbService::IsConfiguredType(const faiss::Index *index) const {
+  if (options_.type == "ivf_pq") {
+    return dynamic_cast<const faiss::IndexIVFPQ *>(index);
+  }
+  auto quantizer = quantizer_of(options_.storage);
+  if (options_.type == "ivf_flat") {
+    if (!quantizer) {
+      return dynamic_cast<const faiss::IndexIVFFlat *>(index);
+    }
+    auto *ivf = dynamic_cast<const faiss::IndexIVFScalarQuantizer *>(index);
+    return ivf && ivf->sq.qtype == *quantizer;
+  }
+  // Flat and HNSW indexes differ in where they keep the vectors
+  const faiss::Index *storage = index;
+  if (options_.type == "hnsw") {
+    auto *hnsw = dynamic_cast<const faiss::IndexHNSW *>(index);
+    if (!hnsw) {
       return false;
     }
-    id2key_ifs.close();
+    storage = hnsw->storage;
+  }
+  if (!quantizer) {
+    return dynamic_cast<const faiss::IndexFlat *>(storage);
+  }
+  auto *sq = dynamic_cast<const faiss::IndexScalarQuantizer *>(storage);
+  return sq && sq->sq.qtype == *quantizer;
+}
+
+size_t FaissVectorDbService::TrainingThreshold() const {
+  if (!is_ivf(options_.type)) {
+    // Scalar quantizers learn the range of every dimension
+    return options_.storage == "float" ? 0 : 1;
+  }
+  // Faiss wants at least 39 training vectors per list
+  return std::max<size_t>(options_.min_train_vectors,
+                          39 * static_cast<size_t>(options_.nlist));
+}
+
+bool FaissVectorDbService::Save(const std::string &path) {
+  if (path == path_) {
+    return Merge();
+  }
+  std::lock_guard merge_lock(merge_mutex_);
+  Frozen frozen;
+  {
+    std::lock_guard write_lock(write_mutex_);
+    frozen = Freeze(false);
+  }
+  if (!WriteSnapshot(path, generation_ + 1, frozen)) {
+    return false;
+  }
+  remove_stale_snapshots(path, generation_ + 1);
+  return true;
+}
 
+bool FaissVectorDbService::Load(const std::string &path) {
+  std::lock_guard merge_lock(merge_mutex_);
+  std::lock_guard write_lock(write_mutex_);
+  try {
+    std::string meta_file = path + ".meta";
     std::ifstream meta_ifs(meta_file, std::ios::binary);
     if (!meta_ifs) {
       ELOGFMT(ERROR, "Load error: Missing {}", meta_file);
       return false;
     }
-
-    index_.reset(faiss::read_index(index_file.c_str()));
-    read_map(key2id_file, key_to_id_);
-    read_vector_of_strings(id2key_file, id_to_key_);
-
-    meta_ifs.read(reinterpret_cast<char *>(&next_id_), sizeof(next_id_));
-    meta_ifs.read(reinterpret_cast<char *>(&dimension_), sizeof(dimension_));
+    faiss::idx_t next_id;
+    int dimension;
     faiss::MetricType metric;
+    meta_ifs.read(reinterpret_cast<char *>(&next_id), sizeof(next_id));
+    meta_ifs.read(reinterpret_cast<char *>(&dimension), sizeof(dimension));
     meta_ifs.read(reinterpret_cast<char *>(&metric), sizeof(metric));
-    meta_ifs.close();
-
-    if (index_->d != dimension_) {
-      ELOGFMT(ERROR, "Load Error: Index dimension mismatch. Expected {}, loaded index has {}", dimension_, index_->d);
-      index_.reset();
-      key_to_id_.clear();
-      id_to_key_.clear();
-      next_id_ = 0;
-      if (this->dimension_ >
-          0) {
-        if (metric == faiss::METRIC_L2)
-          index_ = std::make_unique<faiss::IndexFlatL2>(this->dimension_);
-        else if (metric == faiss::METRIC_INNER_PRODUCT)
-          index_ = std::make_unique<faiss::IndexFlatIP>(this->dimension_);
-        else
-          index_ =
-              std::make_unique<faiss::IndexFlatL2>(this->dimension_);
+    if (!meta_ifs) {
+      ELOGFMT(ERROR, "Load error: Truncated {}", meta_file);
+      return false;
+    }
+    // Missing in snapshots written before they were mapped
+    uint64_t generation = 0;
+    meta_ifs.read(reinterpret_cast<char *>(&generation), sizeof(generation));
+    if (!meta_ifs) {
+      generation = 0;
+    }
+    if (dimension != dimension_) {
+      ELOGFMT(ERROR, "Load Error: Index dimension mismatch. Expected {}, loaded index has {}", dimension_, dimension);
+      return false;
+    }
+    if (generation == 0) {
+      metric_ = metric;
+      if (!LoadLegacy(path)) {
+        return false;
       }
+      next_id_ = next_id;
+      generation_ = 0;
+      return true;
+    }
+
+    auto base = std::make_shared<Base>();
+    auto vectors_file = snapshot_file(path, generation, "vectors");
+    auto keys_file = snapshot_file(path, generation, "keys");
+    auto attributes_file = snapshot_file(path, generation, "attrs");
+    // Optional, the vectors of older snapshots have no attributes
+    if (std::filesystem::exists(attributes_file) &&
+        !base->attributes_file.open(attributes_file)) {
+      ELOGFMT(ERROR, "Load error: Failed to map {}", attributes_file);
+      return false;
+    }
+    if (!base->vectors_file.open(vectors_file) ||
+        !base->keys_file.open(keys_file)) {
+      ELOGFMT(ERROR, "Load error: Missing {} or {}", vectors_file, keys_file);
+      return false;
+    }
+    std::string_view keys_data = bytes_of(base->keys_file);
+    auto *string_keys = view_of<string_keys_header>(keys_data, 0, 1);
+    bool had_string_keys = string_keys && string_keys->magic == string_keys_magic;
+    if (had_string_keys) {
+      // Converted in memory, CreateOrLoad() writes the current layout
+      base->keys_bytes = keys_from_strings(
+          keys_data, [&](std::string_view key) { return LegacyKey(key); });
+      base->keys_file.close();
+      keys_data = base->keys_bytes;
+    }
+    if (!base->Parse(bytes_of(base->vectors_file), keys_data,
+                     bytes_of(base->attributes_file), dimension_)) {
+      ELOGFMT(ERROR, "Load error: Damaged {} or {}", vectors_file, keys_file);
+      return false;
+    }
+    // Missing when written without binary_candidates, Train() adds them
+    auto codes_file = snapshot_file(path, generation, "bits");
+    if (options_.binary_candidates > 0 && std::filesystem::exists(codes_file) &&
+        (!base->codes_file.open(codes_file) ||
+         !base->ParseCodes(bytes_of(base->codes_file), dimension_))) {
+      ELOGFMT(ERROR, "Load error: Damaged {}", codes_file);
       return false;
     }
+    // An index of another type or storage is searched until Train()
+    // replaces it, one is never needed to scan the vectors
+    auto ann_file = snapshot_file(path, generation, "faissidx");
+    if (!scans_vectors(options_) && std::filesystem::exists(ann_file)) {
+      // Inverted lists are mapped, other index types have to be read
+      std::unique_ptr<faiss::Index> ann(faiss::read_index(
+          ann_file.c_str(), is_ivf(options_.type) ? faiss::IO_FLAG_MMAP : 0));
+      base->ann.reset(dynamic_cast<faiss::IndexIDMap2 *>(ann.get()));
+      if (base->ann) {
+        ann.release();
+        base->ann_file = ann_file;
+      }
+    }
 
+    metric_ = metric;
+    Reset(std::move(base));
+    next_id_ = next_id;
+    generation_ = generation;
+    string_keys_ = had_string_keys;
+    if (had_string_keys) {
+      // Rows whose string key had no VectorKey
+      std::unique_lock lock(mutex_);
+      auto &loaded = *view_->base;
+      for (size_t row = 0; row < loaded.count; ++row) {
+        if (loaded.keys[row] == kvdb::empty_id) {
+          loaded.Remove(row);
+          live_--;
+        }
+      }
+    }
     return true;
   } catch (const faiss::FaissException &e) {
     ELOGFMT(ERROR, "FaissException during Load: {}", e.what());
@@ -364,34 +1700,318 @@ bool FaissVectorDbService::Load(const std::string &path) {
   }
 }
 
+// Reads a snapshot written before snapshots were mapped into segments, the
+// next checkpoint writes it in the current layout. Needs write_mutex_.
+bool FaissVectorDbService::LoadLegacy(const std::string &path) {
+  std::string index_file = path + ".faissidx";
+  std::string key2id_file = path + ".key2id";
+  if (!std::filesystem::exists(index_file)) {
+    ELOGFMT(ERROR, "Load error: Missing {}", index_file);
+    return false;
+  }
+  if (!std::filesystem::exists(key2id_file)) {
+    ELOGFMT(ERROR, "Load error: Missing {}", key2id_file);
+    return false;
+  }
+
+  std::unique_ptr<faiss::Index> loaded(faiss::read_index(index_file.c_str()));
+  std::unordered_map<std::string, faiss::idx_t> key_to_id;
+  read_map(key2id_file, key_to_id);
+  if (loaded->d != dimension_) {
+    ELOGFMT(ERROR, "Load Error: Index dimension mismatch. Expected {}, loaded index has {}", dimension_, loaded->d);
+    return false;
+  }
+
+  // Indexes saved before ids were stable store vector i under id i, which
+  // reconstruct() takes as well
+  std::vector<std::pair<faiss::idx_t, const std::string *>> entries;
+  entries.reserve(key_to_id.size());
+  for (auto &[key, id] : key_to_id) {
+    entries.emplace_back(id, &key);
+  }
+  std::sort(entries.begin(), entries.end());
+
+  Reset(std::make_shared<Base>());
+  std::unique_lock lock(mutex_);
+  std::vector<float> vector(dimension_);
+  for (auto &[id, key] : entries) {
+    auto vector_key = LegacyKey(*key);
+    if (!vector_key || *vector_key == kvdb::empty_id || Find(*vector_key)) {
+      continue;
+    }
+    loaded->reconstruct(id, vector.data());
+    Insert(*vector_key, id, vector.data(), {});
+  }
+  return true;
+}
+
+std::optional<VectorKey>
+FaissVectorDbService::LegacyKey(std::string_view key) const {
+  if (options_.legacy_key) {
+    return options_.legacy_key(key);
+  }
+  VectorKey parsed;
+  auto [end, ec] = std::from_chars(key.data(), key.data() + key.size(), parsed);
+  if (ec != std::errc() || end != key.data() + key.size()) {
+    return std::nullopt;
+  }
+  return parsed;
+}
+
 bool FaissVectorDbService::CreateOrLoad(const std::string &path) {
-  if (!Load(path)) {
-    return Save(path);
+  // A snapshot that is there but fails to load is left as it is, along with
+  // its log and older generations, starting over would lose them for good
+  bool exists = std::ranges::any_of(
+      std::array{".meta", ".faissidx", ".key2id", ".id2key"},
+      [&](const char *suffix) { return std::filesystem::exists(path + suffix); });
+  if (exists) {
+    if (!Load(path)) {
+      ELOGFMT(ERROR, "Failed to load the vector index {}, leaving it as it is",
+              path);
+      return false;
+    }
+  } else {
+    // A log only makes sense on top of the snapshot it was written after
+    std::filesystem::remove(path + ".wal");
+    if (!Save(path) || !Load(path)) {
+      return false;
+    }
+  }
+  if (!OpenLog(path)) {
+    return false;
+  }
+
+  {
+    std::lock_guard write_lock(write_mutex_);
+    if (generation_ != 0 && !string_keys_) {
+      remove_stale_snapshots(path, generation_);
+      return true;
+    }
+    string_keys_ = false;
   }
+  ELOGFMT(INFO, "Converting {} to a mapped snapshot", path);
+  return Merge();
+}
+
+// Replays the log of changes made since the last checkpoint and keeps it
+// open for appending. A record cut short by a crash, or one with an unknown
+// op, ends the replay and is dropped from the file along with what follows.
+bool FaissVectorDbService::OpenLog(const std::string &path) {
+  std::lock_guard write_lock(write_mutex_);
+  std::unique_lock lock(mutex_);
+  std::lock_guard file_lock(wal_file_mutex_);
+  auto wal_path = path + ".wal";
+
+  size_t replayed = 0;
+  uintmax_t valid_bytes = 0;
+  if (std::ifstream ifs(wal_path, std::ios::binary); ifs) {
+    std::vector<float> vector(dimension_);
+    while (true) {
+      WalOp op;
+      faiss::idx_t id;
+      ifs.read(reinterpret_cast<char *>(&op), sizeof(op));
+      ifs.read(reinterpret_cast<char *>(&id), sizeof(id));
+      // A byte that is no record is as torn as a short one
+      if (!ifs || op < WalOp::Add || op > WalOp::Delete) {
+        break;
+      }
+      std::optional<VectorKey> key;
+      if (op == WalOp::Put || op == WalOp::Delete) {
+        VectorKey number = kvdb::empty_id;
+        ifs.read(reinterpret_cast<char *>(&number), sizeof(number));
+        key = number;
+      } else {
+        uint32_t key_len;
+        ifs.read(reinterpret_cast<char *>(&key_len), sizeof(key_len));
+        std::string string_key(ifs ? key_len : 0, '\0');
+        ifs.read(string_key.data(), string_key.size());
+        key = LegacyKey(string_key);
+      }
+      bool add = op == WalOp::Add || op == WalOp::AddWithAttributes ||
+                 op == WalOp::Put;
+      if (add) {
+        ifs.read(reinterpret_cast<char *>(vector.data()),
+                 vector.size() * sizeof(float));
+      }
+      VectorAttributes attributes;
+      if (op == WalOp::AddWithAttributes || op == WalOp::Put) {
+        ifs.read(reinterpret_cast<char *>(&attributes.chat_id),
+                 sizeof(attributes.chat_id));
+        ifs.read(reinterpret_cast<char *>(&attributes.sender_id),
+                 sizeof(attributes.sender_id));
+        ifs.read(reinterpret_cast<char *>(&attributes.send_time),
+                 sizeof(attributes.send_time));
+        ifs.read(reinterpret_cast<char *>(&attributes.content_kinds),
+                 sizeof(attributes.content_kinds));
+      }
+      if (!ifs) {
+        break;
+      }
+
+      // String keys without a VectorKey are skipped
+      if (key && *key != kvdb::empty_id) {
+        auto current = Find(*key);
+        if (add) {
+          // Already in the snapshot when a checkpoint was interrupted
+          if (!current || current->id != id) {
+            if (current) {
+              Tombstone(*key, *current);
+            }
+            Insert(*key, id, vector.data(), attributes);
+            next_id_ = std::max(next_id_, id + 1);
+          }
+        } else if (current && current->id == id) {
+          Tombstone(*key, *current);
+        }
+      }
+      replayed++;
+      valid_bytes = static_cast<uintmax_t>(ifs.tellg());
+    }
+  }
+  if (std::filesystem::exists(wal_path)) {
+    std::filesystem::resize_file(wal_path, valid_bytes);
+  }
+  if (replayed) {
+    ELOGFMT(INFO, "Replayed {} vector changes from {}", replayed, wal_path);
+  }
+
+  wal_ = std::fopen(wal_path.c_str(), "ab");
+  if (!wal_) {
+    ELOGFMT(ERROR, "Failed to open {}", wal_path);
+    return false;
+  }
+  path_ = path;
+  std::lock_guard buffer_lock(wal_mutex_);
+  wal_bytes_ = valid_bytes;
   return true;
 }
 
-std::vector<float> FaissVectorDbService::GetVector(const std::string &key) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = key_to_id_.find(key);
-  if (it == key_to_id_.end()) {
-    return {}; // Return empty vector if key not found
+// Replaces the log with `records` through a synced file renamed over it, so
+// a crash leaves one of the two logs whole. Needs write_mutex_.
+bool FaissVectorDbService::ReplaceLog(const std::string &records) {
+  std::lock_guard file_lock(wal_file_mutex_);
+  std::lock_guard buffer_lock(wal_mutex_);
+  auto wal_path = path_ + ".wal";
+  auto *file = std::fopen((wal_path + ".tmp").c_str(), "wb");
+  bool written = file &&
+                 std::fwrite(records.data(), 1, records.size(), file) ==
+                     records.size() &&
+                 sync_file(file);
+  if (file) {
+    std::fclose(file);
+  }
+  if (!written) {
+    ELOGFMT(ERROR, "Failed to write the vector log of {}", path_);
+    return false;
+  }
+  // Windows cannot rename over an open file
+  std::fclose(wal_);
+  std::error_code ec;
+  std::filesystem::rename(wal_path + ".tmp", wal_path, ec);
+  wal_ = std::fopen(wal_path.c_str(), "ab");
+  if (!wal_) {
+    ELOGFMT(ERROR, "Failed to open {}", wal_path);
+    return false;
   }
+  if (ec || !sync_directory(directory_of(path_))) {
+    // The previous log stays, which holds every change since the previous
+    // snapshot and replays the same on top of the new one
+    ELOGFMT(ERROR, "Failed to replace the vector log of {}", path_);
+    return false;
+  }
+  wal_buffer_.clear();
+  wal_bytes_ = records.size();
+  return true;
+}
 
-  faiss::Index::idx_t faiss_id = it->second;
-  std::vector<float> vector_data(dimension_);
-  try {
-    index_->reconstruct(faiss_id, vector_data.data());
-    return vector_data;
-  } catch (const faiss::FaissException &e) {
-    ELOGFMT(ERROR, "FaissException during GetVector for key {}: {}", key, e.what());
-    return {}; // Return empty vector on error
+void FaissVectorDbService::Log(WalOp op, VectorKey key,
+                               faiss::idx_t id, const float *vector,
+                               const VectorAttributes *attributes) {
+  std::lock_guard lock(wal_mutex_);
+  if (!wal_) {
+    return;
+  }
+  AppendRecord(wal_buffer_, op, key, id, vector, attributes);
+}
+
+void FaissVectorDbService::AppendRecord(
+    std::string &out, WalOp op, VectorKey key, faiss::idx_t id,
+    const float *vector, const VectorAttributes *attributes) const {
+  auto append = [&](const void *data, size_t size) {
+    out.append(static_cast<const char *>(data), size);
+  };
+  append(&op, sizeof(op));
+  append(&id, sizeof(id));
+  append(&key, sizeof(key));
+  if (vector) {
+    append(vector, dimension_ * sizeof(float));
+  }
+  if (attributes) {
+    append(&attributes->chat_id, sizeof(attributes->chat_id));
+    append(&attributes->sender_id, sizeof(attributes->sender_id));
+    append(&attributes->send_time, sizeof(attributes->send_time));
+    append(&attributes->content_kinds, sizeof(attributes->content_kinds));
   }
 }
 
-bool FaissVectorDbService::Exists(const std::string &key) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return key_to_id_.count(key) > 0;
+// Every change logged since the previous call is written and synced at once,
+// so the cost of an fsync is shared by all of them.
+bool FaissVectorDbService::Sync() {
+  std::lock_guard file_lock(wal_file_mutex_);
+  std::string pending;
+  {
+    std::lock_guard lock(wal_mutex_);
+    if (!wal_ || wal_buffer_.empty()) {
+      return true;
+    }
+    pending.swap(wal_buffer_);
+    wal_bytes_ += pending.size();
+  }
+  if (std::fwrite(pending.data(), 1, pending.size(), wal_) != pending.size() ||
+      !sync_file(wal_)) {
+    ELOGFMT(ERROR, "Failed to write the vector log of {}", path_);
+    return false;
+  }
+  return true;
+}
+
+bool FaissVectorDbService::Checkpoint(bool force) {
+  {
+    std::lock_guard buffer_lock(wal_mutex_);
+    if (!wal_) {
+      return false;
+    }
+    auto dirty = wal_bytes_ + wal_buffer_.size();
+    if (dirty == 0 || (!force && dirty < options_.checkpoint_bytes)) {
+      return true;
+    }
+  }
+  return Merge();
+}
+
+std::vector<float> FaissVectorDbService::GetVector(VectorKey key) {
+  std::shared_lock lock(mutex_);
+  auto location = Find(key);
+  if (!location) {
+    return {}; // Return empty vector if key not found
+  }
+  auto *vector = VectorOf(*location);
+  return std::vector<float>(vector, vector + dimension_);
+}
+
+bool FaissVectorDbService::Exists(VectorKey key) {
+  std::shared_lock lock(mutex_);
+  return Find(key).has_value();
+}
+
+void FaissVectorDbService::ForEach(
+    const std::function<void(VectorKey key, std::span<const float> vector,
+                             const VectorAttributes &attributes)> &visit) {
+  std::lock_guard write_lock(write_mutex_);
+  for (auto &row : LiveRows(Freeze(false))) {
+    visit(row.key, {row.vector, static_cast<size_t>(dimension_)},
+          row.attributes);
+  }
 }
 
 } // namespace tgdb
@@ -1,45 +1,194 @@
 #pragma once
 
+#include "id_table.hpp"
 #include "vector_db.h"
 #include <faiss/Index.h>
 #include <faiss/IndexFlat.h>
+#include <faiss/IndexIDMap.h>
 #include <faiss/index_io.h>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
-#include <unordered_map>
 #include <mutex>
+#include <shared_mutex>
 
 namespace tgdb {
 
+struct FaissIndexOptions {
+    // "flat" (exact), "hnsw", "ivf_flat" or "ivf_pq"
+    std::string type = "flat";
+    // "float", "fp16" or "sq8": how the searched index keeps the vectors,
+    // ignored by ivf_pq. Quantized flat indexes are searched instead of the
+    // mapped float vectors, which stay on disk for rebuilds.
+    std::string storage = "float";
+    int hnsw_m = 32;
+    int ef_construction = 80;
+    int ef_search = 64;
+    // IVF lists, 0 picks 4 * sqrt(vectors) when the index is trained
+    int nlist = 0;
+    int nprobe = 16;
+    // PQ sub-quantizers, must divide the dimension
+    int pq_m = 64;
+    int pq_nbits = 8;
+    // IVF indexes are trained once this many vectors exist, searches are
+    // exact until then
+    size_t min_train_vectors = 50000;
+    // When set, checkpointed vectors are searched in two passes: the sign
+    // bits of the vectors are ranked by Hamming distance and only this many
+    // candidates get exact distances from the float vectors. Takes the place
+    // of the exact scan, so only flat indexes with float storage use it.
+    size_t binary_candidates = 0;
+    // The index is rewritten once its log grew this large
+    size_t checkpoint_bytes = 64ull << 20;
+    // Turns the keys of indexes written while keys were strings into
+    // VectorKeys, vectors it has none for are dropped. Decimal numbers by
+    // default.
+    std::function<std::optional<VectorKey>(std::string_view)> legacy_key;
+};
+
 class FaissVectorDbService : public VectorDbService {
 public:
-    FaissVectorDbService(int dimension, faiss::MetricType metric = faiss::METRIC_L2);
+    FaissVectorDbService(int dimension, faiss::MetricType metric = faiss::METRIC_L2,
+                         FaissIndexOptions options = {});
     ~FaissVectorDbService() override;
 
-    bool AddVector(const std::string& key, const std::vector<float>& vector) override;
-    std::vector<SearchResult> Search(const std::vector<float>& query_vector, int top_k) override;
-    bool RemoveVector(const std::string& key) override;
-    bool UpdateVector(const std::string& key, const std::vector<float>& vector) override;
+    bool AddVector(VectorKey key, const std::vector<float>& vector,
+                   const VectorAttributes& attributes = {}) override;
+    size_t AddVectors(const std::vector<VectorKey>& keys,
+                      const std::vector<std::vector<float>>& vectors,
+                      const std::vector<VectorAttributes>& attributes = {}) override;
+    std::vector<SearchResult> Search(const std::vector<float>& query_vector, int top_k,
+                                     const SearchFilter& filter = {}) override;
+    std::vector<std::vector<SearchResult>>
+    SearchBatch(const std::vector<std::vector<float>>& query_vectors, int top_k,
+                const SearchFilter& filter = {}) override;
+    bool RemoveVector(VectorKey key) override;
+    bool UpdateVector(VectorKey key, const std::vector<float>& vector) override;
     bool Save(const std::string& path) override;
     bool Load(const std::string& path) override;
     bool CreateOrLoad(const std::string &path) override;
 
-    std::vector<float> GetVector(const std::string &key) override;
-    bool Exists(const std::string &key) override;
+    std::vector<float> GetVector(VectorKey key) override;
+    bool Exists(VectorKey key) override;
+    void ForEach(const std::function<void(VectorKey key,
+                                          std::span<const float> vector,
+                                          const VectorAttributes &attributes)>
+                     &visit) override;
+    size_t Compact() override;
+    bool Train() override;
+    bool Sync() override;
+    bool Checkpoint(bool force = false) override;
 
   private:
+    struct Base;
+    struct Segment;
+    struct View;
+    struct Frozen;
+    struct Row;
+    struct Hit;
+
+    // Where the live vector of a key is, segment is null for rows of the base
+    struct Location {
+        faiss::idx_t id;
+        Segment *segment;
+        size_t row;
+    };
+
     int dimension_;
-    std::unique_ptr<faiss::Index> index_;
-    
-    
-    std::unordered_map<std::string, faiss::Index::idx_t> key_to_id_;
-    std::vector<std::string> id_to_key_; 
-    faiss::Index::idx_t next_id_ = 0;
-    std::mutex mutex_; 
-
-    
-    void RebuildIndex();
+    faiss::MetricType metric_;
+    FaissIndexOptions options_;
+
+    // What searches read: the vectors as of the last checkpoint plus
+    // append-only segments with the ones added since. Rows are only ever
+    // appended or flagged as removed, so a search copies the pointer and runs
+    // without any lock while writes continue. Loaded from a snapshot the base
+    // is memory mapped, so opening it costs the same whatever its size.
+    std::shared_ptr<const View> view_;
+    // Keys of the segments and keys of the base removed or replaced since
+    kvdb::id_table<Location> delta_keys_;
+    faiss::idx_t next_id_ = 0;
+    size_t live_ = 0;
+    // Guards view_ and delta_keys_, held only for O(1) work and never while
+    // searching.
+    std::shared_mutex mutex_;
+    // Held by writers, and by checkpoints only to freeze the view and to
+    // swap in the base written from it.
+    std::mutex write_mutex_;
+    // Held for a whole checkpoint, so only one rewrites the base at a time
+    std::mutex merge_mutex_;
+
+    // Changes since the last checkpoint of path_ are appended to
+    // <path_>.wal, buffered in wal_buffer_ until the next Sync().
+    // Add, Remove and AddWithAttributes records carry string keys, Put and
+    // Delete 8-byte ones. Add records were written before vectors had
+    // attributes and lack them.
+    enum class WalOp : uint8_t {
+        Add = 1,
+        Remove = 2,
+        AddWithAttributes = 3,
+        Put = 4,
+        Delete = 5
+    };
+    std::string path_;
+    // Snapshot files are named after the checkpoint that wrote them, so a
+    // new one never replaces files that are still mapped.
+    uint64_t generation_ = 0;
+    // Whether the loaded snapshot has string keys, CreateOrLoad() rewrites it
+    bool string_keys_ = false;
+    std::FILE *wal_ = nullptr;
+    std::mutex wal_file_mutex_;
+    std::mutex wal_mutex_;
+    std::string wal_buffer_;
+    // Bytes of the log file already written
+    size_t wal_bytes_ = 0;
+
+    std::optional<Location> Find(VectorKey key) const;
+    const float *VectorOf(const Location &location) const;
+    VectorAttributes AttributesOf(const Location &location) const;
+    void Insert(VectorKey key, faiss::idx_t id, const float *vector,
+                const VectorAttributes &attributes);
+    void Tombstone(VectorKey key, const Location &location);
+    std::optional<VectorKey> LegacyKey(std::string_view key) const;
+    // Searches `count` queries stored back to back
+    std::vector<std::vector<SearchResult>>
+    SearchQueries(const float *queries, size_t count, int top_k,
+                  const SearchFilter &filter);
+    void SearchBase(const Base &base, const float *queries, size_t count,
+                    int top_k, const SearchFilter &filter,
+                    std::vector<std::vector<Hit>> &hits) const;
+    void SearchSegment(const Segment &segment, const float *queries,
+                       size_t count, int top_k, const SearchFilter &filter,
+                       std::vector<std::vector<Hit>> &hits) const;
+    void Log(WalOp op, VectorKey key, faiss::idx_t id,
+             const float *vector, const VectorAttributes *attributes = nullptr);
+    void AppendRecord(std::string &out, WalOp op, VectorKey key,
+                      faiss::idx_t id, const float *vector,
+                      const VectorAttributes *attributes) const;
+    bool OpenLog(const std::string &path);
+    bool ReplaceLog(const std::string &records);
+    bool LoadLegacy(const std::string &path);
+    Frozen Freeze(bool seal);
+    std::vector<Row> LiveRows(const Frozen &frozen) const;
+    std::shared_ptr<Base> WriteSnapshot(const std::string &path,
+                                        uint64_t generation,
+                                        const Frozen &frozen) const;
+    std::unique_ptr<faiss::IndexIDMap2> BuildAnn(const Base &snapshot,
+                                                 const Frozen &frozen) const;
+    void ReportRecall(const Base &snapshot,
+                      const faiss::IndexIDMap2 &ann) const;
+    bool Merge();
+    bool Swap(const Frozen &frozen, std::shared_ptr<Base> base);
+    void Reset(std::shared_ptr<Base> base);
+    std::unique_ptr<faiss::IndexIDMap2> MakeIndex(const std::string &type,
+                                                  size_t vectors) const;
+    bool IsConfiguredType(const faiss::Index *index) const;
+    size_t TrainingThreshold() const;
 };
 
 } 
\ No newline at end of file
@@ -0,0 +1,139 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace kvdb {
+// Marks unused slots, the one id an id_table cannot hold.
+inline constexpr uint64_t empty_id = ~uint64_t{0};
+
+template <typename V> struct id_slot {
+  uint64_t id = empty_id;
+  V value{};
+};
+
+// Slot the probe for `id` starts at among `capacity`, a power of two. Ids
+// often differ only in their high bits, e.g. message ids, so they are
+// scrambled by a multiplicative hash whose top bits are taken.
+inline size_t id_home(uint64_t id, size_t capacity) {
+  return static_cast<size_t>((id * 0x9E3779B97F4A7C15ull) >>
+                             (64 - std::countr_zero(capacity)));
+}
+
+// Looks `id` up among the slots of an id_table, which may be mapped from a
+// file it was written to.
+template <typename V>
+const id_slot<V> *find_id(const id_slot<V> *slots, size_t capacity,
+                          uint64_t id) {
+  if (capacity == 0 || id == empty_id) {
+    return nullptr;
+  }
+  for (size_t i = id_home(id, capacity);; i = (i + 1) & (capacity - 1)) {
+    if (slots[i].id == id) {
+      return &slots[i];
+    }
+    if (slots[i].id == empty_id) {
+      return nullptr;
+    }
+  }
+}
+
+// Map from 64-bit ids to values, held in one array probed linearly and kept
+// at most 3/4 full. There is no per-entry allocation, and the slots can be
+// written to a file as they are and searched in place with find_id().
+template <typename V> class id_table {
+public:
+  static constexpr size_t min_capacity = 16;
+
+  id_table() = default;
+  explicit id_table(size_t expected) { reserve(expected); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::span<const id_slot<V>> slots() const { return slots_; }
+
+  V *find(uint64_t id) {
+    auto *slot = find_id(slots_.data(), slots_.size(), id);
+    return slot ? &const_cast<id_slot<V> *>(slot)->value : nullptr;
+  }
+  const V *find(uint64_t id) const {
+    auto *slot = find_id(slots_.data(), slots_.size(), id);
+    return slot ? &slot->value : nullptr;
+  }
+
+  // Returns false when `id` was present, its value is replaced then.
+  bool insert_or_assign(uint64_t id, V value) {
+    reserve(size_ + 1);
+    auto mask = slots_.size() - 1;
+    for (size_t i = id_home(id, slots_.size());; i = (i + 1) & mask) {
+      if (slots_[i].id == id) {
+        slots_[i].value = std::move(value);
+        return false;
+      }
+      if (slots_[i].id == empty_id) {
+        slots_[i] = {id, std::move(value)};
+        size_++;
+        return true;
+      }
+    }
+  }
+
+  // Later slots of the probe sequence are shifted back into the gap, so
+  // lookups never need tombstones.
+  bool erase(uint64_t id) {
+    auto *slot = find_id(slots_.data(), slots_.size(), id);
+    if (!slot) {
+      return false;
+    }
+    auto mask = slots_.size() - 1;
+    size_t hole = slot - slots_.data();
+    for (size_t i = (hole + 1) & mask; slots_[i].id != empty_id;
+         i = (i + 1) & mask) {
+      // Moves unless its probe starts after the hole, up to i
+      size_t home = id_home(slots_[i].id, slots_.size());
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        slots_[hole] = std::move(slots_[i]);
+        hole = i;
+      }
+    }
+    slots_[hole] = {};
+    size_--;
+    return true;
+  }
+
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+  }
+
+  void reserve(size_t count) {
+    auto capacity = std::max(min_capacity, std::bit_ceil(count + count / 3 + 1));
+    if (capacity <= slots_.size()) {
+      return;
+    }
+    auto old = std::exchange(slots_, std::vector<id_slot<V>>(capacity));
+    size_ = 0;
+    for (auto &slot : old) {
+      if (slot.id != empty_id) {
+        insert_or_assign(slot.id, std::move(slot.value));
+      }
+    }
+  }
+
+  template <typename F> void for_each(F &&visit) const {
+    for (auto &slot : slots_) {
+      if (slot.id != empty_id) {
+        visit(slot.id, slot.value);
+      }
+    }
+  }
+
+private:
+  std::vector<id_slot<V>> slots_;
+  size_t size_ = 0;
+};
+} // namespace kvdb
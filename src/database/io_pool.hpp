@@ -0,0 +1,95 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "async_simple/Executor.h"
+#include "async_simple/Promise.h"
+#include "async_simple/Try.h"
+#include "async_simple/coro/Lazy.h"
+
+namespace kvdb {
+// Fixed set of threads for blocking storage calls. Coroutines hand work over
+// with run() and resume on their own executor once it is done, so a slow
+// read or a write stall never occupies the threads that drive network I/O.
+class io_pool {
+public:
+  explicit io_pool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back([this] { work(); });
+    }
+  }
+
+  io_pool(const io_pool &) = delete;
+  io_pool &operator=(const io_pool &) = delete;
+
+  ~io_pool() {
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Runs `f` on a pool thread. Exceptions thrown by `f` are rethrown to the
+  // awaiting coroutine.
+  template <typename F, typename R = std::invoke_result_t<F>>
+  async_simple::coro::Lazy<R> run(F f) {
+    auto *executor = co_await async_simple::CurrentExecutor{};
+    async_simple::Promise<R> promise;
+    auto future = promise.getFuture().via(executor);
+
+    post([promise = std::move(promise),
+          f = std::make_shared<F>(std::move(f))]() mutable {
+      promise.setValue(async_simple::makeTryCall(*f));
+    });
+    co_return co_await std::move(future);
+  }
+
+  size_t size() const { return workers_.size(); }
+
+private:
+  void post(std::function<void()> job) {
+    {
+      std::lock_guard lock(mutex_);
+      jobs_.push_back(std::move(job));
+    }
+    cv_.notify_one();
+  }
+
+  void work() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+          return;
+        }
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      job();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> jobs_;
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+};
+} // namespace kvdb
@@ -0,0 +1,118 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <expected>
+#include <format>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "async_simple/coro/Lazy.h"
+
+#include "ylt/easylog.hpp"
+
+#include "background_scan.hpp"
+#include "database.hpp"
+
+namespace kvdb {
+// Ordered schema migrations of a database. The version reached is stored in
+// the database itself, each pending step runs as a checkpointed background
+// scan and bumps the version once it completes. Until then records in an
+// older format keep being decoded on read, see detail::decode.
+template <typename T> struct migrations {
+  struct step {
+    uint32_t version;
+    std::string name;
+    std::function<async_simple::coro::Lazy<scan_progress>(
+        database<T> &, background_scan_options)>
+        run;
+  };
+
+  std::vector<step> steps;
+  // Applied to every step, the checkpoint name is filled in per step.
+  background_scan_options options;
+
+  // Registers a step rewriting the values for which `process(key, value)`
+  // returns a new one. V restricts the scan, and what is rewritten, to one
+  // column family part.
+  template <typename V = T, typename F>
+  void add(uint32_t version, std::string name, F process) {
+    steps.push_back(
+        {version, std::move(name),
+         [process = std::move(process)](database<T> &db,
+                                        background_scan_options options) {
+           return background_scan<T, V>(db, std::move(options), process);
+         }});
+    std::ranges::sort(steps, {}, &step::version);
+  }
+
+  uint32_t latest_version() const {
+    return steps.empty() ? 0 : steps.back().version;
+  }
+
+  bool running() const { return running_; }
+
+  // Brings `db` to the latest version. Safe to restart after an interruption
+  // or a failed step, a step resumes from its last checkpoint.
+  async_simple::coro::Lazy<std::expected<void, std::string>>
+  run(database<T> &db) {
+    if (running_.exchange(true)) {
+      co_return std::unexpected<std::string>("Migrations are already running");
+    }
+    // Cleared however run() ends, including by an exception
+    struct running_guard {
+      std::atomic<bool> &running;
+      ~running_guard() { running = false; }
+    } guard{running_};
+
+    auto stored = db.schema_version();
+    if (!stored) {
+      co_return std::unexpected(stored.error());
+    }
+    auto version = *stored;
+    if (!db.get_meta("schema_version") && !db.begin().valid()) {
+      // A new database is created in the latest format
+      version = latest_version();
+      db.set_schema_version(version);
+    }
+
+    for (auto &s : steps) {
+      if (s.version <= version) {
+        continue;
+      }
+      ELOGFMT(INFO, "Migrating {} to version {}: {}", db.db_path, s.version,
+              s.name);
+
+      auto step_options = options;
+      step_options.checkpoint = std::format("migration/{}", s.version);
+      scan_progress progress;
+      try {
+        progress = co_await s.run(db, std::move(step_options));
+      } catch (const std::exception &e) {
+        co_return std::unexpected(std::format(
+            "Migration to version {} ({}) failed: {}", s.version, s.name,
+            e.what()));
+      }
+
+      if (!db.set_schema_version(s.version)) {
+        co_return std::unexpected(
+            std::format("Failed to record schema version {}", s.version));
+      }
+      version = s.version;
+      ELOGFMT(INFO,
+              "Migrated {} to version {}: {} scanned, {} rewritten, {} "
+              "conflicts",
+              db.db_path, s.version, progress.scanned, progress.written,
+              progress.conflicts);
+    }
+
+    co_return std::expected<void, std::string>{};
+  }
+
+private:
+  std::atomic<bool> running_ = false;
+};
+} // namespace kvdb
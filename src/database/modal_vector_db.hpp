@@ -0,0 +1,214 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "ylt/easylog.hpp"
+
+#include "id_table.hpp"
+#include "vector_db.h"
+
+namespace tgdb {
+// One index per modality, e.g. text and image embeddings. Vectors of
+// different modalities are not compared with each other, so a query only
+// scans the index of its own modality. A message has at most one vector per
+// modality, which is stored under the same key in each index.
+class ModalVectorDb {
+public:
+  using factory = std::function<std::unique_ptr<VectorDbService>()>;
+  // Maps a key of an index shared by every modality to the modality and the
+  // key its vector gets, nullopt to drop it.
+  using splitter =
+      std::function<std::optional<std::pair<size_t, VectorKey>>(VectorKey)>;
+
+  // Modality i is named names[i], its index is stored as <path>.<name>.
+  // `higher_is_closer` tells how the scores of the indexes compare, true for
+  // inner products.
+  ModalVectorDb(std::vector<std::string> names, const factory &make,
+                bool higher_is_closer = false)
+      : names_(std::move(names)), higher_is_closer_(higher_is_closer) {
+    for (size_t i = 0; i < names_.size(); ++i) {
+      indexes_.push_back(make());
+    }
+  }
+
+  size_t size() const { return indexes_.size(); }
+
+  VectorDbService &operator[](size_t modality) {
+    return *indexes_.at(modality);
+  }
+
+  std::string PathOf(const std::string &path, size_t modality) const {
+    return path + "." + names_.at(modality);
+  }
+
+  bool CreateOrLoad(const std::string &path) {
+    for (size_t i = 0; i < size(); ++i) {
+      if (!indexes_[i]->CreateOrLoad(PathOf(path, i))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Save(const std::string &path) {
+    for (size_t i = 0; i < size(); ++i) {
+      if (!indexes_[i]->Save(PathOf(path, i))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Maintenance of every index, see VectorDbService.
+  bool Sync() {
+    bool synced = true;
+    for (auto &index : indexes_) {
+      synced &= index->Sync();
+    }
+    return synced;
+  }
+
+  bool Train() {
+    bool trained = true;
+    for (auto &index : indexes_) {
+      trained &= index->Train();
+    }
+    return trained;
+  }
+
+  size_t Compact() {
+    size_t purged = 0;
+    for (auto &index : indexes_) {
+      purged += index->Compact();
+    }
+    return purged;
+  }
+
+  bool Checkpoint(bool force = false) {
+    bool written = true;
+    for (auto &index : indexes_) {
+      written &= index->Checkpoint(force);
+    }
+    return written;
+  }
+
+  // Whether any modality has a vector for `key`.
+  bool Exists(VectorKey key) {
+    return std::ranges::any_of(
+        indexes_, [&](auto &index) { return index->Exists(key); });
+  }
+
+  // Removes the vectors of `key` in every modality.
+  bool RemoveVector(VectorKey key) {
+    bool removed = false;
+    for (auto &index : indexes_) {
+      removed |= index->RemoveVector(key);
+    }
+    return removed;
+  }
+
+  // Combines the results of searching several modalities for the same
+  // thing. A key found in more than one keeps its closest score.
+  std::vector<SearchResult>
+  Merge(std::vector<std::vector<SearchResult>> results, int top_k) const {
+    auto closer = [&](float a, float b) {
+      return higher_is_closer_ ? a > b : a < b;
+    };
+    std::vector<SearchResult> merged;
+    kvdb::id_table<size_t> slots;
+    for (auto &modality_results : results) {
+      for (auto &result : modality_results) {
+        if (auto *slot = slots.find(result.key)) {
+          auto &kept = merged[*slot];
+          kept.score = closer(result.score, kept.score) ? result.score
+                                                         : kept.score;
+        } else {
+          slots.insert_or_assign(result.key, merged.size());
+          merged.push_back(result);
+        }
+      }
+    }
+    auto k = std::min(merged.size(), static_cast<size_t>(std::max(top_k, 0)));
+    std::partial_sort(merged.begin(), merged.begin() + k, merged.end(),
+                      [&](const SearchResult &a, const SearchResult &b) {
+                        return closer(a.score, b.score);
+                      });
+    merged.resize(k);
+    return merged;
+  }
+
+  // Moves the vectors of the index at `path`, written when one index held
+  // every modality, into the per-modality indexes opened by CreateOrLoad()
+  // and deletes it. `open_shared` makes the service it is read with. Does
+  // nothing when there is no such index.
+  bool Migrate(const std::string &path, const factory &open_shared,
+               const splitter &split) {
+    if (!std::filesystem::exists(path + ".meta")) {
+      return true;
+    }
+    ELOGFMT(INFO, "Splitting {} into one index per modality", path);
+    size_t moved = 0, dropped = 0;
+    {
+      auto shared = open_shared();
+      if (!shared->CreateOrLoad(path)) {
+        ELOGFMT(ERROR, "Failed to open {} for splitting", path);
+        return false;
+      }
+      shared->ForEach([&](VectorKey key, std::span<const float> vector,
+                          const VectorAttributes &attributes) {
+        auto target = split(key);
+        if (!target || target->first >= size() ||
+            !indexes_[target->first]->AddVector(
+                target->second, {vector.begin(), vector.end()}, attributes)) {
+          dropped++;
+          return;
+        }
+        moved++;
+      });
+    }
+    if (!Checkpoint(true)) {
+      return false;
+    }
+    RemoveFiles(path);
+    ELOGFMT(INFO, "Split {}: {} vectors moved, {} dropped", path, moved,
+            dropped);
+    return true;
+  }
+
+private:
+  // Removes <path> and its files, but not those of the modalities.
+  void RemoveFiles(const std::string &path) const {
+    std::filesystem::path base(path);
+    auto dir = base.has_parent_path() ? base.parent_path()
+                                      : std::filesystem::path(".");
+    auto prefix = base.filename().string() + ".";
+    std::error_code ec;
+    for (auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+      auto name = entry.path().filename().string();
+      if (!name.starts_with(prefix)) {
+        continue;
+      }
+      std::string_view rest(name);
+      rest.remove_prefix(prefix.size());
+      if (std::ranges::find(names_, rest.substr(0, rest.find('.'))) !=
+          names_.end()) {
+        continue;
+      }
+      std::filesystem::remove(entry.path(), ec);
+    }
+  }
+
+  std::vector<std::string> names_;
+  std::vector<std::unique_ptr<VectorDbService>> indexes_;
+  bool higher_is_closer_;
+};
+} // namespace tgdb
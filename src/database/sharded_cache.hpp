@@ -0,0 +1,108 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace kvdb {
+// Key-value cache split into independently locked shards, so readers of one
+// shard never wait for writers of another one.
+template <typename T, size_t ShardCount = 64> struct sharded_cache {
+  struct string_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const {
+      return std::hash<std::string_view>{}(key);
+    }
+  };
+
+  struct shard {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<std::string, T, string_hash, std::equal_to<>> map;
+  };
+
+  static size_t shard_index(std::string_view key) {
+    return string_hash{}(key) % ShardCount;
+  }
+
+  shard &shard_for(std::string_view key) { return shards[shard_index(key)]; }
+  const shard &shard_for(std::string_view key) const {
+    return shards[shard_index(key)];
+  }
+
+  std::optional<T> find(std::string_view key) const {
+    auto &s = shard_for(key);
+    std::shared_lock lock(s.mutex);
+    if (auto it = s.map.find(key); it != s.map.end()) {
+      return it->second;
+    }
+    return std::nullopt;
+  }
+
+  bool contains(std::string_view key) const {
+    auto &s = shard_for(key);
+    std::shared_lock lock(s.mutex);
+    return s.map.contains(key);
+  }
+
+  void insert_or_assign(std::string_view key, T value) {
+    auto &s = shard_for(key);
+    std::unique_lock lock(s.mutex);
+    s.map.insert_or_assign(std::string(key), std::move(value));
+  }
+
+  void erase(std::string_view key) {
+    auto &s = shard_for(key);
+    std::unique_lock lock(s.mutex);
+    if (auto it = s.map.find(key); it != s.map.end()) {
+      s.map.erase(it);
+    }
+  }
+
+  // Erases the entries for which `pred(key, value)` holds, one shard at a
+  // time.
+  template <typename F> size_t erase_if(F pred) {
+    size_t erased = 0;
+    for (auto &s : shards) {
+      std::unique_lock lock(s.mutex);
+      erased += std::erase_if(s.map, [&](const auto &entry) {
+        return pred(entry.first, entry.second);
+      });
+    }
+    return erased;
+  }
+
+  // Calls `visit(key, value)` for every entry, each shard read-locked while
+  // it is visited.
+  template <typename F> void for_each(F &&visit) const {
+    for (auto &s : shards) {
+      std::shared_lock lock(s.mutex);
+      for (const auto &[key, value] : s.map) {
+        visit(key, value);
+      }
+    }
+  }
+
+  void clear() {
+    for (auto &s : shards) {
+      std::unique_lock lock(s.mutex);
+      s.map.clear();
+    }
+  }
+
+  size_t size() const {
+    size_t total = 0;
+    for (auto &s : shards) {
+      std::shared_lock lock(s.mutex);
+      total += s.map.size();
+    }
+    return total;
+  }
+
+  std::array<shard, ShardCount> shards;
+};
+} // namespace kvdb
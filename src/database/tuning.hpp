@@ -0,0 +1,92 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "rocksdb/cache.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/options.h"
+#include "rocksdb/table.h"
+
+namespace kvdb {
+struct tuning_options {
+  size_t block_cache_bytes = 256ull << 20;
+  // 0 disables bloom filters.
+  int bloom_bits_per_key = 10;
+  // "zstd", "lz4", "snappy" or "none".
+  std::string compression = "zstd";
+  int zstd_level = 3;
+  // Per-file dictionary trained from a sample of the values being written.
+  // Short chat messages barely compress without one. 0 disables it.
+  uint32_t zstd_dict_bytes = 16u << 10;
+  uint32_t zstd_train_bytes = 100u * (16u << 10);
+  size_t write_buffer_bytes = 64ull << 20;
+  int max_write_buffer_number = 3;
+};
+
+// nullopt for names that are not listed above.
+inline std::optional<rocksdb::CompressionType>
+compression_type(const std::string &name) {
+  if (name == "zstd") {
+    return rocksdb::kZSTD;
+  } else if (name == "lz4") {
+    return rocksdb::kLZ4Compression;
+  } else if (name == "snappy") {
+    return rocksdb::kSnappyCompression;
+  } else if (name == "none") {
+    return rocksdb::kNoCompression;
+  }
+  return std::nullopt;
+}
+
+// Rejects settings apply_tuning() cannot honour, so a misspelled option
+// fails open() instead of silently storing data uncompressed.
+inline std::expected<void, std::string>
+check_tuning(const tuning_options &tuning) {
+  if (!compression_type(tuning.compression)) {
+    return std::unexpected("Unknown compression \"" + tuning.compression +
+                           "\", expected zstd, lz4, snappy or none");
+  }
+  return {};
+}
+
+// Applies the table, compression and memtable settings. `block_cache` may be
+// shared between several column families; it is created on first use.
+inline void apply_tuning(const tuning_options &tuning,
+                         rocksdb::ColumnFamilyOptions &options,
+                         std::shared_ptr<rocksdb::Cache> &block_cache) {
+  rocksdb::BlockBasedTableOptions table_options;
+  if (tuning.block_cache_bytes > 0) {
+    if (!block_cache) {
+      block_cache = rocksdb::NewLRUCache(tuning.block_cache_bytes);
+    }
+    table_options.block_cache = block_cache;
+  }
+  if (tuning.bloom_bits_per_key > 0) {
+    table_options.filter_policy.reset(
+        rocksdb::NewBloomFilterPolicy(tuning.bloom_bits_per_key, false));
+  }
+  table_options.cache_index_and_filter_blocks = true;
+  table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+  options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(table_options));
+
+  options.compression =
+      compression_type(tuning.compression).value_or(rocksdb::kNoCompression);
+  options.bottommost_compression = options.compression;
+  if (options.compression == rocksdb::kZSTD) {
+    options.compression_opts.level = tuning.zstd_level;
+    options.compression_opts.max_dict_bytes = tuning.zstd_dict_bytes;
+    options.compression_opts.zstd_max_train_bytes = tuning.zstd_train_bytes;
+    options.bottommost_compression_opts = options.compression_opts;
+    options.bottommost_compression_opts.enabled = true;
+  }
+
+  options.write_buffer_size = tuning.write_buffer_bytes;
+  options.max_write_buffer_number = tuning.max_write_buffer_number;
+  options.level_compaction_dynamic_level_bytes = true;
+}
+} // namespace kvdb
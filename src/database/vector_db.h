@@ -1,27 +1,90 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
 #include <string>
 #include <vector>
 
 namespace tgdb {
 
+// Identifies a vector within its index. The indexer uses message ids, which
+// also key message_db.
+using VectorKey = uint64_t;
+
 struct SearchResult {
-  std::string key;
+  VectorKey key;
   float score;
 };
 
+// What a vector was made from, stored next to it so searches can be
+// restricted without reading the messages.
+struct VectorAttributes {
+  int64_t chat_id = 0;
+  int64_t sender_id = 0;
+  int64_t send_time = 0;
+  // One bit per content kind of the message
+  uint32_t content_kinds = 0;
+};
+
+// Restricts a search to the vectors whose attributes match every field set.
+// It is checked while the index is searched, so a filtered search still
+// returns the top_k closest matching vectors.
+struct SearchFilter {
+  std::optional<int64_t> chat_id;
+  std::optional<int64_t> sender_id;
+  // Inclusive bounds of send_time
+  std::optional<int64_t> min_send_time;
+  std::optional<int64_t> max_send_time;
+  // Vectors with any of these content kinds, 0 for all
+  uint32_t content_kinds = 0;
+
+  bool empty() const {
+    return !chat_id && !sender_id && !min_send_time && !max_send_time &&
+           content_kinds == 0;
+  }
+
+  bool matches(const VectorAttributes &attributes) const {
+    return (!chat_id || attributes.chat_id == *chat_id) &&
+           (!sender_id || attributes.sender_id == *sender_id) &&
+           (!min_send_time || attributes.send_time >= *min_send_time) &&
+           (!max_send_time || attributes.send_time <= *max_send_time) &&
+           (content_kinds == 0 || (attributes.content_kinds & content_kinds));
+  }
+
+  bool operator==(const SearchFilter &) const = default;
+};
+
 class VectorDbService {
 public:
   virtual ~VectorDbService() = default;
 
-  virtual bool AddVector(const std::string &key,
-                         const std::vector<float> &vector) = 0;
+  virtual bool AddVector(VectorKey key,
+                         const std::vector<float> &vector,
+                         const VectorAttributes &attributes = {}) = 0;
+
+  // Adds keys[i] -> vectors[i] in one go, skipping keys that already exist.
+  // `attributes` is either empty or holds one entry per vector. Returns how
+  // many were added.
+  virtual size_t
+  AddVectors(const std::vector<VectorKey> &keys,
+             const std::vector<std::vector<float>> &vectors,
+             const std::vector<VectorAttributes> &attributes = {}) = 0;
 
   virtual std::vector<SearchResult>
-  Search(const std::vector<float> &query_vector, int top_k) = 0;
-  virtual bool RemoveVector(const std::string &key) = 0;
+  Search(const std::vector<float> &query_vector, int top_k,
+         const SearchFilter &filter = {}) = 0;
+
+  // Runs several queries as one scan of the index, result i answers query i.
+  virtual std::vector<std::vector<SearchResult>>
+  SearchBatch(const std::vector<std::vector<float>> &query_vectors, int top_k,
+              const SearchFilter &filter = {}) = 0;
+  virtual bool RemoveVector(VectorKey key) = 0;
 
-  virtual bool UpdateVector(const std::string &key,
+  // Replaces the vector of `key`, which keeps its attributes.
+  virtual bool UpdateVector(VectorKey key,
                             const std::vector<float> &vector) = 0;
 
   virtual bool Save(const std::string &path) = 0;
@@ -30,8 +93,32 @@ public:
 
   virtual bool CreateOrLoad(const std::string &path) = 0;
 
-  virtual std::vector<float> GetVector(const std::string &key) = 0;
-  virtual bool Exists(const std::string &key) = 0;
+  virtual std::vector<float> GetVector(VectorKey key) = 0;
+  virtual bool Exists(VectorKey key) = 0;
+
+  // Calls `visit` with every vector of the index, which must not be changed
+  // from within it.
+  virtual void
+  ForEach(const std::function<void(VectorKey key,
+                                   std::span<const float> vector,
+                                   const VectorAttributes &attributes)>
+              &visit) = 0;
+
+  // Purges removed vectors once they make up a noticeable part of the index,
+  // without blocking searches. Returns how many were purged.
+  virtual size_t Compact() = 0;
+
+  // Builds the configured index type once enough vectors exist to train it.
+  // Returns whether the index has its configured type.
+  virtual bool Train() = 0;
+
+  // Makes the changes made so far to the index opened by CreateOrLoad()
+  // durable, by syncing its write-ahead log.
+  virtual bool Sync() = 0;
+
+  // Rewrites the index opened by CreateOrLoad() and empties its log once
+  // enough changes accumulated, or whenever anything changed with `force`.
+  virtual bool Checkpoint(bool force = false) = 0;
 };
 
 } // namespace tgdb
\ No newline at end of file
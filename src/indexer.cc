@@ -7,9 +7,13 @@
 
 #include "ylt/easylog.hpp"
 
+#include "async_simple/coro/Collect.h"
 #include "ylt/coro_http/coro_http_client.hpp"
+#include <algorithm>
 #include <atomic>
+#include <charconv>
 #include <expected>
+#include <format>
 #include <ranges>
 #include <regex>
 #include <string_view>
@@ -47,11 +51,12 @@ Lazy<void> indexer::index_message(td::tl_object_ptr<td_api::message> message,
 
   if (!message) {
     ELOGFMT(INFO, "Indexing message {} as empty message", id);
-    ctx.message_db.put(std::to_string(id), tgdb::message{
-                                               .message_id = id,
-                                               .chat_id = chat_id,
-                                               .textifyed_contents = {},
-                                           });
+    co_await ctx.message_db.async_put(std::to_string(id),
+                                      tgdb::message{
+                                          .message_id = id,
+                                          .chat_id = chat_id,
+                                          .textifyed_contents = {},
+                                      });
     co_return;
   } else {
     ELOGFMT(INFO, "Indexing message {}", id);
@@ -64,34 +69,37 @@ Lazy<void> indexer::index_message(td::tl_object_ptr<td_api::message> message,
 
   msg.chat_id = message->chat_id_;
 
+  // Only the sender id is stored with the message, profiles live in the user
+  // directory and are refreshed by updateUser events.
   if (auto user = try_move_as<td_api::messageSenderUser>(user_id)) {
-    msg.sender.user_id = user->user_id_;
+    msg.sender_id = user->user_id_;
 
-    auto user_info =
-        co_await ctx.bot.query_async<td_api::getUser>(user->user_id_);
+    if (!ctx.users.find(user->user_id_)) {
+      auto user_info =
+          co_await ctx.bot.query_async<td_api::getUser>(user->user_id_);
 
-    if (!user_info) {
-      ELOGFMT(ERROR, "Failed to index message {}: failed to retrieve userinfo",
-              id);
-      co_return;
-    }
+      if (!user_info) {
+        ELOGFMT(ERROR,
+                "Failed to index message {}: failed to retrieve userinfo", id);
+        co_return;
+      }
 
-    if (user_info->usernames_ &&
-        user_info->usernames_->active_usernames_.size() > 0) {
-      msg.sender.str_id = user_info->usernames_->active_usernames_[0];
+      ctx.users.update(*user_info);
     }
-
-    msg.sender.nickname = user_info->first_name_ + " " + user_info->last_name_;
   } else if (auto chat = try_move_as<td_api::messageSenderChat>(user_id)) {
-    msg.sender.user_id = chat->chat_id_;
-    auto chat_info =
-        co_await ctx.bot.query_async<td_api::getChat>(chat->chat_id_);
-    if (!chat_info) {
-      ELOGFMT(ERROR, "Failed to index message {}: failed to retrieve chat info",
-              id);
-      co_return;
+    msg.sender_id = chat->chat_id_;
+
+    if (!ctx.users.find(chat->chat_id_)) {
+      auto chat_info =
+          co_await ctx.bot.query_async<td_api::getChat>(chat->chat_id_);
+      if (!chat_info) {
+        ELOGFMT(ERROR,
+                "Failed to index message {}: failed to retrieve chat info", id);
+        co_return;
+      }
+      ctx.users.update(
+          tgdb::user{.nickname = chat_info->title_, .user_id = chat->chat_id_});
     }
-    msg.sender.nickname = chat_info->title_;
   } else {
     ELOGFMT(ERROR, "Failed to index message {}: Unknown user type: {}", id,
             user_id->get_id());
@@ -100,6 +108,58 @@ Lazy<void> indexer::index_message(td::tl_object_ptr<td_api::message> message,
   auto send_time = message->date_;
   msg.send_time = send_time;
 
+  if (!co_await textify_content(std::move(message->content_), msg)) {
+    co_return;
+  }
+
+  if (message->reply_to_) {
+    if (auto replyToMsg =
+            try_get_as<td_api::messageReplyToMessage>(message->reply_to_)) {
+      msg.reply_to_message_id = replyToMsg->message_id_;
+    } else {
+      msg.reply_to_message_id = -1;
+    }
+  }
+
+  co_await commit_message(std::move(msg));
+}
+
+// What the embedding of a message is generated from.
+static Content embedding_content(const message &msg, bool aligned_image) {
+  Content content;
+  for (const auto &[kind, text] : msg.textifyed_contents.entries()) {
+    if (!text.empty()) {
+      content.text += text;
+      content.text += " ";
+    }
+  }
+
+  if (aligned_image && msg.image_file.has_value() &&
+      msg.image_file.value().has_value()) {
+    content.image_path = msg.image_file.value().value();
+  }
+  return content;
+}
+
+// What searches of the vector index can be filtered by, content_kinds has
+// bit N set for content_kind N.
+static VectorAttributes vector_attributes(const message &msg) {
+  VectorAttributes attributes{.chat_id = msg.chat_id,
+                              .sender_id = msg.sender_id,
+                              .send_time = msg.send_time};
+  for (const auto &[kind, text] : msg.textifyed_contents.entries()) {
+    attributes.content_kinds |= 1u << static_cast<uint32_t>(kind);
+  }
+  if (msg.image_file.has_value() && msg.image_file.value().has_value()) {
+    attributes.content_kinds |=
+        1u << static_cast<uint32_t>(content_kind::image);
+  }
+  return attributes;
+}
+
+Lazy<bool>
+indexer::textify_content(td::tl_object_ptr<td_api::MessageContent> content,
+                         message &msg) {
   auto download_file =
       [&](auto &file) -> Lazy<std::expected<std::string, std::string>> {
     if (file->local_ && file->local_->is_downloading_completed_) {
@@ -116,18 +176,19 @@ Lazy<void> indexer::index_message(td::tl_object_ptr<td_api::message> message,
         co_return std::filesystem::path(downloaded->local_->path_).string();
       } else {
         ELOGFMT(ERROR, "Failed to download file {}, message {} skipped",
-                file->remote_->id_, id);
+                file->remote_->id_, msg.message_id);
         co_return std::unexpected<std::string>("Failed to download file");
       }
     } else {
-      ELOGFMT(ERROR, "Failed to index message {}: Unknown file", id);
+      ELOGFMT(ERROR, "Failed to index message {}: Unknown file",
+              msg.message_id);
       co_return std::unexpected<std::string>("Unknown file type");
     }
   };
 
   auto process_image = [&](std::string file) -> Lazy<void> {
     if (file.empty() || file.ends_with(".webm")) {
-      msg.textifyed_contents["image"] = "";
+      msg.textifyed_contents.set(content_kind::image, "");
       co_return;
     }
 
@@ -136,7 +197,7 @@ Lazy<void> indexer::index_message(td::tl_object_ptr<td_api::message> message,
       ELOGFMT(INFO, "Performing OCR on file {}", file);
       if (auto ocr_res = co_await ocr_client_->ocr(file)) {
         ELOGFMT(INFO, "OCR result: {}", ocr_res.value());
-        msg.textifyed_contents["image"] = ocr_res.value();
+        msg.textifyed_contents.set(content_kind::image, ocr_res.value());
       } else {
         ELOGFMT(ERROR, "Failed to perform OCR on file {}: {}", file,
                 ocr_res.error());
@@ -172,148 +233,373 @@ Lazy<void> indexer::index_message(td::tl_object_ptr<td_api::message> message,
       td_api::messageDice::ID,
   };
 
-  if (auto text = try_move_as<td_api::messageText>(message->content_)) {
-    msg.textifyed_contents["text"] = text->text_->text_;
+  if (auto text = try_move_as<td_api::messageText>(content)) {
+    msg.textifyed_contents.set(content_kind::text, text->text_->text_);
   } else if (auto photo =
-                 try_move_as<td_api::messagePhoto>(message->content_)) {
+                 try_move_as<td_api::messagePhoto>(content)) {
     if (photo->caption_)
-      msg.textifyed_contents["text"] = photo->caption_->text_;
+      msg.textifyed_contents.set(content_kind::text,
+                                 photo->caption_->text_);
 
     if (auto image =
             co_await download_file(photo->photo_->sizes_.back()->photo_))
       co_await process_image(image.value());
   } else if (auto video =
-                 try_move_as<td_api::messageVideo>(message->content_)) {
+                 try_move_as<td_api::messageVideo>(content)) {
 
   } else if (auto sticker =
-                 try_move_as<td_api::messageSticker>(message->content_)) {
+                 try_move_as<td_api::messageSticker>(content)) {
     if (auto sticker_file =
             co_await download_file(sticker->sticker_->sticker_)) {
       co_await process_image(sticker_file.value());
     }
   } else if (auto document =
-                 try_move_as<td_api::messageDocument>(message->content_)) {
+                 try_move_as<td_api::messageDocument>(content)) {
     if (document->caption_)
-      msg.textifyed_contents["text"] = document->caption_->text_;
+      msg.textifyed_contents.set(content_kind::text,
+                                 document->caption_->text_);
 
-    msg.textifyed_contents["document"] = document->document_->file_name_;
+    msg.textifyed_contents.set(content_kind::document,
+                               document->document_->file_name_);
   } else if (auto audio =
-                 try_move_as<td_api::messageAudio>(message->content_)) {
+                 try_move_as<td_api::messageAudio>(content)) {
     if (audio->caption_)
-      msg.textifyed_contents["text"] = audio->caption_->text_;
+      msg.textifyed_contents.set(content_kind::text,
+                                 audio->caption_->text_);
 
-    msg.textifyed_contents["audio"] =
+    msg.textifyed_contents.set(
+        content_kind::audio,
         std::format("MIME type: {}, duration: {}s, file name: {}",
                     audio->audio_->mime_type_, audio->audio_->duration_ / 1000,
-                    audio->audio_->file_name_);
+                    audio->audio_->file_name_));
   } else if (auto voice =
-                 try_move_as<td_api::messageVoiceNote>(message->content_)) {
+                 try_move_as<td_api::messageVoiceNote>(content)) {
     if (voice->caption_)
-      msg.textifyed_contents["text"] = voice->caption_->text_;
-    msg.textifyed_contents["voice"] = std::format(
-        "MIME type: {}, duration: {}s", voice->voice_note_->mime_type_,
-        voice->voice_note_->duration_ / 1000);
+      msg.textifyed_contents.set(content_kind::text,
+                                 voice->caption_->text_);
+    msg.textifyed_contents.set(
+        content_kind::voice,
+        std::format("MIME type: {}, duration: {}s",
+                    voice->voice_note_->mime_type_,
+                    voice->voice_note_->duration_ / 1000));
   } else if (auto video_note =
-                 try_move_as<td_api::messageVideoNote>(message->content_)) {
+                 try_move_as<td_api::messageVideoNote>(content)) {
     if (video_note->video_note_->video_) {
-      msg.textifyed_contents["video_note"] = std::format(
-          "Duration: {}s", video_note->video_note_->duration_ / 1000);
+      msg.textifyed_contents.set(
+          content_kind::video_note,
+          std::format("Duration: {}s",
+                      video_note->video_note_->duration_ / 1000));
     }
   } else if (auto location =
-                 try_move_as<td_api::messageLocation>(message->content_)) {
-    msg.textifyed_contents["location"] = std::format(
-        "Latitude: {}, Longitude: {}", location->location_->latitude_,
-        location->location_->longitude_);
+                 try_move_as<td_api::messageLocation>(content)) {
+    msg.textifyed_contents.set(
+        content_kind::location,
+        std::format("Latitude: {}, Longitude: {}",
+                    location->location_->latitude_,
+                    location->location_->longitude_));
   } else if (auto contact =
-                 try_move_as<td_api::messageContact>(message->content_)) {
-    msg.textifyed_contents["contact"] =
+                 try_move_as<td_api::messageContact>(content)) {
+    msg.textifyed_contents.set(
+        content_kind::contact,
         std::format("Name: {}, Phone: {}", contact->contact_->first_name_,
-                    contact->contact_->phone_number_);
+                    contact->contact_->phone_number_));
   } else if (auto venue =
-                 try_move_as<td_api::messageVenue>(message->content_)) {
-    msg.textifyed_contents["venue"] =
+                 try_move_as<td_api::messageVenue>(content)) {
+    msg.textifyed_contents.set(
+        content_kind::venue,
         std::format("Title: {}, Address: {}", venue->venue_->title_,
-                    venue->venue_->address_);
+                    venue->venue_->address_));
   } else if (std::ranges::contains(contentTypesFunctionalMessages,
-                                   message->content_->get_id())) {
-    auto str = to_string(message->content_);
-    msg.textifyed_contents["functional_message"] = str.substr(0, str.find(' '));
+                                   content->get_id())) {
+    auto str = to_string(content);
+    msg.textifyed_contents.set(content_kind::functional_message,
+                               str.substr(0, str.find(' ')));
   } else {
-    ELOGFMT(ERROR, "Failed to index message {}: Unknown content type: {}", id,
-            message->content_->get_id());
+    ELOGFMT(ERROR, "Failed to index message {}: Unknown content type: {}",
+            msg.message_id, content->get_id());
+    co_return false;
+  }
+  co_return true;
+}
+
+
+uint64_t indexer::begin_embedding() {
+  std::lock_guard lock(embeddings_mutex_);
+  auto ticket = next_embedding_++;
+  pending_embeddings_.insert(ticket);
+  return ticket;
+}
+
+void indexer::end_embedding(uint64_t ticket) {
+  {
+    std::lock_guard lock(embeddings_mutex_);
+    pending_embeddings_.erase(ticket);
+  }
+  embeddings_done_.notify_all();
+}
+
+bool indexer::wait_for_embeddings(std::chrono::steady_clock::duration timeout) {
+  std::unique_lock lock(embeddings_mutex_);
+  auto last = next_embedding_;
+  return embeddings_done_.wait_for(lock, timeout, [&] {
+    return pending_embeddings_.empty() || *pending_embeddings_.begin() >= last;
+  });
+}
+
+Lazy<void> indexer::commit_message(message msg) {
+  auto id = msg.message_id;
+  const std::string key = std::to_string(id);
+  auto previous = co_await ctx.message_db.async_get(key);
+
+  // Taken before the message is stored, so a backup of message_db can wait
+  // for the vectors of everything in it, see wait_for_embeddings()
+  struct pending_embedding {
+    indexer &self;
+    uint64_t ticket;
+    ~pending_embedding() { self.end_embedding(ticket); }
+  } pending{*this, begin_embedding()};
+
+  ELOGFMT(INFO, "msg indexed: {}", msg.to_string());
+  co_await ctx.message_db.async_put(key, msg);
+  co_await mark_chat_indexed(msg.chat_id);
+
+  if (!ctx.embedding_service_ || !ctx.vector_db_service_) {
     co_return;
   }
 
-  if (message->reply_to_) {
-    if (auto replyToMsg =
-            try_get_as<td_api::messageReplyToMessage>(message->reply_to_)) {
-      msg.reply_to_message_id = replyToMsg->message_id_;
-    } else {
-      msg.reply_to_message_id = -1;
+  auto aligned_image = ctx.embedding_service_->support_aligned_image();
+  auto content = embedding_content(msg, aligned_image);
+  if (previous) {
+    // Edits that only touch fields outside the embedded content, e.g. a
+    // reply or sender change, keep their vectors. A vector lost earlier, e.g.
+    // to a failed embedding, is made again.
+    auto previous_content = embedding_content(*previous, aligned_image);
+    auto has_vector = [&](EmbeddingType type) {
+      return (*ctx.vector_db_service_)[static_cast<size_t>(type)].Exists(
+          static_cast<VectorKey>(id));
+    };
+    if (previous_content.text == content.text &&
+        previous_content.image_path == content.image_path &&
+        (content.text.empty() || has_vector(EmbeddingType::Text)) &&
+        (content.image_path.empty() || has_vector(EmbeddingType::Image))) {
+      ELOGFMT(INFO, "Embedded content of message {} unchanged", id);
+      co_return;
     }
+    remove_vectors(id);
   }
 
-  ELOGFMT(INFO, "map1: {}", msg.textifyed_contents.empty());
-  ELOGFMT(INFO, "msg indexed: {}", msg.to_string());
-  ctx.message_db.put(std::to_string(id), msg);
+  if (content.empty()) {
+    ELOGFMT(INFO, "No content available for embedding in message {}", id);
+    co_return;
+  }
 
-  if (ctx.embedding_service_ && ctx.vector_db_service_) {
-    ELOGFMT(INFO, "Generating embeddings for message {}", id);
+  ELOGFMT(INFO, "Generating embeddings for message {}", id);
+  try {
+    auto embedding = co_await ctx.embedding_service_->multimodal_embedding(
+        std::move(content));
 
-    Content content;
+    if (embedding && !embedding->empty()) {
+      ELOGFMT(INFO, "Generated embedding for message {}", id);
 
-    std::string combined_text;
-    for (const auto &[type, text] : msg.textifyed_contents) {
-      if (!text.empty()) {
-        combined_text += text + " ";
+      // Each embedding goes to the index of its type, under the message id
+      auto attributes = vector_attributes(msg);
+      size_t added = 0;
+      for (auto &[type, vec] : embedding.value()) {
+        added += (*ctx.vector_db_service_)[static_cast<size_t>(type)].AddVector(
+            static_cast<VectorKey>(id), vec, attributes);
+      }
+      if (added == embedding->size()) {
+        ELOGFMT(INFO,
+                "Added {} vector embeddings for message {} to vector database",
+                added, id);
+      } else {
+        ELOGFMT(ERROR,
+                "Added only {} of {} vector embeddings for message {} to "
+                "vector database",
+                added, embedding->size(), id);
       }
+    } else {
+      ELOGFMT(WARNING, "No embeddings generated for message {}", id);
     }
+  } catch (const std::exception &e) {
+    ELOGFMT(ERROR, "Error generating embeddings for message {}: {}", id,
+            e.what());
+  }
+}
 
-    if (!combined_text.empty()) {
-      content.text = combined_text;
+void indexer::remove_vectors(int64_t message_id,
+                             std::initializer_list<EmbeddingType> types) {
+  if (!ctx.vector_db_service_) {
+    return;
+  }
+  for (auto type : types) {
+    (*ctx.vector_db_service_)[static_cast<size_t>(type)].RemoveVector(
+        static_cast<VectorKey>(message_id));
+  }
+}
+
+Lazy<void> indexer::update_message_content(
+    int64_t chat_id, int64_t message_id,
+    td::tl_object_ptr<td_api::MessageContent> content) {
+  auto stored = co_await ctx.message_db.async_get(std::to_string(message_id));
+  if (!stored) {
+    // Never indexed, e.g. sent while the bot was offline
+    co_await fetch_and_index(chat_id, message_id);
+    co_return;
+  }
+  if (stored->chat_id != chat_id) {
+    // Message ids are only unique within a chat, the stored message is
+    // another one
+    co_return;
+  }
+
+  auto msg = std::move(*stored);
+  msg.textifyed_contents = {};
+  msg.image_file = std::nullopt;
+  if (!co_await textify_content(std::move(content), msg)) {
+    co_return;
+  }
+  ELOGFMT(INFO, "Message {} in chat {} edited", message_id, chat_id);
+  co_await commit_message(std::move(msg));
+}
+
+Lazy<void> indexer::remove_messages(int64_t chat_id,
+                                    std::vector<int64_t> message_ids) {
+  for (auto message_id : message_ids) {
+    auto key = std::to_string(message_id);
+    // Message ids are only unique within a chat, the stored message may be
+    // another chat's
+    auto meta = co_await ctx.message_db.offload(
+        [&] { return ctx.message_db.get_part<message_meta>(key); });
+    if (!meta || meta->chat_id != chat_id) {
+      continue;
     }
+    if (auto res = co_await ctx.message_db.async_remove(key); !res) {
+      ELOGFMT(ERROR, "Failed to remove message {}: {}", message_id,
+              res.error());
+      continue;
+    }
+    remove_vectors(message_id);
+    ELOGFMT(INFO, "Message {} in chat {} deleted", message_id, chat_id);
+  }
+}
 
-    if (msg.image_file.has_value() && msg.image_file.value().has_value()) {
+Lazy<void> indexer::index_missing_message(int64_t chat_id,
+                                          int64_t message_id) {
+  if (co_await ctx.message_db.async_has(std::to_string(message_id))) {
+    co_return;
+  }
+  co_await fetch_and_index(chat_id, message_id);
+}
 
-      if (ctx.embedding_service_->support_aligned_image()) {
-        content.image_path = msg.image_file.value().value();
-      }
+Lazy<void> indexer::fetch_and_index(int64_t chat_id, int64_t message_id) {
+  if (!co_await chat_indexed(chat_id)) {
+    co_return;
+  }
+  auto message =
+      co_await ctx.bot.query_async<td_api::getMessage>(chat_id, message_id);
+  if (message) {
+    co_await index_message(std::move(message));
+  }
+}
+
+static std::string indexed_chat_name(int64_t chat_id) {
+  return std::format("indexed_chat/{}", chat_id);
+}
+
+Lazy<bool> indexer::chat_indexed(int64_t chat_id) {
+  {
+    std::shared_lock lock(indexed_chats_mutex_);
+    if (indexed_chats_.contains(chat_id)) {
+      co_return true;
     }
+  }
+  auto name = indexed_chat_name(chat_id);
+  auto indexed = co_await ctx.message_db.offload(
+      [&] { return ctx.message_db.get_meta(name).has_value(); });
+  if (indexed) {
+    std::unique_lock lock(indexed_chats_mutex_);
+    indexed_chats_.insert(chat_id);
+  }
+  co_return indexed;
+}
 
-    if (!content.empty()) {
-      try {
-        auto embedding = co_await ctx.embedding_service_->multimodal_embedding(
-            std::move(content));
-
-        if (embedding && !embedding->empty()) {
-          ELOGFMT(INFO, "Generated embedding for message {}", id);
-
-          const std::string key = std::to_string(id);
-
-          for (const auto &[type, vec] : embedding.value())
-            if (ctx.vector_db_service_->AddVector(
-                    key + std::format(":type-{}", (int)type), vec)) {
-              ELOGFMT(
-                  INFO,
-                  "Added vector embedding for message {} to vector database",
-                  id);
-            } else {
-              ELOGFMT(ERROR,
-                      "Failed to add vector embedding for message {} to vector "
-                      "database",
-                      id);
-            }
-        } else {
-          ELOGFMT(WARNING, "No embeddings generated for message {}", id);
-        }
-      } catch (const std::exception &e) {
-        ELOGFMT(ERROR, "Error generating embeddings for message {}: {}", id,
-                e.what());
+Lazy<void> indexer::mark_chat_indexed(int64_t chat_id) {
+  {
+    std::shared_lock lock(indexed_chats_mutex_);
+    if (indexed_chats_.contains(chat_id)) {
+      co_return;
+    }
+  }
+  auto name = indexed_chat_name(chat_id);
+  if (!co_await ctx.message_db.offload(
+          [&] { return ctx.message_db.put_meta(name, ""); })) {
+    ELOGFMT(ERROR, "Failed to record chat {} as indexed", chat_id);
+    co_return;
+  }
+  std::unique_lock lock(indexed_chats_mutex_);
+  indexed_chats_.insert(chat_id);
+}
+
+keyword_page indexer::keyword_search(std::string_view query,
+                                     std::string_view offset, size_t limit,
+                                     size_t max_scanned) {
+  auto contains_query = [&](const message &msg) {
+    return std::ranges::any_of(
+        msg.textifyed_contents.entries(),
+        [&](const auto &field) { return field.value.contains(query); });
+  };
+
+  // Offsets are an index into the matches in memory, or "c" followed by the
+  // last key read from disk.
+  keyword_page page;
+  if (!offset.starts_with('c')) {
+    size_t skip = 0;
+    std::from_chars(offset.data(), offset.data() + offset.size(), skip);
+
+    std::vector<std::pair<int64_t, std::string>> matches;
+    ctx.message_db.for_each_cached([&](const std::string &key,
+                                       const message &msg) {
+      if (contains_query(msg)) {
+        matches.emplace_back(msg.send_time, key);
       }
-    } else {
-      ELOGFMT(INFO, "No content available for embedding in message {}", id);
+    });
+    std::ranges::sort(matches, std::greater{});
+
+    skip = std::min(skip, matches.size());
+    auto end = std::min(skip + limit, matches.size());
+    for (auto i = skip; i < end; ++i) {
+      page.keys.push_back(std::move(matches[i].second));
+    }
+    if (end < matches.size()) {
+      page.next_offset = std::to_string(end);
+      return page;
+    }
+    // Without a hot predicate every message is cached already
+    if (!ctx.message_db.hot) {
+      return page;
     }
+    offset = "c";
   }
+
+  kvdb::scan_options options;
+  if (offset.size() > 1) {
+    options.lower_bound = std::string(offset.substr(1)) + '\0';
+  }
+  std::string last_key;
+  size_t scanned = 0;
+  for (const auto &[key, msg] : ctx.message_db.scan(std::move(options))) {
+    if (page.keys.size() == limit || scanned == max_scanned) {
+      page.next_offset = "c" + last_key;
+      break;
+    }
+    scanned++;
+    last_key = key;
+    if (!ctx.message_db.cache->contains(key) && contains_query(msg)) {
+      page.keys.push_back(key);
+    }
+  }
+  return page;
 }
 
 Lazy<void> indexer::index_message_batch(
@@ -339,7 +625,7 @@ async_simple::coro::Lazy<void> indexer::index_messages_in_chat(
       if (current % 1000 == 0) {
         ELOGFMT(INFO, "ids for chat {}: {}", chat_id, current);
       }
-      if (ctx.message_db.has(std::to_string(current << 20))) {
+      if (co_await ctx.message_db.async_has(std::to_string(current << 20))) {
         current++;
         continue;
       } else {
@@ -413,7 +699,8 @@ async_simple::coro::Lazy<void> indexer::index_messages_in_chat(
 }
 
 async_simple::coro::Lazy<std::vector<VectorSearchResult>>
-indexer::vector_search(const std::string &query_text, int top_k) {
+indexer::vector_search(const std::string &query_text, int top_k,
+                       SearchFilter filter) {
   if (!ctx.embedding_service_ || !ctx.vector_db_service_) {
     ELOGFMT(ERROR, "Vector search failed: embedding service or vector database "
                    "not available");
@@ -434,8 +721,10 @@ indexer::vector_search(const std::string &query_text, int top_k) {
       co_return std::vector<VectorSearchResult>{};
     }
 
-    auto search_results = ctx.vector_db_service_->Search(
-        embedding.value()[EmbeddingType::Text], top_k);
+    search_query query{EmbeddingType::Text,
+                       std::move(embedding.value()[EmbeddingType::Text]),
+                       top_k, std::move(filter)};
+    auto search_results = co_await search_pool.add_task(std::move(query));
     ELOGFMT(INFO, "Vector search found {} results", search_results.size());
 
     co_return co_await process_search_results(search_results);
@@ -446,7 +735,8 @@ indexer::vector_search(const std::string &query_text, int top_k) {
 }
 
 async_simple::coro::Lazy<std::vector<VectorSearchResult>>
-indexer::vector_search_image(const std::string &image_path, int top_k) {
+indexer::vector_search_image(const std::string &image_path, int top_k,
+                             SearchFilter filter) {
   if (!ctx.embedding_service_ || !ctx.vector_db_service_) {
     ELOGFMT(ERROR, "Vector search failed: embedding service or vector database "
                    "not available");
@@ -474,8 +764,10 @@ indexer::vector_search_image(const std::string &image_path, int top_k) {
       co_return std::vector<VectorSearchResult>{};
     }
 
-    auto search_results = ctx.vector_db_service_->Search(
-        embedding.value()[EmbeddingType::Image], top_k);
+    search_query query{EmbeddingType::Image,
+                       std::move(embedding.value()[EmbeddingType::Image]),
+                       top_k, std::move(filter)};
+    auto search_results = co_await search_pool.add_task(std::move(query));
     ELOGFMT(INFO, "Vector search found {} results", search_results.size());
 
     co_return co_await process_search_results(search_results);
@@ -487,7 +779,8 @@ indexer::vector_search_image(const std::string &image_path, int top_k) {
 
 async_simple::coro::Lazy<std::vector<VectorSearchResult>>
 indexer::vector_search_multimodal(const std::string &query_text,
-                                  const std::string &image_path, int top_k) {
+                                  const std::string &image_path, int top_k,
+                                  SearchFilter filter) {
   if (!ctx.embedding_service_ || !ctx.vector_db_service_) {
     ELOGFMT(ERROR, "Vector search failed: embedding service or vector database "
                    "not available");
@@ -516,8 +809,20 @@ indexer::vector_search_multimodal(const std::string &query_text,
       co_return std::vector<VectorSearchResult>{};
     }
 
-    auto search_results = ctx.vector_db_service_->Search(
-        embedding.value()[EmbeddingType::Text], top_k);
+    // Text and image are each matched against their own index, a message
+    // found by both is returned once
+    search_query text_query{EmbeddingType::Text,
+                            std::move(embedding.value()[EmbeddingType::Text]),
+                            top_k, filter};
+    search_query image_query{EmbeddingType::Image,
+                             std::move(embedding.value()[EmbeddingType::Image]),
+                             top_k, std::move(filter)};
+    auto [text_results, image_results] = co_await async_simple::coro::collectAll(
+        search_pool.add_task(std::move(text_query)),
+        search_pool.add_task(std::move(image_query)));
+    auto search_results = ctx.vector_db_service_->Merge(
+        {std::move(text_results.value()), std::move(image_results.value())},
+        top_k);
     ELOGFMT(INFO, "Vector search found {} results", search_results.size());
 
     co_return co_await process_search_results(search_results);
@@ -527,24 +832,64 @@ indexer::vector_search_multimodal(const std::string &query_text,
   }
 }
 
+// Queries of the same modality with the same filter are searched together.
+Lazy<std::vector<std::vector<SearchResult>>>
+indexer::search_batch(std::vector<search_query> queries) {
+  ELOGFMT(DEBUG, "Running {} vector searches as one batch", queries.size());
+  std::vector<std::vector<SearchResult>> results(queries.size());
+  std::vector<bool> done(queries.size());
+  for (size_t first = 0; first < queries.size(); ++first) {
+    if (done[first]) {
+      continue;
+    }
+    int top_k = 0;
+    std::vector<size_t> group;
+    std::vector<std::vector<float>> vectors;
+    for (size_t i = first; i < queries.size(); ++i) {
+      if (!done[i] && queries[i].type == queries[first].type &&
+          queries[i].filter == queries[first].filter) {
+        done[i] = true;
+        top_k = std::max(top_k, queries[i].top_k);
+        group.push_back(i);
+        vectors.push_back(std::move(queries[i].vector));
+      }
+    }
+    auto &index =
+        (*ctx.vector_db_service_)[static_cast<size_t>(queries[first].type)];
+    auto found = index.SearchBatch(vectors, top_k, queries[first].filter);
+    for (size_t j = 0; j < group.size(); ++j) {
+      auto &query_results = results[group[j]];
+      query_results = std::move(found[j]);
+      auto limit = static_cast<size_t>(std::max(queries[group[j]].top_k, 0));
+      if (query_results.size() > limit) {
+        query_results.resize(limit);
+      }
+    }
+  }
+  co_return results;
+}
+
 async_simple::coro::Lazy<std::vector<VectorSearchResult>>
 indexer::process_search_results(const std::vector<SearchResult> &results) {
   std::vector<VectorSearchResult> processed_results;
 
+  std::vector<std::string> message_ids;
+  message_ids.reserve(results.size());
   for (const auto &result : results) {
+    message_ids.push_back(std::to_string(result.key));
+  }
 
-    std::string message_id_str = result.key.substr(0, result.key.find(':'));
-
-    auto msg_opt = ctx.message_db.get(message_id_str);
-    if (!msg_opt) {
+  auto messages = co_await ctx.message_db.async_get_many(message_ids);
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (!messages[i]) {
       ELOGFMT(WARNING,
               "Message {} found in vector database but not in message database",
-              message_id_str);
+              message_ids[i]);
       continue;
     }
 
-    processed_results.push_back(
-        VectorSearchResult{.msg = msg_opt.value(), .score = result.score});
+    processed_results.push_back(VectorSearchResult{
+        .msg = std::move(messages[i].value()), .score = results[i].score});
   }
 
   ELOGFMT(INFO, "Processed {} search results", processed_results.size());
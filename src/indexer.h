@@ -5,10 +5,21 @@
 #include "td/tl/TlObject.h"
 #include "ocr.h"
 #include "database/vector_db.h"
+#include "embedding/embedding_service.h"
+#include "utils.h"
 
 #include "ylt/coro_http/coro_http_client.hpp"
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <initializer_list>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
 #include <vector>
 
 namespace tgdb {
@@ -20,6 +31,12 @@ struct VectorSearchResult {
   float score;
 };
 
+struct keyword_page {
+  std::vector<std::string> keys;
+  // Passed back to keyword_search() for the next page, empty after the last.
+  std::string next_offset;
+};
+
 struct indexer {
   context &ctx;
   std::unique_ptr<IOcrClient> ocr_client_;
@@ -37,18 +54,102 @@ struct indexer {
   async_simple::coro::Lazy<void>
   index_messages_in_chat(int64_t chat_id, int64_t until_id,
                          std::function<void(int, int64_t)> progress_callback);
+
+  // Applies an edit to an indexed message. Its embedding is only regenerated
+  // when the embedded text or image changed.
+  async_simple::coro::Lazy<void>
+  update_message_content(int64_t chat_id, int64_t message_id,
+                         td::tl_object_ptr<td_api::MessageContent> content);
+
+  // Drops deleted messages from message_db and the vector index.
+  async_simple::coro::Lazy<void> remove_messages(int64_t chat_id,
+                                                std::vector<int64_t> message_ids);
+
+  // Fetches and indexes a message missing from message_db, e.g. one sent
+  // while the bot was offline, if its chat is indexed.
+  async_simple::coro::Lazy<void> index_missing_message(int64_t chat_id,
+                                                      int64_t message_id);
+
+  // Whether messages of a chat were ever stored. Recorded in message_db
+  // metadata, so updates about chats the bot never indexed are ignored.
+  async_simple::coro::Lazy<bool> chat_indexed(int64_t chat_id);
+  async_simple::coro::Lazy<void> mark_chat_indexed(int64_t chat_id);
+
+  // Drops the vectors of a message, by default all of them.
+  void remove_vectors(int64_t message_id,
+                      std::initializer_list<EmbeddingType> types = {
+                          EmbeddingType::Text, EmbeddingType::Image});
+
+  // Blocks until every message stored before the call has its vectors in
+  // the index, or failed to get them. False if `timeout` passed first.
+  bool wait_for_embeddings(std::chrono::steady_clock::duration timeout);
                          
-  // Vector search methods
+  // Up to `limit` keys of the messages containing `query`, starting at
+  // `offset`. Messages in memory come first, newest first, then the older
+  // ones on disk in key order. A page reads at most `max_scanned` of those,
+  // so a rare query takes several pages to reach the oldest messages.
+  keyword_page keyword_search(std::string_view query, std::string_view offset,
+                              size_t limit, size_t max_scanned);
+
+  // Vector search methods, `filter` restricts them to e.g. one chat or a
+  // time range
   async_simple::coro::Lazy<std::vector<VectorSearchResult>>
-  vector_search(const std::string& query_text, int top_k = 10);
+  vector_search(const std::string& query_text, int top_k = 10,
+                SearchFilter filter = {});
   
   async_simple::coro::Lazy<std::vector<VectorSearchResult>>
-  vector_search_image(const std::string& image_path, int top_k = 10);
+  vector_search_image(const std::string& image_path, int top_k = 10,
+                      SearchFilter filter = {});
   
   async_simple::coro::Lazy<std::vector<VectorSearchResult>>
-  vector_search_multimodal(const std::string& query_text, const std::string& image_path, int top_k = 10);
+  vector_search_multimodal(const std::string& query_text, const std::string& image_path, int top_k = 10,
+                           SearchFilter filter = {});
 
 private:
+  struct search_query {
+    // Index of the modality searched
+    EmbeddingType type;
+    std::vector<float> vector;
+    int top_k;
+    SearchFilter filter;
+  };
+
+  // Searches that arrive within a few milliseconds of each other, e.g. from
+  // inline queries, are answered by a single scan of each vector index.
+  task_batch_debounce_pool<search_query, std::vector<SearchResult>>
+      search_pool{std::chrono::milliseconds(5),
+                  [this](std::vector<search_query> queries) {
+                    return search_batch(std::move(queries));
+                  }};
+
+  async_simple::coro::Lazy<std::vector<std::vector<SearchResult>>>
+  search_batch(std::vector<search_query> queries);
+
+  // Fills textifyed_contents and image_file from a message content, false
+  // for unsupported content types.
+  async_simple::coro::Lazy<bool>
+  textify_content(td::tl_object_ptr<td_api::MessageContent> content,
+                  message &msg);
+
+  // Stores a message and keeps its vectors in sync with its content.
+  async_simple::coro::Lazy<void> commit_message(message msg);
+
+  async_simple::coro::Lazy<void> fetch_and_index(int64_t chat_id,
+                                                int64_t message_id);
+
+  // Chats known to be indexed, see chat_indexed()
+  std::shared_mutex indexed_chats_mutex_;
+  std::unordered_set<int64_t> indexed_chats_;
+
+  // Messages stored whose embeddings are still being generated, numbered in
+  // the order they were stored in.
+  std::mutex embeddings_mutex_;
+  std::condition_variable embeddings_done_;
+  uint64_t next_embedding_ = 0;
+  std::set<uint64_t> pending_embeddings_;
+  uint64_t begin_embedding();
+  void end_embedding(uint64_t ticket);
+
   async_simple::coro::Lazy<void>
   index_message_batch(td::tl_object_ptr<td_api::message> message, int64_t id,
                       int64_t chat_id, std::atomic_int64_t &completed_count,
@@ -0,0 +1,135 @@
+#include "migrations.h"
+#include "context.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "async_simple/coro/Sleep.h"
+
+namespace tgdb {
+namespace {
+// Spaces out the Telegram lookups of a step, however fast records are
+// scanned.
+struct fetch_pacer {
+  std::mutex mutex;
+  std::chrono::steady_clock::time_point next = {};
+
+  async_simple::coro::Lazy<void> wait(size_t rate) {
+    if (rate == 0) {
+      co_return;
+    }
+    std::chrono::steady_clock::duration delay;
+    {
+      std::lock_guard lock(mutex);
+      auto now = std::chrono::steady_clock::now();
+      next = std::max(next, now);
+      delay = next - now;
+      next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / rate));
+    }
+    if (delay > std::chrono::steady_clock::duration::zero()) {
+      co_await async_simple::coro::sleep(delay);
+    }
+  }
+};
+} // namespace
+
+// Looks up the local file of an image message, nullopt if it has none.
+static async_simple::coro::Lazy<std::optional<std::string>>
+fetch_image_file(context &ctx, int64_t chat_id, int64_t message_id) {
+  auto fetched_message =
+      co_await ctx.bot.query_async<td_api::getMessage>(chat_id, message_id);
+  if (!fetched_message) {
+    ELOGFMT(ERROR, "Failed to fetch message {} in chat {}", message_id,
+            chat_id);
+    co_return std::nullopt;
+  }
+  if (auto msg_content =
+          try_get_as<td_api::messagePhoto>(fetched_message->content_)) {
+    if (msg_content->photo_ && msg_content->photo_->sizes_.size() > 0) {
+      auto &largest_size = msg_content->photo_->sizes_.back();
+      if (largest_size->photo_ && largest_size->photo_->local_.get()) {
+        co_return largest_size->photo_->local_->path_;
+      }
+    }
+  } else if (auto msg_content = try_get_as<td_api::messageSticker>(
+                 fetched_message->content_)) {
+    if (msg_content->sticker_ &&
+        msg_content->sticker_->sticker_->local_.get()) {
+      co_return msg_content->sticker_->sticker_->local_->path_;
+    }
+  } else {
+    co_return std::nullopt;
+  }
+
+  ELOGFMT(WARNING,
+          "Message {} in chat {} has a image but do not have local file",
+          message_id, chat_id);
+  co_return std::nullopt;
+}
+
+void register_message_migrations(context &ctx,
+                                 kvdb::migrations<message> &migrations) {
+  // Rewrites every record in the current layout: packed textified contents
+  // and one column family per part. Old records are decoded on read until
+  // this step reaches them. Their sender profile is not part of the new
+  // layout, it goes to the user directory unless that knows the sender.
+  migrations.add(
+      1, "repack messages into column families",
+      [&ctx](const std::string &key, const message &msg)
+          -> async_simple::coro::Lazy<std::optional<message>> {
+        if (!ctx.users.find(msg.sender_id)) {
+          auto raw = co_await ctx.message_db.offload(
+              [&] { return ctx.message_db.get_raw(key); });
+          if (raw) {
+            if (auto old = struct_pack::deserialize<legacy::message_v0>(*raw);
+                old && old->sender.user_id == msg.sender_id) {
+              ctx.users.update(std::move(old->sender));
+            }
+          }
+        }
+        co_return msg;
+      });
+
+  // Fills in image_file for messages indexed before it was recorded. Only
+  // the media family is scanned. Images of that time only left their OCR
+  // text, so only records that have one are fetched from Telegram.
+  migrations.add<message_media>(
+      2, "backfill image files",
+      [&ctx, pacer = std::make_shared<fetch_pacer>()](
+          const std::string &key, const message_media &media)
+          -> async_simple::coro::Lazy<std::optional<message_media>> {
+        if (media.image_file && !media.image_file->empty()) {
+          co_return std::nullopt;
+        }
+        if (!media.ocr_text) {
+          co_return std::nullopt;
+        }
+        co_await pacer->wait(ctx.cfg.migration_config.max_fetch_rate);
+        auto image_file =
+            co_await fetch_image_file(ctx, media.chat_id, std::stoll(key));
+        if (!image_file) {
+          co_return std::nullopt;
+        }
+
+        auto updated = media;
+        updated.image_file = std::move(*image_file);
+        co_return updated;
+      });
+
+  // Records which chats have messages, for those indexed before that was
+  // tracked, see indexer::chat_indexed(). Nothing is rewritten.
+  migrations.add<message_meta>(
+      3, "record indexed chats",
+      [&ctx](const std::string &, const message_meta &meta)
+          -> async_simple::coro::Lazy<std::optional<message_meta>> {
+        co_await ctx.indexer.mark_chat_indexed(meta.chat_id);
+        co_return std::nullopt;
+      });
+}
+} // namespace tgdb
@@ -0,0 +1,12 @@
+#pragma once
+#include "data.h"
+#include "database/migration.hpp"
+
+namespace tgdb {
+struct context;
+
+// Schema history of message_db. Append new steps with the next version,
+// never renumber or remove released ones.
+void register_message_migrations(context &ctx,
+                                 kvdb::migrations<message> &migrations);
+} // namespace tgdb
@@ -0,0 +1,187 @@
+#include "retention.h"
+#include "context.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "ylt/easylog.hpp"
+
+namespace tgdb {
+namespace {
+// Whether a message sent at `send_time` is older than `days`.
+bool older_than(int64_t send_time, uint32_t days) {
+  auto now = std::chrono::duration_cast<std::chrono::seconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  return send_time < now - static_cast<int64_t>(days) * 24 * 60 * 60;
+}
+
+// message_db is keyed by the decimal message id.
+std::optional<int64_t> message_id_of(std::string_view key) {
+  int64_t message_id;
+  auto [end, ec] = std::from_chars(key.data(), key.data() + key.size(),
+                                   message_id);
+  if (ec != std::errc() || end != key.data() + key.size()) {
+    return std::nullopt;
+  }
+  return message_id;
+}
+} // namespace
+
+void retention::install() {
+  for (const auto &rule : ctx.cfg.retention_config.rules) {
+    if (rule.chat_id) {
+      chat_rules[*rule.chat_id] = &rule;
+    } else {
+      default_rule = &rule;
+    }
+  }
+  if (chat_rules.empty() && !default_rule) {
+    return;
+  }
+
+  // Every part carries chat_id and send_time, so each family is filtered on
+  // its own and a message's parts expire together.
+  ctx.message_db.expire_part<message_meta>(
+      [this](std::string_view, const message_meta &meta) {
+        return message_expired(meta.chat_id, meta.send_time);
+      },
+      [this](std::string_view key) {
+        std::lock_guard lock(dropped_mutex);
+        dropped_messages.emplace(key);
+      });
+  ctx.message_db.expire_part<message_text>(
+      [this](std::string_view, const message_text &text) {
+        return message_expired(text.chat_id, text.send_time);
+      });
+  ctx.message_db.expire_part<message_media>(
+      [this](std::string_view, const message_media &media) {
+        if (message_expired(media.chat_id, media.send_time)) {
+          return true;
+        }
+        return (media.image_file || media.ocr_text) &&
+               media_expired(media.chat_id, media.send_time);
+      },
+      [this](std::string_view key) {
+        std::lock_guard lock(dropped_mutex);
+        dropped_media.emplace(key);
+      });
+}
+
+const config::retention_rule_t *retention::rule_for(int64_t chat_id) const {
+  if (auto it = chat_rules.find(chat_id); it != chat_rules.end()) {
+    return it->second;
+  }
+  return default_rule;
+}
+
+bool retention::message_expired(int64_t chat_id, int64_t send_time) const {
+  const auto *rule = rule_for(chat_id);
+  if (!rule) {
+    return false;
+  }
+  if (rule->max_age_days && older_than(send_time, *rule->max_age_days)) {
+    return true;
+  }
+  if (rule->max_count) {
+    std::shared_lock lock(cutoffs_mutex);
+    if (auto it = count_cutoffs.find(chat_id); it != count_cutoffs.end()) {
+      return send_time < it->second;
+    }
+  }
+  return false;
+}
+
+bool retention::media_expired(int64_t chat_id, int64_t send_time) const {
+  const auto *rule = rule_for(chat_id);
+  return rule && rule->drop_media_after_days &&
+         older_than(send_time, *rule->drop_media_after_days);
+}
+
+// A compaction filter only sees one record at a time, so max_count limits are
+// turned into a per-chat cutoff time from a scan of the meta family.
+void retention::recount() {
+  auto counted = [](const config::retention_rule_t *rule) {
+    return rule && rule->max_count;
+  };
+  if (!counted(default_rule) &&
+      std::ranges::none_of(chat_rules, counted,
+                           &decltype(chat_rules)::value_type::second)) {
+    return;
+  }
+
+  std::unordered_map<int64_t, std::vector<int64_t>> send_times;
+  for (const auto &[key, meta] : ctx.message_db.scan_part<message_meta>()) {
+    if (const auto *rule = rule_for(meta.chat_id); rule && rule->max_count) {
+      send_times[meta.chat_id].push_back(meta.send_time);
+    }
+  }
+
+  std::unordered_map<int64_t, int64_t> cutoffs;
+  for (auto &[chat_id, times] : send_times) {
+    auto max_count = *rule_for(chat_id)->max_count;
+    if (times.size() <= max_count) {
+      continue;
+    }
+    if (max_count == 0) {
+      cutoffs[chat_id] = std::numeric_limits<int64_t>::max();
+      continue;
+    }
+    auto nth = times.begin() + (max_count - 1);
+    std::ranges::nth_element(times, nth, std::greater{});
+    cutoffs[chat_id] = *nth;
+  }
+
+  std::unique_lock lock(cutoffs_mutex);
+  count_cutoffs = std::move(cutoffs);
+}
+
+void retention::enforce() {
+  if (chat_rules.empty() && !default_rule) {
+    return;
+  }
+  auto begin_time = std::chrono::steady_clock::now();
+
+  recount();
+  if (auto res = ctx.message_db.compact(); !res) {
+    ELOGFMT(ERROR, "Failed to compact message_db: {}", res.error());
+    return;
+  }
+
+  std::unordered_set<std::string> messages, media;
+  {
+    std::lock_guard lock(dropped_mutex);
+    messages.swap(dropped_messages);
+    media.swap(dropped_media);
+  }
+
+  std::vector<std::string> keys;
+  keys.reserve(messages.size() + media.size());
+  for (const auto &key : messages) {
+    if (auto message_id = message_id_of(key)) {
+      ctx.indexer.remove_vectors(*message_id);
+    }
+    media.erase(key);
+    keys.push_back(key);
+  }
+  for (const auto &key : media) {
+    if (auto message_id = message_id_of(key)) {
+      ctx.indexer.remove_vectors(*message_id, {EmbeddingType::Image});
+    }
+    keys.push_back(key);
+  }
+  ctx.message_db.reload(keys);
+
+  ELOGFMT(INFO,
+          "Retention dropped {} messages and the media of {} more in {}ms",
+          messages.size(), media.size(),
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::steady_clock::now() - begin_time)
+              .count());
+}
+} // namespace tgdb
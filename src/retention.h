@@ -0,0 +1,51 @@
+#pragma once
+#include "config.h"
+
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace tgdb {
+struct context;
+
+// Per-chat retention of message_db, see config::retention_config_t. Expired
+// messages and media are dropped by compaction filters, so nothing is checked
+// on the hot path. What the filters dropped is recorded and later removed
+// from the vector index and the cache by enforce().
+class retention {
+public:
+  explicit retention(context &ctx) : ctx(ctx) {}
+
+  // Installs the compaction filters, must run before message_db is opened.
+  void install();
+
+  // Recounts max_count limits, compacts message_db and tombstones the vectors
+  // of what was dropped. Blocking, meant for a background thread.
+  void enforce();
+
+  // Turns max_count limits into the per-chat cutoffs the compaction filters
+  // check, from a scan of the meta family. Blocking.
+  void recount();
+
+private:
+  const config::retention_rule_t *rule_for(int64_t chat_id) const;
+  bool message_expired(int64_t chat_id, int64_t send_time) const;
+  bool media_expired(int64_t chat_id, int64_t send_time) const;
+
+  context &ctx;
+  std::unordered_map<int64_t, const config::retention_rule_t *> chat_rules;
+  const config::retention_rule_t *default_rule = nullptr;
+
+  mutable std::shared_mutex cutoffs_mutex;
+  // Send time of the oldest message a max_count limit keeps, per chat
+  std::unordered_map<int64_t, int64_t> count_cutoffs;
+
+  std::mutex dropped_mutex;
+  std::unordered_set<std::string> dropped_messages;
+  std::unordered_set<std::string> dropped_media;
+};
+} // namespace tgdb
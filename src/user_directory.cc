@@ -0,0 +1,76 @@
+#include "user_directory.h"
+
+#include "ylt/easylog.hpp"
+
+namespace tgdb {
+user_directory::user_directory() : user_db("user_db") {
+  // Every profile is interned in users_ already, no need for a second copy.
+  user_db.cache.reset();
+}
+
+std::expected<void, std::string> user_directory::open() {
+  if (auto res = user_db.open(); !res) {
+    return res;
+  }
+
+  std::unique_lock lock(mutex_);
+  users_.clear();
+  for (auto &[key, info] : user_db) {
+    auto id = info.user_id;
+    users_[id] = std::make_shared<const user>(std::move(info));
+  }
+  return {};
+}
+
+std::shared_ptr<const user> user_directory::find(int64_t user_id) const {
+  std::shared_lock lock(mutex_);
+  if (auto it = users_.find(user_id); it != users_.end()) {
+    return it->second;
+  }
+  return nullptr;
+}
+
+void user_directory::update(user info) {
+  {
+    std::shared_lock lock(mutex_);
+    if (auto it = users_.find(info.user_id); it != users_.end()) {
+      if (it->second->nickname == info.nickname &&
+          it->second->str_id == info.str_id) {
+        return;
+      }
+    }
+  }
+
+  if (!user_db.put(std::to_string(info.user_id), info)) {
+    ELOGFMT(ERROR, "Failed to store user {}", info.user_id);
+  }
+
+  auto id = info.user_id;
+  auto interned = std::make_shared<const user>(std::move(info));
+  std::unique_lock lock(mutex_);
+  users_[id] = std::move(interned);
+}
+
+void user_directory::update(const td::td_api::user &info) {
+  user u{
+      .nickname = info.first_name_ + " " + info.last_name_,
+      .user_id = info.id_,
+  };
+  if (info.usernames_ && info.usernames_->active_usernames_.size() > 0) {
+    u.str_id = info.usernames_->active_usernames_[0];
+  }
+  update(std::move(u));
+}
+
+user user_directory::resolve(int64_t sender_id) const {
+  if (auto known = find(sender_id)) {
+    return *known;
+  }
+  return user{.nickname = std::to_string(sender_id), .user_id = sender_id};
+}
+
+size_t user_directory::size() const {
+  std::shared_lock lock(mutex_);
+  return users_.size();
+}
+} // namespace tgdb
@@ -0,0 +1,38 @@
+#pragma once
+#include "data.h"
+#include "database/database.hpp"
+#include "td/telegram/td_api.h"
+
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+namespace tgdb {
+// Sender profiles keyed by user (or sender chat) id. Messages only keep the
+// sender id, names are joined in at render time so renames apply to every
+// old message at once.
+struct user_directory {
+  kvdb::database<user> user_db;
+
+  user_directory();
+
+  std::expected<void, std::string> open();
+
+  std::shared_ptr<const user> find(int64_t user_id) const;
+  void update(user info);
+  void update(const td::td_api::user &info);
+
+  // Profile to display for a message sender, named by its id until the
+  // directory knows it.
+  user resolve(int64_t sender_id) const;
+
+  size_t size() const;
+
+private:
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<int64_t, std::shared_ptr<const user>> users_;
+};
+} // namespace tgdb
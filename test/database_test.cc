@@ -1,8 +1,13 @@
 #include "../src/database/database.hpp"
+#include "../src/database/background_scan.hpp"
+#include "../src/database/migration.hpp"
+#include "async_simple/coro/SyncAwait.h"
 #include "benchmark/benchmark.h"
 #include "gtest/gtest.h"
 #include <chrono>
 #include <filesystem>
+#include <format>
+#include <mutex>
 #include <random>
 #include <string_view>
 #include <thread>
@@ -13,6 +18,46 @@ struct TestData {
   bool operator==(const TestData &other) const = default;
 };
 
+// Same record with a changed layout, reads TestData records through upgrade()
+struct TestDataV2 {
+  int64_t id;
+  std::vector<std::string> names;
+  bool operator==(const TestDataV2 &other) const = default;
+
+  static std::optional<TestDataV2> upgrade(std::string_view packed) {
+    auto old = struct_pack::deserialize<TestData>(packed);
+    if (!old) {
+      return std::nullopt;
+    }
+    return TestDataV2{old->id, {old->name}};
+  }
+};
+
+// TestData stored split over two column families
+struct TestHead {
+  static constexpr std::string_view family_name = "head";
+  int id;
+};
+
+struct TestBody {
+  static constexpr std::string_view family_name = "body";
+  std::string name;
+};
+
+struct TestSplit {
+  int id;
+  std::string name;
+  bool operator==(const TestSplit &other) const = default;
+
+  using families = std::tuple<TestHead, TestBody>;
+  static families to_parts(const TestSplit &value) {
+    return {TestHead{value.id}, TestBody{value.name}};
+  }
+  static TestSplit from_parts(families &&parts) {
+    return {std::get<0>(parts).id, std::move(std::get<1>(parts).name)};
+  }
+};
+
 TEST(DatabaseTest, OpenAndClose) {
   std::filesystem::path temp_dir =
       std::filesystem::temp_directory_path() / "tgdb_test_db";
@@ -143,6 +188,562 @@ TEST(DatabaseTest, Transaction) {
   ASSERT_FALSE(std::filesystem::exists(temp_dir));
 }
 
+TEST(DatabaseTest, GetMany) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_get_many";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestData> db(temp_dir.string());
+    auto open_result = db.open();
+    ASSERT_TRUE(open_result.has_value()) << open_result.error();
+
+    TestData cached_data = {1, "cached"};
+    TestData disk_data = {2, "disk"};
+    ASSERT_TRUE(db.put("cached_key", cached_data));
+    // put_raw bypasses the cache, so this key has to come from RocksDB
+    auto packed = struct_pack::serialize<std::string>(disk_data);
+    ASSERT_TRUE(db.put_raw("disk_key", packed));
+
+    std::vector<std::string> keys = {"disk_key", "missing_key", "cached_key"};
+    auto results = db.get_many(keys);
+    ASSERT_EQ(results.size(), keys.size());
+    ASSERT_TRUE(results[0].has_value()) << results[0].error();
+    ASSERT_EQ(results[0].value(), disk_data);
+    ASSERT_FALSE(results[1].has_value());
+    ASSERT_TRUE(results[2].has_value()) << results[2].error();
+    ASSERT_EQ(results[2].value(), cached_data);
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, ScanPrefixAndBounds) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_scan";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestData> db(temp_dir.string());
+    auto open_result = db.open();
+    ASSERT_TRUE(open_result.has_value()) << open_result.error();
+
+    for (int i = 0; i < 5; ++i) {
+      db.put("a_" + std::to_string(i), TestData{i, "a"});
+      db.put("b_" + std::to_string(i), TestData{i, "b"});
+    }
+
+    int count = 0;
+    for (const auto &[key, value] : db) {
+      ASSERT_EQ(key.substr(2), std::to_string(value.id));
+      count++;
+    }
+    ASSERT_EQ(count, 10);
+
+    std::vector<std::string> keys;
+    for (const auto &[key, value] : db.scan({.prefix = "b_"})) {
+      ASSERT_EQ(value.name, "b");
+      keys.push_back(key);
+    }
+    ASSERT_EQ(keys, (std::vector<std::string>{"b_0", "b_1", "b_2", "b_3",
+                                              "b_4"}));
+
+    keys.clear();
+    for (const auto &[key, value] :
+         db.scan({.prefix = "a_", .upper_bound = "a_3"})) {
+      keys.push_back(key);
+    }
+    ASSERT_EQ(keys, (std::vector<std::string>{"a_0", "a_1", "a_2"}));
+
+    auto it = db.begin();
+    it.seek("b_3");
+    ASSERT_TRUE(it.valid());
+    ASSERT_EQ(it.key(), "b_3");
+    ASSERT_EQ(it->second, (TestData{3, "b"}));
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, ConcurrentReadersAndWriters) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_concurrent";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestData> db(temp_dir.string());
+    auto open_result = db.open();
+    ASSERT_TRUE(open_result.has_value()) << open_result.error();
+
+    constexpr int thread_count = 8, keys_per_thread = 500;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; ++t) {
+      threads.emplace_back([&db, t] {
+        for (int i = 0; i < keys_per_thread; ++i) {
+          auto key = std::format("{}_{}", t, i);
+          db.put(key, TestData{i, key});
+          auto value = db.get(key);
+          EXPECT_TRUE(value.has_value());
+          db.get(std::format("{}_{}", (t + 1) % thread_count, i));
+          if (i % 2) {
+            db.with_transaction([&](auto &tx) { tx.remove(key); });
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    ASSERT_EQ(db.cache->size(), thread_count * keys_per_thread / 2);
+    for (int t = 0; t < thread_count; ++t) {
+      ASSERT_TRUE(db.has(std::format("{}_0", t)));
+      ASSERT_FALSE(db.has(std::format("{}_1", t)));
+    }
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, UpgradeOldLayout) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_upgrade";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestData> db(temp_dir.string());
+    ASSERT_TRUE(db.open().has_value());
+    db.put("old_key", TestData{7, "old"});
+  }
+
+  {
+    kvdb::database<TestDataV2> db(temp_dir.string());
+    auto open_result = db.open();
+    ASSERT_TRUE(open_result.has_value()) << open_result.error();
+    db.put("new_key", TestDataV2{8, {"new"}});
+
+    auto old_value = db.get_raw("old_key");
+    ASSERT_TRUE(old_value.has_value());
+    auto upgraded = db.get("old_key");
+    ASSERT_TRUE(upgraded.has_value()) << upgraded.error();
+    ASSERT_EQ(upgraded.value(), (TestDataV2{7, {"old"}}));
+
+    int count = 0;
+    for (const auto &[key, value] : db) {
+      ASSERT_EQ(value.names.size(), 1u);
+      count++;
+    }
+    ASSERT_EQ(count, 2);
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, ColumnFamilies) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_families";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    // Written before the split, stays in the default family
+    kvdb::database<TestData> db(temp_dir.string());
+    ASSERT_TRUE(db.open().has_value());
+    db.put("a_legacy", TestData{1, "legacy"});
+  }
+
+  {
+    kvdb::database<TestSplit> db(temp_dir.string());
+    db.cache.reset();
+    auto open_result = db.open();
+    ASSERT_TRUE(open_result.has_value()) << open_result.error();
+    ASSERT_TRUE(db.has_legacy_values);
+
+    db.put("b_split", TestSplit{2, "split"});
+    db.put("c_split", TestSplit{3, "other"});
+
+    auto legacy = db.get("a_legacy");
+    ASSERT_TRUE(legacy.has_value()) << legacy.error();
+    ASSERT_EQ(legacy.value(), (TestSplit{1, "legacy"}));
+
+    auto body = db.get_part<TestBody>("b_split");
+    ASSERT_TRUE(body.has_value()) << body.error();
+    ASSERT_EQ(body->name, "split");
+    ASSERT_EQ(db.get_part<TestHead>("a_legacy")->id, 1);
+
+    std::vector<std::string> keys;
+    for (const auto &[key, value] : db) {
+      keys.push_back(key);
+    }
+    ASSERT_EQ(keys,
+              (std::vector<std::string>{"a_legacy", "b_split", "c_split"}));
+
+    std::vector<int> ids;
+    for (const auto &[key, head] : db.scan_part<TestHead>()) {
+      ids.push_back(head.id);
+    }
+    ASSERT_EQ(ids, (std::vector<int>{1, 2, 3}));
+
+    // Rewriting moves the value out of the default family
+    db.put("a_legacy", TestSplit{1, "moved"});
+    ASSERT_FALSE(db.get_raw("a_legacy").has_value());
+    ASSERT_EQ(db.get("a_legacy")->name, "moved");
+
+    ASSERT_TRUE(db.remove("b_split").has_value());
+    ASSERT_FALSE(db.get("b_split").has_value());
+    ASSERT_FALSE(db.get_part<TestBody>("b_split").has_value());
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, UnknownCompressionRejected) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_compression";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestSplit> db(temp_dir.string());
+    db.tune_family("body", kvdb::tuning_options{.compression = "zstandard"});
+    auto open_result = db.open();
+    ASSERT_FALSE(open_result.has_value());
+    ASSERT_NE(open_result.error().find("zstandard"), std::string::npos);
+  }
+
+  std::filesystem::remove_all(temp_dir);
+}
+
+TEST(DatabaseTest, BackgroundScanSnapshot) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_background";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestData> db(temp_dir.string());
+    ASSERT_TRUE(db.open().has_value());
+    for (int i = 0; i < 10; ++i) {
+      db.put(std::format("key_{}", i), TestData{i, "old"});
+    }
+
+    kvdb::background_scan_options options{.concurrency = 4, .chunk_size = 3};
+    size_t reports = 0;
+    options.on_progress = [&](const kvdb::scan_progress &) { reports++; };
+
+    auto progress = async_simple::coro::syncAwait(kvdb::background_scan(
+        db, options,
+        [&](const std::string &key, const TestData &value)
+            -> async_simple::coro::Lazy<std::optional<TestData>> {
+          if (key == "key_0") {
+            // Written after the snapshot, neither visited nor overwritten
+            db.put("key_00", TestData{100, "live"});
+            db.put("key_1", TestData{1, "live"});
+          }
+          co_return TestData{value.id, "new"};
+        }));
+
+    ASSERT_EQ(progress.scanned, 10u);
+    ASSERT_EQ(progress.written, 9u);
+    ASSERT_EQ(progress.conflicts, 1u);
+    ASSERT_EQ(reports, 4u);
+    ASSERT_EQ(db.get("key_1")->name, "live");
+    ASSERT_EQ(db.get("key_2")->name, "new");
+    ASSERT_EQ(db.get("key_00")->name, "live");
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, BackgroundScanOfPartKeepsOtherParts) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_background_part";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestSplit> db(temp_dir.string());
+    ASSERT_TRUE(db.open().has_value());
+    db.put("a", TestSplit{1, "old"});
+    db.put("b", TestSplit{2, "old"});
+
+    auto progress = async_simple::coro::syncAwait(
+        kvdb::background_scan<TestSplit, TestHead>(
+            db, {},
+            [&](const std::string &key, const TestHead &head)
+                -> async_simple::coro::Lazy<std::optional<TestHead>> {
+              // Edits the part the scan does not compare
+              db.put(key, TestSplit{head.id, "live"});
+              co_return TestHead{head.id * 10};
+            }));
+
+    ASSERT_EQ(progress.written, 2u);
+    ASSERT_EQ(progress.conflicts, 0u);
+    ASSERT_EQ(db.get("a"), (TestSplit{10, "live"}));
+    ASSERT_EQ(db.get("b"), (TestSplit{20, "live"}));
+  }
+
+  std::filesystem::remove_all(temp_dir);
+}
+
+TEST(DatabaseTest, MigrationsResumeFromCheckpoint) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_migrations";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestData> db(temp_dir.string());
+    ASSERT_TRUE(db.open().has_value());
+    for (int i = 0; i < 6; ++i) {
+      db.put(std::format("key_{}", i), TestData{i, "v0"});
+    }
+    ASSERT_EQ(db.schema_version(), 0u);
+    // Left behind by an interrupted run of step 1
+    ASSERT_TRUE(db.put_meta("migration/1", "key_2"));
+
+    kvdb::migrations<TestData> migrations;
+    migrations.options.chunk_size = 2;
+    using result = async_simple::coro::Lazy<std::optional<TestData>>;
+    migrations.add(2, "append",
+                   [](const std::string &, const TestData &value) -> result {
+                     co_return TestData{value.id, value.name + "+v2"};
+                   });
+    migrations.add(1, "rename",
+                   [](const std::string &, const TestData &value) -> result {
+                     co_return TestData{value.id, "v1"};
+                   });
+
+    auto res = async_simple::coro::syncAwait(migrations.run(db));
+    ASSERT_TRUE(res.has_value()) << res.error();
+    ASSERT_EQ(db.schema_version(), 2u);
+    ASSERT_FALSE(db.get_meta("migration/1").has_value());
+    ASSERT_EQ(db.get("key_1")->name, "v0+v2");
+    ASSERT_EQ(db.get("key_3")->name, "v1+v2");
+
+    // Metadata never shows up in scans
+    int count = 0;
+    for (const auto &[key, value] : db) {
+      count++;
+    }
+    ASSERT_EQ(count, 6);
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, FailedMigrationCanBeRetried) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_failed_migration";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestData> db(temp_dir.string());
+    ASSERT_TRUE(db.open().has_value());
+    db.put("key", TestData{1, "v0"});
+
+    kvdb::migrations<TestData> migrations;
+    bool fail = true;
+    migrations.steps.push_back(
+        {1, "flaky",
+         [&](kvdb::database<TestData> &, kvdb::background_scan_options)
+             -> async_simple::coro::Lazy<kvdb::scan_progress> {
+           if (fail) {
+             throw std::runtime_error("commit failed");
+           }
+           co_return kvdb::scan_progress{};
+         }});
+
+    auto res = async_simple::coro::syncAwait(migrations.run(db));
+    ASSERT_FALSE(res.has_value());
+    ASSERT_NE(res.error().find("commit failed"), std::string::npos);
+    ASSERT_FALSE(migrations.running());
+    ASSERT_EQ(db.schema_version(), 0u);
+
+    fail = false;
+    res = async_simple::coro::syncAwait(migrations.run(db));
+    ASSERT_TRUE(res.has_value()) << res.error();
+    ASSERT_EQ(db.schema_version(), 1u);
+
+    // A damaged version is an error, not an exception
+    ASSERT_TRUE(db.put_meta("schema_version", "x1"));
+    ASSERT_FALSE(db.schema_version().has_value());
+    res = async_simple::coro::syncAwait(migrations.run(db));
+    ASSERT_FALSE(res.has_value());
+    ASSERT_FALSE(migrations.running());
+  }
+
+  std::filesystem::remove_all(temp_dir);
+}
+
+TEST(DatabaseTest, BackupAndRestore) {
+  auto temp_dir = std::filesystem::temp_directory_path() / "tgdb_test_backup";
+  auto db_dir = temp_dir / "db";
+  auto backup_dir = temp_dir / "backup";
+  auto restored_dir = temp_dir / "restored";
+  std::filesystem::remove_all(temp_dir);
+  std::filesystem::create_directories(temp_dir);
+
+  {
+    kvdb::database<TestData> db(db_dir.string());
+    ASSERT_TRUE(db.open().has_value());
+    db.put("first", TestData{1, "first"});
+    auto first = db.backup(backup_dir.string());
+    ASSERT_TRUE(first.has_value()) << first.error();
+
+    db.put("second", TestData{2, "second"});
+    auto second = db.backup(backup_dir.string(), 1);
+    ASSERT_TRUE(second.has_value()) << second.error();
+    ASSERT_NE(*first, *second);
+
+    auto res = db.checkpoint((temp_dir / "checkpoint").string());
+    ASSERT_TRUE(res.has_value()) << res.error();
+  }
+
+  auto res = kvdb::restore_backup(backup_dir.string(), restored_dir.string());
+  ASSERT_TRUE(res.has_value()) << res.error();
+  for (auto dir : {restored_dir, temp_dir / "checkpoint"}) {
+    kvdb::database<TestData> db(dir.string());
+    ASSERT_TRUE(db.open().has_value());
+    ASSERT_EQ(db.get("first").value(), (TestData{1, "first"}));
+    ASSERT_EQ(db.get("second").value(), (TestData{2, "second"}));
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, AsyncFacade) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_async";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestData> db(temp_dir.string());
+    db.io = std::make_shared<kvdb::io_pool>(2);
+    db.cache.reset();
+    ASSERT_TRUE(db.open().has_value());
+
+    auto caller = std::this_thread::get_id();
+    auto res = async_simple::coro::syncAwait(
+        [&]() -> async_simple::coro::Lazy<std::expected<TestData, std::string>> {
+          co_await db.async_put("key", TestData{1, "async"});
+
+          kvdb::transaction_batch<TestData> batch(&db);
+          batch.put("batched", TestData{2, "batched"});
+          co_await db.async_write(std::move(batch));
+
+          auto io_thread = co_await db.io->run(
+              [] { return std::this_thread::get_id(); });
+          EXPECT_NE(io_thread, caller);
+
+          std::vector<std::string> keys = {"key", "batched"};
+          auto many = co_await db.async_get_many(std::move(keys));
+          EXPECT_TRUE(many[1].has_value());
+          EXPECT_TRUE(co_await db.async_has("batched"));
+          EXPECT_FALSE(co_await db.async_has("missing"));
+          co_return co_await db.async_get("key");
+        }());
+    ASSERT_TRUE(res.has_value()) << res.error();
+    ASSERT_EQ(res->name, "async");
+    ASSERT_TRUE(async_simple::coro::syncAwait(db.async_remove("key")));
+    ASSERT_FALSE(db.get("key").has_value());
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, ExpirePart) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_expire";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    kvdb::database<TestSplit> db(temp_dir.string());
+    std::mutex mutex;
+    std::vector<std::string> expired;
+    db.expire_part<TestHead>(
+        [](std::string_view, const TestHead &head) { return head.id < 0; },
+        [&](std::string_view key) {
+          std::lock_guard lock(mutex);
+          expired.emplace_back(key);
+        });
+    db.expire_part<TestBody>([](std::string_view, const TestBody &body) {
+      return body.name == "stale";
+    });
+    ASSERT_TRUE(db.open().has_value());
+
+    db.put("expired", TestSplit{-1, "gone"});
+    db.put("trimmed", TestSplit{2, "stale"});
+    db.put("kept", TestSplit{3, "fresh"});
+
+    auto res = db.compact();
+    ASSERT_TRUE(res.has_value()) << res.error();
+    ASSERT_EQ(expired, std::vector<std::string>{"expired"});
+
+    // Compaction does not touch the cache until it is reloaded
+    ASSERT_TRUE(db.has("expired"));
+    std::vector<std::string> keys = {"expired", "trimmed"};
+    db.reload(keys);
+    ASSERT_FALSE(db.has("expired"));
+    ASSERT_EQ(db.get("trimmed").value(), (TestSplit{2, ""}));
+    ASSERT_EQ(db.get("kept").value(), (TestSplit{3, "fresh"}));
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
+TEST(DatabaseTest, HotAndColdTiers) {
+  std::filesystem::path temp_dir =
+      std::filesystem::temp_directory_path() / "tgdb_test_db_tiers";
+  std::filesystem::remove_all(temp_dir);
+
+  {
+    int boundary = 10;
+    kvdb::database<TestData> db(temp_dir.string());
+    db.hot = [&](const TestData &value) { return value.id >= boundary; };
+    ASSERT_TRUE(db.open().has_value());
+
+    db.put("old", TestData{1, "old"});
+    db.put("recent", TestData{20, "recent"});
+    db.with_transaction(
+        [](auto &batch) { batch.put("batched", TestData{2, "batched"}); });
+    ASSERT_FALSE(db.cache->contains("old"));
+    ASSERT_FALSE(db.cache->contains("batched"));
+    ASSERT_TRUE(db.cache->contains("recent"));
+
+    // Cold values are still found, just on disk
+    ASSERT_TRUE(db.has("old"));
+    ASSERT_FALSE(db.has("missing"));
+
+    // and are cached once read, until a demote() finds them unread
+    ASSERT_EQ(db.get("old")->name, "old");
+    ASSERT_TRUE(db.cache->contains("old"));
+
+    boundary = 30;
+    ASSERT_EQ(db.demote(), 1u);
+    ASSERT_FALSE(db.cache->contains("recent"));
+    ASSERT_TRUE(db.cache->contains("old"));
+    ASSERT_EQ(db.get("recent")->name, "recent");
+    ASSERT_EQ(db.demote(), 1u);
+    ASSERT_FALSE(db.cache->contains("old"));
+    ASSERT_TRUE(db.cache->contains("recent"));
+
+    std::vector<std::string> cached;
+    db.for_each_cached([&](const std::string &key, const TestData &) {
+      cached.push_back(key);
+    });
+    ASSERT_EQ(cached, std::vector<std::string>{"recent"});
+  }
+
+  std::filesystem::remove_all(temp_dir);
+  ASSERT_FALSE(std::filesystem::exists(temp_dir));
+}
+
 static void BM_DatabaseIteratorBenchmark(benchmark::State &state) {
   std::filesystem::path temp_dir =
       std::filesystem::temp_directory_path() / "tgdb_benchmark_db";
@@ -1,10 +1,16 @@
 #include "gtest/gtest.h"
 #include "faiss_vector_db.h"
+#include "modal_vector_db.hpp"
 #include "vector_db.h"
+#include <atomic>
 #include <filesystem>
+#include <fstream>
+#include <thread>
 #include <vector>
 #include <string>
 #include <numeric>
+#include <random>
+#include <unordered_map>
 
 
 std::vector<float> CreateDummyVector(int dim, float start_val = 0.0f, float step = 1.0f) {
@@ -32,6 +38,15 @@ protected:
         
         std::filesystem::remove(test_db_path_);
     }
+
+    // Every file a snapshot and log of test_db_path_ consist of
+    void RemoveSnapshotFiles() {
+        for (auto &entry : std::filesystem::directory_iterator(".")) {
+            if (entry.path().filename().string().starts_with(test_db_path_ + ".")) {
+                std::filesystem::remove(entry.path());
+            }
+        }
+    }
 };
 
 TEST_F(VectorDbTest, Initialization) {
@@ -39,7 +54,7 @@ TEST_F(VectorDbTest, Initialization) {
 }
 
 TEST_F(VectorDbTest, AddAndSearchVector) {
-    std::string key1 = "vec1";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> vec1 = CreateDummyVector(dimension_, 1.0f);
 
     ASSERT_TRUE(db_service_->AddVector(key1, vec1));
@@ -51,7 +66,7 @@ TEST_F(VectorDbTest, AddAndSearchVector) {
     
     EXPECT_FLOAT_EQ(results[0].score, 0.0f);
 
-    std::string key2 = "vec2";
+    tgdb::VectorKey key2 = 2;
     std::vector<float> vec2 = CreateDummyVector(dimension_, 5.0f);
     ASSERT_TRUE(db_service_->AddVector(key2, vec2));
 
@@ -68,11 +83,11 @@ TEST_F(VectorDbTest, AddAndSearchVector) {
 }
 
 TEST_F(VectorDbTest, SearchMultipleResults) {
-    std::string key1 = "vec1";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> vec1 = CreateDummyVector(dimension_, 1.0f); 
-    std::string key2 = "vec2";
+    tgdb::VectorKey key2 = 2;
     std::vector<float> vec2 = CreateDummyVector(dimension_, 1.1f); 
-    std::string key3 = "vec3";
+    tgdb::VectorKey key3 = 3;
     std::vector<float> vec3 = CreateDummyVector(dimension_, 10.0f); 
 
     ASSERT_TRUE(db_service_->AddVector(key1, vec1));
@@ -91,7 +106,7 @@ TEST_F(VectorDbTest, SearchMultipleResults) {
 }
 
 TEST_F(VectorDbTest, AddExistingKey) {
-    std::string key1 = "vec_exist";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> vec1 = CreateDummyVector(dimension_, 1.0f);
     std::vector<float> vec2 = CreateDummyVector(dimension_, 2.0f);
 
@@ -114,7 +129,7 @@ TEST_F(VectorDbTest, SearchEmptyDatabase) {
 }
 
 TEST_F(VectorDbTest, RemoveVector) {
-    std::string key1 = "vec_to_remove";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> vec1 = CreateDummyVector(dimension_, 1.0f);
     ASSERT_TRUE(db_service_->AddVector(key1, vec1));
 
@@ -127,11 +142,11 @@ TEST_F(VectorDbTest, RemoveVector) {
     ASSERT_TRUE(results_after_remove.empty());
 
     
-    ASSERT_FALSE(db_service_->RemoveVector("non_existent_key"));
+    ASSERT_FALSE(db_service_->RemoveVector(999));
 }
 
 TEST_F(VectorDbTest, UpdateVector) {
-    std::string key1 = "vec_to_update";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> original_vec = CreateDummyVector(dimension_, 1.0f);
     std::vector<float> updated_vec = CreateDummyVector(dimension_, 10.0f);
 
@@ -157,14 +172,14 @@ TEST_F(VectorDbTest, UpdateVector) {
     EXPECT_FLOAT_EQ(results_updated[0].score, 0.0f);
 
     
-    ASSERT_FALSE(db_service_->UpdateVector("non_existent_key", updated_vec));
+    ASSERT_FALSE(db_service_->UpdateVector(999, updated_vec));
 }
 
 
 TEST_F(VectorDbTest, SaveAndLoad) {
-    std::string key1 = "saveload_vec1";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> vec1 = CreateDummyVector(dimension_, 1.0f);
-    std::string key2 = "saveload_vec2";
+    tgdb::VectorKey key2 = 2;
     std::vector<float> vec2 = CreateDummyVector(dimension_, 5.0f);
 
     ASSERT_TRUE(db_service_->AddVector(key1, vec1));
@@ -200,19 +215,19 @@ TEST_F(VectorDbTest, LoadNonExistentFile) {
 }
 
 TEST_F(VectorDbTest, AddVectorWithWrongDimension) {
-    std::string key1 = "wrong_dim_vec";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> wrong_dim_vec = CreateDummyVector(dimension_ + 1, 1.0f); 
     
     ASSERT_FALSE(db_service_->AddVector(key1, wrong_dim_vec));
 
     std::vector<float> also_wrong_dim_vec = CreateDummyVector(dimension_ -1 < 0 ? 1 : dimension_ -1 , 1.0f); 
     if (dimension_ > 1) { 
-        ASSERT_FALSE(db_service_->AddVector("wrong_dim_vec2", also_wrong_dim_vec));
+        ASSERT_FALSE(db_service_->AddVector(2, also_wrong_dim_vec));
     }
 }
 
 TEST_F(VectorDbTest, SearchWithWrongDimension) {
-    std::string key1 = "correct_dim_vec";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> correct_dim_vec = CreateDummyVector(dimension_, 1.0f);
     ASSERT_TRUE(db_service_->AddVector(key1, correct_dim_vec));
 
@@ -233,11 +248,11 @@ TEST_F(VectorDbTest, SearchWithWrongDimension) {
 
 TEST_F(VectorDbTest, UpdateNonExistentKey) {
     std::vector<float> vec = CreateDummyVector(dimension_);
-    ASSERT_FALSE(db_service_->UpdateVector("non_existent_key_update", vec));
+    ASSERT_FALSE(db_service_->UpdateVector(999, vec));
 }
 
 TEST_F(VectorDbTest, UpdateVectorWithWrongDimension) {
-    std::string key1 = "update_dim_test";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> vec1 = CreateDummyVector(dimension_);
     ASSERT_TRUE(db_service_->AddVector(key1, vec1));
 
@@ -252,7 +267,7 @@ TEST_F(VectorDbTest, UpdateVectorWithWrongDimension) {
 
 
 TEST_F(VectorDbTest, RemoveAndReAdd) {
-    std::string key = "readd_key";
+    tgdb::VectorKey key = 1;
     std::vector<float> vec = CreateDummyVector(dimension_, 7.0f);
 
     ASSERT_TRUE(db_service_->AddVector(key, vec));
@@ -272,9 +287,9 @@ TEST_F(VectorDbTest, RemoveAndReAdd) {
 }
 
 TEST_F(VectorDbTest, SearchTopKMoreThanItems) {
-    std::string key1 = "item1";
+    tgdb::VectorKey key1 = 1;
     std::vector<float> vec1 = CreateDummyVector(dimension_, 1.0f);
-    std::string key2 = "item2";
+    tgdb::VectorKey key2 = 2;
     std::vector<float> vec2 = CreateDummyVector(dimension_, 2.0f);
 
     ASSERT_TRUE(db_service_->AddVector(key1, vec1));
@@ -285,6 +300,544 @@ TEST_F(VectorDbTest, SearchTopKMoreThanItems) {
     EXPECT_EQ(results[0].key, key1); 
 }
 
+TEST_F(VectorDbTest, AddAndSearchBatch) {
+    std::vector<tgdb::VectorKey> keys;
+    std::vector<std::vector<float>> vectors;
+    for (int i = 0; i < 2000; ++i) {
+        keys.push_back(i);
+        vectors.push_back(CreateDummyVector(dimension_, static_cast<float>(i)));
+    }
+    // Existing keys and wrong dimensions are skipped
+    keys.push_back(0);
+    vectors.push_back(CreateDummyVector(dimension_, 1.0f));
+    keys.push_back(5000);
+    vectors.push_back(CreateDummyVector(dimension_ - 1));
+    EXPECT_EQ(db_service_->AddVectors(keys, vectors), 2000);
+    EXPECT_FALSE(db_service_->Exists(5000));
+
+    std::vector<std::vector<float>> queries = {
+        CreateDummyVector(dimension_, 10.0f),
+        CreateDummyVector(dimension_ + 1),
+        CreateDummyVector(dimension_, 1500.0f),
+    };
+    auto results = db_service_->SearchBatch(queries, 2);
+    ASSERT_EQ(results.size(), 3);
+    ASSERT_EQ(results[0].size(), 2);
+    EXPECT_EQ(results[0][0].key, 10);
+    EXPECT_TRUE(results[1].empty());
+    ASSERT_EQ(results[2].size(), 2);
+    EXPECT_EQ(results[2][0].key, 1500);
+
+    auto single = db_service_->Search(queries[2], 2);
+    ASSERT_EQ(single.size(), 2);
+    EXPECT_EQ(single[1].key, results[2][1].key);
+    EXPECT_FLOAT_EQ(single[1].score, results[2][1].score);
+}
+
+TEST_F(VectorDbTest, SearchSkipsTombstones) {
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_TRUE(db_service_->AddVector(i,
+                                           CreateDummyVector(dimension_, i)));
+    }
+    // Removed vectors stay in the index as tombstones until compacted
+    ASSERT_TRUE(db_service_->RemoveVector(3));
+    ASSERT_FALSE(db_service_->Exists(3));
+
+    auto results = db_service_->Search(CreateDummyVector(dimension_, 3.0f), 7);
+    ASSERT_EQ(results.size(), 7);
+    for (const auto &result : results) {
+        EXPECT_NE(result.key, 3);
+    }
+
+    ASSERT_TRUE(db_service_->UpdateVector(4, CreateDummyVector(dimension_, 3.0f)));
+    results = db_service_->Search(CreateDummyVector(dimension_, 3.0f), 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].key, 4);
+}
+
+TEST_F(VectorDbTest, CompactPurgesTombstones) {
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(db_service_->AddVector(i,
+                                           CreateDummyVector(dimension_, i)));
+    }
+    ASSERT_TRUE(db_service_->RemoveVector(0));
+    ASSERT_TRUE(db_service_->RemoveVector(2));
+    EXPECT_EQ(db_service_->Compact(), 2u);
+    EXPECT_EQ(db_service_->Compact(), 0u);
+
+    auto results = db_service_->Search(CreateDummyVector(dimension_, 1.0f), 4);
+    ASSERT_EQ(results.size(), 2);
+    EXPECT_EQ(results[0].key, 1);
+    EXPECT_EQ(results[1].key, 3);
+
+    // Ids stay stable across compaction and a save/load round trip
+    ASSERT_TRUE(db_service_->Save(test_db_path_));
+    auto loaded = std::make_unique<tgdb::FaissVectorDbService>(dimension_);
+    ASSERT_TRUE(loaded->Load(test_db_path_));
+    EXPECT_EQ(loaded->GetVector(3), CreateDummyVector(dimension_, 3.0f));
+    EXPECT_FALSE(loaded->Exists(2));
+}
+
+TEST_F(VectorDbTest, LogReplayedOnStartup) {
+    auto remove_files = [&] { RemoveSnapshotFiles(); };
+    remove_files();
+
+    tgdb::FaissVectorDbService writer(dimension_);
+    ASSERT_TRUE(writer.CreateOrLoad(test_db_path_));
+    ASSERT_TRUE(writer.AddVector(1, CreateDummyVector(dimension_, 1.0f)));
+    ASSERT_TRUE(writer.AddVector(2, CreateDummyVector(dimension_, 2.0f)));
+    ASSERT_TRUE(writer.UpdateVector(1, CreateDummyVector(dimension_, 3.0f)));
+    ASSERT_TRUE(writer.RemoveVector(2));
+    ASSERT_TRUE(writer.Sync());
+    auto logged = std::filesystem::file_size(test_db_path_ + ".wal");
+    EXPECT_GT(logged, 0u);
+    {
+        // A zero filled tail is torn, not a run of records
+        std::ofstream wal(test_db_path_ + ".wal",
+                          std::ios::binary | std::ios::app);
+        std::string zeros(64, '\0');
+        wal.write(zeros.data(), zeros.size());
+    }
+
+    // Nothing but the log has the changes yet
+    tgdb::FaissVectorDbService reader(dimension_);
+    ASSERT_TRUE(reader.CreateOrLoad(test_db_path_));
+    EXPECT_EQ(reader.GetVector(1), CreateDummyVector(dimension_, 3.0f));
+    EXPECT_FALSE(reader.Exists(2));
+    EXPECT_EQ(std::filesystem::file_size(test_db_path_ + ".wal"), logged);
+
+    ASSERT_TRUE(writer.Checkpoint(true));
+    EXPECT_EQ(std::filesystem::file_size(test_db_path_ + ".wal"), 0u);
+    remove_files();
+}
+
+TEST_F(VectorDbTest, DamagedSnapshotIsKept) {
+    RemoveSnapshotFiles();
+    {
+        tgdb::FaissVectorDbService writer(dimension_);
+        ASSERT_TRUE(writer.CreateOrLoad(test_db_path_));
+        ASSERT_TRUE(writer.AddVector(1, CreateDummyVector(dimension_, 1.0f)));
+        ASSERT_TRUE(writer.Sync());
+    }
+    auto logged = std::filesystem::file_size(test_db_path_ + ".wal");
+    std::filesystem::resize_file(test_db_path_ + ".meta", 4);
+
+    tgdb::FaissVectorDbService reader(dimension_);
+    EXPECT_FALSE(reader.CreateOrLoad(test_db_path_));
+    EXPECT_EQ(std::filesystem::file_size(test_db_path_ + ".wal"), logged);
+    EXPECT_TRUE(std::filesystem::exists(test_db_path_ + ".1.vectors"));
+    RemoveSnapshotFiles();
+}
+
+TEST_F(VectorDbTest, CheckpointWritesMappedSnapshot) {
+    RemoveSnapshotFiles();
+    {
+        tgdb::FaissVectorDbService writer(dimension_);
+        ASSERT_TRUE(writer.CreateOrLoad(test_db_path_));
+        for (int i = 0; i < 4; ++i) {
+            ASSERT_TRUE(writer.AddVector(i,
+                                         CreateDummyVector(dimension_, i)));
+        }
+        ASSERT_TRUE(writer.RemoveVector(1));
+        ASSERT_TRUE(writer.Checkpoint(true));
+        EXPECT_TRUE(std::filesystem::exists(test_db_path_ + ".2.vectors"));
+        EXPECT_TRUE(std::filesystem::exists(test_db_path_ + ".2.keys"));
+        EXPECT_FALSE(std::filesystem::exists(test_db_path_ + ".1.vectors"));
+
+        // Changes after the checkpoint are searched together with it
+        ASSERT_TRUE(writer.UpdateVector(3, CreateDummyVector(dimension_, 10.0f)));
+        auto results = writer.Search(CreateDummyVector(dimension_, 10.0f), 1);
+        ASSERT_EQ(results.size(), 1);
+        EXPECT_EQ(results[0].key, 3);
+    }
+
+    tgdb::FaissVectorDbService reader(dimension_);
+    ASSERT_TRUE(reader.CreateOrLoad(test_db_path_));
+    EXPECT_FALSE(reader.Exists(1));
+    EXPECT_EQ(reader.GetVector(2), CreateDummyVector(dimension_, 2.0f));
+    EXPECT_EQ(reader.GetVector(3), CreateDummyVector(dimension_, 10.0f));
+    auto results = reader.Search(CreateDummyVector(dimension_, 0.0f), 4);
+    ASSERT_EQ(results.size(), 3);
+    EXPECT_EQ(results[0].key, 0);
+    EXPECT_EQ(results[1].key, 2);
+    EXPECT_EQ(results[2].key, 3);
+    RemoveSnapshotFiles();
+}
+
+TEST_F(VectorDbTest, SearchesRunAlongsideWrites) {
+    std::atomic<bool> done = false;
+    std::atomic<size_t> searches = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&] {
+            while (!done) {
+                auto results = db_service_->Search(CreateDummyVector(dimension_, 100.0f), 5);
+                for (auto &result : results) {
+                    EXPECT_LT(result.key, 3000u);
+                }
+                searches++;
+            }
+        });
+    }
+
+    // Enough vectors to fill several segments, with a rewrite of the base
+    // while searches run
+    // No ASSERT here, returning early would leave the readers running
+    for (int i = 0; i < 3000; ++i) {
+        EXPECT_TRUE(db_service_->AddVector(i,
+                                           CreateDummyVector(dimension_, i)));
+        if (i % 3 == 0) {
+            EXPECT_TRUE(db_service_->RemoveVector(i));
+        }
+        if (i == 1500) {
+            EXPECT_GT(db_service_->Compact(), 0u);
+        }
+    }
+    done = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    EXPECT_GT(searches.load(), 0u);
+
+    auto results = db_service_->Search(CreateDummyVector(dimension_, 100.0f), 3);
+    ASSERT_EQ(results.size(), 3);
+    EXPECT_EQ(results[0].key, 100);
+    EXPECT_FALSE(db_service_->Exists(99));
+    EXPECT_EQ(db_service_->GetVector(2999), CreateDummyVector(dimension_, 2999.0f));
+}
+
+TEST_F(VectorDbTest, CheckpointsRunAlongsideWrites) {
+    RemoveSnapshotFiles();
+    auto check = [&](tgdb::FaissVectorDbService &db) {
+        for (int i = 0; i < 2000; ++i) {
+            if (i % 3 == 0) {
+                EXPECT_FALSE(db.Exists(i));
+            } else {
+                EXPECT_EQ(db.GetVector(i),
+                          CreateDummyVector(dimension_, i % 3 == 1 ? i + 0.5f : i));
+            }
+        }
+    };
+    {
+        tgdb::FaissVectorDbService db(dimension_);
+        ASSERT_TRUE(db.CreateOrLoad(test_db_path_));
+        std::atomic<bool> done = false;
+        std::thread writer([&] {
+            for (int i = 0; i < 2000; ++i) {
+                EXPECT_TRUE(db.AddVector(i, CreateDummyVector(dimension_, i)));
+                if (i % 3 == 0) {
+                    EXPECT_TRUE(db.RemoveVector(i));
+                } else if (i % 3 == 1) {
+                    EXPECT_TRUE(db.UpdateVector(
+                        i, CreateDummyVector(dimension_, i + 0.5f)));
+                }
+            }
+            done = true;
+        });
+        // Changes made while a checkpoint writes the snapshot land in the
+        // log that replaces the old one
+        size_t checkpoints = 0;
+        while (!done) {
+            EXPECT_TRUE(db.Checkpoint(true));
+            checkpoints++;
+        }
+        writer.join();
+        EXPECT_GT(checkpoints, 0u);
+        check(db);
+        ASSERT_TRUE(db.Sync());
+    }
+    tgdb::FaissVectorDbService restarted(dimension_);
+    ASSERT_TRUE(restarted.CreateOrLoad(test_db_path_));
+    check(restarted);
+    RemoveSnapshotFiles();
+}
+
+TEST_F(VectorDbTest, FilteredSearch) {
+    RemoveSnapshotFiles();
+    tgdb::FaissVectorDbService hnsw(dimension_, faiss::METRIC_L2,
+                                    {.type = "hnsw", .hnsw_m = 8});
+    ASSERT_TRUE(hnsw.CreateOrLoad(test_db_path_));
+    for (int i = 0; i < 100; ++i) {
+        tgdb::VectorAttributes attributes{.chat_id = i % 10 == 0 ? 2 : 1,
+                                          .sender_id = i % 2,
+                                          .send_time = i,
+                                          .content_kinds = 1u << (i % 3)};
+        ASSERT_TRUE(hnsw.AddVector(i,
+                                   CreateDummyVector(dimension_, i), attributes));
+    }
+    // Once searching the graph and once, after a restart, the segments
+    // replayed from the log
+    auto check = [&](tgdb::VectorDbService &db) {
+        auto results = db.Search(CreateDummyVector(dimension_, 54.0f), 3, {.chat_id = 2});
+        ASSERT_EQ(results.size(), 3);
+        EXPECT_EQ(results[0].key, 50);
+        EXPECT_EQ(results[1].key, 60);
+        EXPECT_EQ(results[2].key, 40);
+
+        results = db.Search(CreateDummyVector(dimension_, 0.0f), 10,
+                            {.sender_id = 1, .min_send_time = 20, .max_send_time = 29,
+                             .content_kinds = 1u << 2});
+        ASSERT_EQ(results.size(), 2);
+        EXPECT_EQ(results[0].key, 23);
+        EXPECT_EQ(results[1].key, 29);
+    };
+    check(hnsw);
+    ASSERT_TRUE(hnsw.Sync());
+    {
+        tgdb::FaissVectorDbService restarted(dimension_);
+        ASSERT_TRUE(restarted.CreateOrLoad(test_db_path_));
+        check(restarted);
+    }
+    EXPECT_TRUE(hnsw.Train());
+    check(hnsw);
+    RemoveSnapshotFiles();
+}
+
+TEST_F(VectorDbTest, HnswIndex) {
+    tgdb::FaissVectorDbService hnsw(dimension_, faiss::METRIC_L2,
+                                    {.type = "hnsw", .hnsw_m = 8});
+    for (int i = 0; i < 50; ++i) {
+        ASSERT_TRUE(hnsw.AddVector(i,
+                                   CreateDummyVector(dimension_, i)));
+    }
+    EXPECT_TRUE(hnsw.Train());
+
+    ASSERT_TRUE(hnsw.RemoveVector(20));
+    auto results = hnsw.Search(CreateDummyVector(dimension_, 20.0f), 2);
+    ASSERT_EQ(results.size(), 2);
+    EXPECT_NE(results[0].key, 20);
+    EXPECT_NE(results[1].key, 20);
+}
+
+TEST_F(VectorDbTest, HnswKeepsPurgedNodes) {
+    RemoveSnapshotFiles();
+    tgdb::FaissIndexOptions options{.type = "hnsw", .hnsw_m = 8};
+    {
+        tgdb::FaissVectorDbService hnsw(dimension_, faiss::METRIC_L2, options);
+        ASSERT_TRUE(hnsw.CreateOrLoad(test_db_path_));
+        for (int i = 0; i < 50; ++i) {
+            ASSERT_TRUE(hnsw.AddVector(i, CreateDummyVector(dimension_, i)));
+        }
+        ASSERT_TRUE(hnsw.Checkpoint(true));
+        // Too few to rebuild the graph, the next snapshot keeps their nodes
+        ASSERT_TRUE(hnsw.RemoveVector(20));
+        ASSERT_TRUE(hnsw.UpdateVector(21, CreateDummyVector(dimension_, 100.0f)));
+        ASSERT_TRUE(hnsw.Checkpoint(true));
+    }
+    tgdb::FaissVectorDbService restarted(dimension_, faiss::METRIC_L2, options);
+    ASSERT_TRUE(restarted.CreateOrLoad(test_db_path_));
+    auto results = restarted.Search(CreateDummyVector(dimension_, 20.5f), 2);
+    ASSERT_EQ(results.size(), 2);
+    for (auto &result : results) {
+        EXPECT_NE(result.key, 20);
+        EXPECT_NE(result.key, 21);
+    }
+    results = restarted.Search(CreateDummyVector(dimension_, 100.0f), 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].key, 21);
+    RemoveSnapshotFiles();
+}
+
+TEST_F(VectorDbTest, QuantizedStorage) {
+    RemoveSnapshotFiles();
+    {
+        tgdb::FaissVectorDbService writer(dimension_);
+        ASSERT_TRUE(writer.CreateOrLoad(test_db_path_));
+        for (int i = 0; i < 200; ++i) {
+            ASSERT_TRUE(writer.AddVector(i,
+                                         CreateDummyVector(dimension_, i * 0.5f)));
+        }
+        ASSERT_TRUE(writer.Checkpoint(true));
+    }
+
+    // Existing float snapshots are converted by Train()
+    for (std::string storage : {"sq8", "fp16", "float"}) {
+        tgdb::FaissVectorDbService db(dimension_, faiss::METRIC_L2,
+                                      {.storage = storage});
+        ASSERT_TRUE(db.CreateOrLoad(test_db_path_));
+        EXPECT_TRUE(db.Train());
+
+        auto results = db.Search(CreateDummyVector(dimension_, 60.0f), 3);
+        ASSERT_EQ(results.size(), 3);
+        EXPECT_EQ(results[0].key, 120);
+        // The snapshot keeps the float vectors
+        EXPECT_EQ(db.GetVector(7), CreateDummyVector(dimension_, 3.5f));
+    }
+    RemoveSnapshotFiles();
+}
+
+TEST_F(VectorDbTest, BinaryFirstPass) {
+    tgdb::FaissVectorDbService db(dimension_, faiss::METRIC_L2,
+                                  {.binary_candidates = 100});
+    std::mt19937 rng(7);
+    std::normal_distribution<float> normal;
+    std::vector<std::vector<float>> vectors(500, std::vector<float>(dimension_));
+    for (size_t i = 0; i < vectors.size(); ++i) {
+        for (auto &value : vectors[i]) {
+            value = normal(rng);
+        }
+        ASSERT_TRUE(db.AddVector(i, vectors[i]));
+    }
+    // Checkpointed vectors get their sign codes
+    EXPECT_TRUE(db.Train());
+    ASSERT_TRUE(db.RemoveVector(3));
+
+    for (int i = 0; i < 20; ++i) {
+        auto results = db.Search(vectors[i], 2);
+        ASSERT_EQ(results.size(), 2);
+        if (i == 3) {
+            EXPECT_NE(results[0].key, 3);
+            EXPECT_NE(results[1].key, 3);
+        } else {
+            EXPECT_EQ(results[0].key, i);
+            EXPECT_FLOAT_EQ(results[0].score, 0.0f);
+            EXPECT_LE(results[0].score, results[1].score);
+        }
+    }
+
+    // Types searched through an index never get sign codes
+    RemoveSnapshotFiles();
+    {
+        tgdb::FaissVectorDbService hnsw(
+            dimension_, faiss::METRIC_L2,
+            {.type = "hnsw", .binary_candidates = 100});
+        ASSERT_TRUE(hnsw.CreateOrLoad(test_db_path_));
+        for (size_t i = 0; i < 50; ++i) {
+            ASSERT_TRUE(hnsw.AddVector(i, vectors[i]));
+        }
+        ASSERT_TRUE(hnsw.Checkpoint(true));
+        EXPECT_TRUE(std::filesystem::exists(test_db_path_ + ".2.faissidx"));
+        EXPECT_FALSE(std::filesystem::exists(test_db_path_ + ".2.bits"));
+        EXPECT_EQ(hnsw.Search(vectors[5], 1).at(0).key, 5);
+    }
+    RemoveSnapshotFiles();
+}
+
+TEST_F(VectorDbTest, IvfTrainsOnceEnoughVectors) {
+    tgdb::FaissVectorDbService ivf(
+        dimension_, faiss::METRIC_L2,
+        {.type = "ivf_flat", .nlist = 2, .nprobe = 2, .min_train_vectors = 100});
+    for (int i = 0; i < 99; ++i) {
+        ASSERT_TRUE(ivf.AddVector(i,
+                                  CreateDummyVector(dimension_, i)));
+    }
+    EXPECT_FALSE(ivf.Train());
+
+    ASSERT_TRUE(ivf.AddVector(99, CreateDummyVector(dimension_, 99.0f)));
+    EXPECT_TRUE(ivf.Train());
+
+    // Searching every list is exact
+    auto results = ivf.Search(CreateDummyVector(dimension_, 42.0f), 1);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_EQ(results[0].key, 42);
+    EXPECT_EQ(ivf.GetVector(7), CreateDummyVector(dimension_, 7.0f));
+}
+
+TEST_F(VectorDbTest, ModalitiesSplitSharedIndex) {
+    RemoveSnapshotFiles();
+    {
+        tgdb::FaissVectorDbService shared(dimension_);
+        ASSERT_TRUE(shared.CreateOrLoad(test_db_path_));
+    }
+    // Records of a log written while keys were strings
+    {
+        std::ofstream wal(test_db_path_ + ".wal", std::ios::binary | std::ios::app);
+        auto append = [&](const std::string &key, faiss::idx_t id, float start,
+                          int64_t chat_id) {
+            uint8_t op = 3;
+            auto key_len = static_cast<uint32_t>(key.size());
+            auto vector = CreateDummyVector(dimension_, start);
+            tgdb::VectorAttributes attributes{.chat_id = chat_id};
+            wal.write(reinterpret_cast<const char *>(&op), sizeof(op));
+            wal.write(reinterpret_cast<const char *>(&id), sizeof(id));
+            wal.write(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
+            wal.write(key.data(), key.size());
+            wal.write(reinterpret_cast<const char *>(vector.data()),
+                      vector.size() * sizeof(float));
+            wal.write(reinterpret_cast<const char *>(&attributes.chat_id), 8);
+            wal.write(reinterpret_cast<const char *>(&attributes.sender_id), 8);
+            wal.write(reinterpret_cast<const char *>(&attributes.send_time), 8);
+            wal.write(reinterpret_cast<const char *>(&attributes.content_kinds), 4);
+        };
+        append("1:type-0", 0, 1.0f, 7);
+        append("1:type-1", 1, 2.0f, 0);
+        append("2:type-0", 2, 3.0f, 0);
+        append("unknown", 3, 4.0f, 0);
+    }
+
+    // The shared index is read with the modality in the low byte of its keys
+    auto open_shared = [&] {
+        tgdb::FaissIndexOptions options{
+            .legacy_key = [](std::string_view key) -> std::optional<tgdb::VectorKey> {
+                auto suffix = key.find(":type-");
+                if (suffix == std::string_view::npos) {
+                    return std::nullopt;
+                }
+                return std::stoull(std::string(key.substr(0, suffix))) << 8 |
+                       std::stoull(std::string(key.substr(suffix + 6)));
+            }};
+        return std::make_unique<tgdb::FaissVectorDbService>(
+            dimension_, faiss::METRIC_L2, options);
+    };
+    tgdb::ModalVectorDb modal({"text", "image"}, [&] {
+        return std::make_unique<tgdb::FaissVectorDbService>(dimension_);
+    });
+    ASSERT_TRUE(modal.CreateOrLoad(test_db_path_));
+    ASSERT_TRUE(modal.Migrate(test_db_path_, open_shared, [](tgdb::VectorKey key) {
+        return std::optional<std::pair<size_t, tgdb::VectorKey>>{{key & 0xff, key >> 8}};
+    }));
+    EXPECT_FALSE(std::filesystem::exists(test_db_path_ + ".meta"));
+    EXPECT_EQ(modal[0].GetVector(1), CreateDummyVector(dimension_, 1.0f));
+    EXPECT_EQ(modal[1].GetVector(1), CreateDummyVector(dimension_, 2.0f));
+    EXPECT_FALSE(modal[1].Exists(2));
+
+    // Each modality only returns its own vectors, attributes moved with them
+    auto text = modal[0].Search(CreateDummyVector(dimension_, 2.0f), 5);
+    ASSERT_EQ(text.size(), 2);
+    auto filtered = modal[0].Search(CreateDummyVector(dimension_, 2.0f), 5,
+                                    {.chat_id = 7});
+    ASSERT_EQ(filtered.size(), 1);
+    EXPECT_EQ(filtered[0].key, 1);
+
+    // A message found in both modalities is returned once, with its closest
+    // score
+    auto image = modal[1].Search(CreateDummyVector(dimension_, 2.0f), 5);
+    auto merged = modal.Merge({text, image}, 5);
+    ASSERT_EQ(merged.size(), 2);
+    EXPECT_EQ(merged[0].key, 1);
+    EXPECT_FLOAT_EQ(merged[0].score, 0.0f);
+    EXPECT_EQ(merged[1].key, 2);
+
+    ASSERT_TRUE(modal.RemoveVector(1));
+    EXPECT_FALSE(modal.Exists(1));
+    RemoveSnapshotFiles();
+}
+
+TEST_F(VectorDbTest, IdTableMatchesReference) {
+    kvdb::id_table<uint64_t> table;
+    std::unordered_map<uint64_t, uint64_t> reference;
+    std::mt19937_64 rng(3);
+    // Few distinct ids, so erases often shift probe chains back
+    for (int i = 0; i < 20000; ++i) {
+        uint64_t id = (rng() % 512) << 20;
+        if (rng() % 3 == 0) {
+            EXPECT_EQ(table.erase(id), reference.erase(id) == 1);
+        } else {
+            EXPECT_EQ(table.insert_or_assign(id, i), !reference.contains(id));
+            reference[id] = i;
+        }
+    }
+    ASSERT_EQ(table.size(), reference.size());
+    for (uint64_t id = 0; id < 512; ++id) {
+        auto it = reference.find(id << 20);
+        auto *value = table.find(id << 20);
+        ASSERT_EQ(value != nullptr, it != reference.end());
+        if (value) {
+            EXPECT_EQ(*value, it->second);
+        }
+    }
+}
+
 
 
 
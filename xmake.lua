@@ -6,7 +6,8 @@ includes("dependencies/yalantinglibs.lua")
 
 option("test", {default = false})
 
-add_requires("tdlib", "faiss", "rocksdb", "yalantinglibs", "reflect-cpp", "utfcpp")
+add_requires("tdlib", "faiss", "yalantinglibs", "reflect-cpp", "utfcpp")
+add_requires("rocksdb", {configs = {zstd = true}})
 if has_config("test") then
     add_requires("gtest", "benchmark")
 end